@@ -0,0 +1,14 @@
+# Color calibration of the lamps of a chain, load it with FN_CALIBRATION=<file>
+#
+# There are 5 fields:
+# address	lamp address (0-254), * for all other lamps and broadcasts
+# gamma		exponent of the intensity curve (1.0 is linear)
+# red		gain of the red channel (0.0-1.0)
+# green		gain of the green channel (0.0-1.0)
+# blue		gain of the blue channel (0.0-1.0)
+#
+# The gains scale each LED down to the white point of the dimmest lamp.
+# Color broadcasts are followed by a frame to every lamp with a row of its own.
+
+*	2.2	1.0	1.0	1.0
+3	2.2	1.0	0.92	0.85
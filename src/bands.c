@@ -0,0 +1,155 @@
+/**
+ * fnordlicht C library - spectrum bands
+ *
+ * sums a power spectrum into log spaced bands, one per lamp,
+ * weighted by the 50 phon equal loudness contour (ISO 226:2003)
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "libfn.h"
+
+/* sound pressure level (dB) which sounds as loud as 50 dB at 1 kHz,
+ * from the parameters of ISO 226:2003 table 1 */
+static const struct {
+	double freq, spl;
+} fn_iso226_50phon[] = {
+	{    20, 104.7 }, {    25,  99.1 }, {  31.5,  93.7 }, {    40,  88.5 }, {    50,  84.0 },
+	{    63,  79.6 }, {    80,  75.4 }, {   100,  71.6 }, {   125,  68.2 }, {   160,  64.7 },
+	{   200,  61.7 }, {   250,  59.0 }, {   315,  56.5 }, {   400,  54.3 }, {   500,  52.6 },
+	{   630,  51.1 }, {   800,  50.0 }, {  1000,  50.0 }, {  1250,  52.0 }, {  1600,  52.9 },
+	{  2000,  49.6 }, {  2500,  46.9 }, {  3150,  46.1 }, {  4000,  47.1 }, {  5000,  50.5 },
+	{  6300,  56.1 }, {  8000,  61.8 }, { 10000,  63.8 }, { 12500,  60.1 }
+};
+
+#define FN_ISO226_POINTS (sizeof(fn_iso226_50phon) / sizeof(fn_iso226_50phon[0]))
+
+/* power gain which makes a tone as loud as one at 1 kHz */
+double fn_loudness_gain(double freq) {
+	double spl;
+	int i;
+
+	if (freq <= fn_iso226_50phon[0].freq) {
+		spl = fn_iso226_50phon[0].spl;
+	}
+	else if (freq >= fn_iso226_50phon[FN_ISO226_POINTS - 1].freq) {
+		spl = fn_iso226_50phon[FN_ISO226_POINTS - 1].spl;
+	}
+	else {
+		for (i = 1; fn_iso226_50phon[i].freq < freq; i++);
+
+		/* linear in log frequency */
+		double x = log(freq / fn_iso226_50phon[i - 1].freq) / log(fn_iso226_50phon[i].freq / fn_iso226_50phon[i - 1].freq);
+		spl = fn_iso226_50phon[i - 1].spl + x * (fn_iso226_50phon[i].spl - fn_iso226_50phon[i - 1].spl);
+	}
+
+	return pow(10, (50 - spl) / 10);
+}
+
+/* 'gain' scales the power spectrum, e.g. to make a full scale sine come out as 1 */
+int fn_bands_init(struct fn_bands *b, int count, int window, int rate, double min_freq, double max_freq, double gain) {
+	double df = (double) rate / window;
+	int i, k, n = 0;
+
+	memset(b, 0, sizeof(struct fn_bands));
+
+	if (count < 1 || window < 2 || gain <= 0 || min_freq <= 0 || max_freq <= min_freq || max_freq > rate / 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	b->count = count;
+	b->bins = window / 2 + 1;
+	b->attack = b->release = 1; /* no smoothing */
+
+	/* a bin belongs to at most two bands, plus one per band narrower than a bin */
+	int entries = (max_freq - min_freq) / df + 2 * count + 2;
+
+	b->offset = malloc((count + 1) * sizeof(int));
+	b->bin = malloc(entries * sizeof(int));
+	b->weight = malloc(entries * sizeof(float));
+	b->power = malloc(b->bins * sizeof(float));
+	b->energy = calloc(count, sizeof(float));
+
+	if (!b->offset || !b->bin || !b->weight || !b->power || !b->energy) {
+		fn_bands_free(b);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		double lo = min_freq * pow(max_freq / min_freq, (double) i / count);
+		double hi = min_freq * pow(max_freq / min_freq, (double) (i + 1) / count);
+
+		b->offset[i] = n;
+
+		/* the share of every bin (df wide, centered on k * df) within the band */
+		for (k = floor(lo / df + 0.5); k <= floor(hi / df + 0.5) && k < b->bins; k++) {
+			double overlap = fmin(hi, (k + 0.5) * df) - fmax(lo, (k - 0.5) * df);
+
+			if (overlap > 0 && n < entries) {
+				b->bin[n] = k;
+				b->weight[n] = overlap / df * fn_loudness_gain(k * df) * gain;
+				n++;
+			}
+		}
+	}
+
+	b->offset[count] = n;
+	b->bins = (n > 0) ? b->bin[n - 1] + 1 : 0; /* nothing above max_freq is needed */
+
+	return 0;
+}
+
+void fn_bands_free(struct fn_bands *b) {
+	free(b->offset);
+	free(b->bin);
+	free(b->weight);
+	free(b->power);
+	free(b->energy);
+}
+
+/* time constants (s) of rising and falling energies, 'interval' between two updates */
+void fn_bands_smoothing(struct fn_bands *b, double interval, double attack, double release) {
+	b->attack = (attack > 0) ? 1 - exp(-interval / attack) : 1;
+	b->release = (release > 0) ? 1 - exp(-interval / release) : 1;
+}
+
+/* 'spectrum': interleaved complex numbers (re, im) as FFTW returns them, at least b->bins */
+void fn_bands_update(struct fn_bands *b, const double *spectrum) {
+	int i, j;
+
+	fn_power_spectrum(b->power, spectrum, b->bins);
+
+	for (i = 0; i < b->count; i++) {
+		float e = 0, *s = &b->energy[i];
+
+		for (j = b->offset[i]; j < b->offset[i + 1]; j++) {
+			e += b->weight[j] * b->power[b->bin[j]];
+		}
+
+		*s += ((e > *s) ? b->attack : b->release) * (e - *s);
+	}
+}
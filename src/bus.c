@@ -0,0 +1,513 @@
+/**
+ * fnordlicht C library - asynchronous bus
+ *
+ * owns the serial port and feeds it from a dedicated writer thread,
+ * submissions from any thread go through a lock-free ring
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "libfn.h"
+
+/* ring positions are tickets: a frame submitted at pos gets ticket pos + 1 */
+static int fn_bus_pop(struct fn_bus *bus, struct remote_msg_t *msg) {
+	struct fn_bus_cell *cell = &bus->ring[bus->dequeue % FN_BUS_RING];
+	uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+
+	if (seq != bus->dequeue + 1) {
+		return 0; /* empty or producer still copying */
+	}
+
+	*msg = cell->msg;
+	__atomic_store_n(&cell->seq, bus->dequeue + FN_BUS_RING, __ATOMIC_RELEASE);
+	bus->dequeue++;
+
+	return 1;
+}
+
+static int fn_bus_ring_empty(struct fn_bus *bus) {
+	struct fn_bus_cell *cell = &bus->ring[bus->dequeue % FN_BUS_RING];
+
+	return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != bus->dequeue + 1;
+}
+
+uint32_t fn_bus_submit(struct fn_bus *bus, const struct remote_msg_t *msg) {
+	uint32_t pos = __atomic_load_n(&bus->enqueue, __ATOMIC_RELAXED);
+	struct fn_bus_cell *cell;
+
+	/* claim a cell (bounded MPMC queue after D. Vyukov, used as MPSC) */
+	while (1) {
+		cell = &bus->ring[pos % FN_BUS_RING];
+		int32_t dif = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos;
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&bus->enqueue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (dif < 0) {
+			return 0; /* ring full */
+		}
+		else {
+			pos = __atomic_load_n(&bus->enqueue, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->msg = *msg;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* only wake the writer if it is about to sleep,
+	 * the fence pairs with the one in fn_bus_writer(): one of us sees the other */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&bus->sleeping, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(bus->evfd, &one, sizeof(one)) < 0) { /* counter saturated, writer is awake anyway */ }
+	}
+
+	return pos + 1;
+}
+
+uint32_t fn_bus_submit_frames(struct fn_bus *bus, const struct remote_msg_t *msgs, int count) {
+	uint32_t ticket = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!(ticket = fn_bus_submit(bus, &msgs[i]))) {
+			return 0;
+		}
+	}
+
+	return ticket;
+}
+
+static void fn_bus_wake(struct fn_bus *bus) {
+	uint64_t one = 1;
+	if (write(bus->evfd, &one, sizeof(one)) < 0) { }
+}
+
+static void fn_bus_complete(struct fn_bus *bus) {
+	uint32_t oldest, done;
+
+	/* everything older than the oldest frame still queued has been written or superseded */
+	done = fn_sched_oldest(&bus->sched, &oldest) ? oldest - 1 : bus->dequeue;
+	if (done == bus->done) {
+		return;
+	}
+
+	__atomic_store_n(&bus->done, done, __ATOMIC_SEQ_CST);
+
+	/* a pair, fn_bus_set_notify() may replace it any time */
+	pthread_mutex_lock(&bus->mutex);
+	fn_bus_notify_t notify = bus->notify;
+	void *arg = bus->notify_arg;
+	pthread_mutex_unlock(&bus->mutex);
+
+	if (notify) {
+		notify(bus, done, arg);
+	}
+
+	if (__atomic_load_n(&bus->waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&bus->mutex);
+		pthread_cond_broadcast(&bus->cond);
+		pthread_mutex_unlock(&bus->mutex);
+	}
+}
+
+/* the walk is over: 'count' devices answered */
+static void fn_bus_walked(struct fn_walk *walk, int count) {
+	fn_topology_store(walk->device, count);
+
+	if (count != walk->count && walk->cb) {
+		walk->cb(walk->device, walk->count, count, walk->arg);
+	}
+
+	free(walk);
+}
+
+static void * fn_bus_writer(void *arg) {
+	struct fn_bus *bus = arg;
+	struct remote_msg_t msg, burst[FN_SCHED_SLOTS], calibrated[FN_SCHED_SLOTS];
+	struct epoll_event ev;
+	struct fn_walk *walk = NULL;	/* topology walk in progress */
+	int held = 0, first = 0;	/* frames of the burst which did not fit into the last refill */
+	int armed = 0, pollable = 1;
+	int64_t quiet = 0;	/* end of the last burst on the wire */
+	long wait = 0;
+
+	while (1) {
+		/* apply a new latency budget */
+		long budget = __atomic_exchange_n(&bus->budget, 0, __ATOMIC_ACQ_REL);
+		if (budget) {
+			fn_sched_set_budget(&bus->sched, budget);
+		}
+
+		/* a topology walk takes the probes over until it is done */
+		if (!walk && !bus->probe_due && (walk = __atomic_exchange_n(&bus->verify, NULL, __ATOMIC_ACQ_REL))) {
+			walk->address = 0;
+		}
+
+		/* move submissions into the scheduler, which coalesces them */
+		while (fn_sched_pending(&bus->sched) < FN_SCHED_SLOTS && fn_bus_pop(bus, &msg)) {
+			if (fn_sched_submit_tagged(&bus->sched, &msg, bus->dequeue) < 0) {
+				bus->dropped++;
+			}
+		}
+
+		/* refill the output buffer once it has been written completely */
+		if (bus->outlen == 0) {
+			int64_t now = fn_now();
+			int probe = 0;
+
+			if (!held) {
+				held = fn_sched_take(&bus->sched, burst, &wait);
+				first = 0;
+			}
+
+			/* probes only go out on an idle bus, one at a time */
+			if (held == 0 && !bus->probe_due) {
+				if (!walk) {
+					probe = __atomic_exchange_n(&bus->probe, 0, __ATOMIC_ACQ_REL);
+				}
+				else if (walk->address == 0 || fn_get_int(bus->fd) == 0) {
+					probe = walk->address + 1; /* the last device released the line again */
+				}
+				else if (now > walk->release) {
+					fn_bus_walked(walk, walk->address);
+					walk = NULL;
+				}
+			}
+
+			if (probe) {
+				memset(&burst[0], 0, sizeof(struct remote_msg_t));
+				burst[0].address = probe - 1;
+				burst[0].cmd = REMOTE_CMD_PULL_INT;
+				burst[0].pull_int.delay = 1; /* 50ms */
+				held = 1;
+			}
+
+			/* receivers may have picked up noise on a silent line, but never sync within a batch */
+			int sync = __atomic_exchange_n(&bus->resync, 0, __ATOMIC_ACQ_REL);
+			if (sync || (held > 0 && now - quiet > FN_BUS_IDLE)) {
+				memset(bus->out, REMOTE_SYNC_BYTE, REMOTE_SYNC_LEN);
+				bus->out[REMOTE_SYNC_LEN] = 0; /* address byte */
+				bus->outlen = REMOTE_SYNC_LEN + 1;
+				bus->syncs++;
+				fn_capture(&(struct remote_msg_t) { .address = 0 }, 1, FN_CAPTURE_SYNC | FN_CAPTURE_BUS);
+			}
+
+			if (held > 0) {
+				const struct remote_msg_t *frames = burst + first;
+				int n = held, m;
+
+				/* calibrated broadcasts grow, whatever does not fit goes out next */
+				if ((m = fn_calibrate(calibrated, FN_SCHED_SLOTS, frames, &n))) {
+					frames = calibrated;
+				}
+				else {
+					m = n;
+				}
+
+				first += n;
+				held -= n;
+
+				fn_capture(frames, m, FN_CAPTURE_BUS);
+				bus->outlen += fn_pack_frames(bus->out + bus->outlen, frames, m);
+			}
+			bus->outpos = 0;
+
+			if (bus->outlen > 0) { /* when the line falls silent again */
+				quiet = ((quiet > now) ? quiet : now) + (int64_t) bus->outlen * 10 * 1000000000 / FN_BITRATE;
+			}
+
+			if (probe) { /* sample the line once the device had time to answer */
+				bus->probe_due = quiet + (int64_t) FN_INT_TIMEOUT * 1000000;
+			}
+		}
+
+		if (bus->outlen > 0) {
+			ssize_t q = write(bus->fd, bus->out + bus->outpos, bus->outlen - bus->outpos);
+
+			if (q >= 0) {
+				bus->outpos += q;
+			}
+			else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				bus->error = errno;
+				bus->outpos = bus->outlen; /* drop the burst */
+				__atomic_store_n(&bus->resync, 1, __ATOMIC_RELEASE); /* it may have been cut off within a frame */
+			}
+
+			if (bus->outpos == bus->outlen) {
+				bus->outlen = bus->outpos = 0;
+				if (!held) { /* held frames are out of the scheduler, but not written yet */
+					fn_bus_complete(bus);
+				}
+			}
+		}
+		else {
+			fn_bus_complete(bus);
+		}
+
+		/* a deadline rather than a duration: it stays right while the writer sleeps */
+		__atomic_store_n(&bus->drained, fn_now() + (fn_sched_queued(&bus->sched) +
+			(bus->outlen - bus->outpos + held * REMOTE_MSG_LEN) * 10 * 1000000 / FN_BITRATE) * 1000, __ATOMIC_RELAXED);
+
+		if (!__atomic_load_n(&bus->running, __ATOMIC_ACQUIRE) && bus->outlen == 0 && !held &&
+		    fn_sched_pending(&bus->sched) == 0 && fn_bus_ring_empty(bus)) {
+			break;
+		}
+
+		/* only poll for EPOLLOUT while the kernel buffer is full */
+		if (armed != (bus->outlen > 0)) {
+			armed = (bus->outlen > 0);
+			ev.events = EPOLLOUT;
+			ev.data.fd = bus->fd;
+			pollable = epoll_ctl(bus->epfd, (armed) ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, bus->fd, &ev) == 0;
+		}
+
+		int timeout;
+		if (armed) {
+			timeout = (pollable) ? -1 : 1; /* regular files can't be polled */
+		}
+		else if (held) {
+			timeout = 0; /* the rest of the burst is ready */
+		}
+		else {
+			timeout = (wait > 0) ? (wait + 999) / 1000 : -1;
+		}
+
+		/* the probed device should hold the interrupt line by now */
+		if (bus->probe_due) {
+			int64_t left = bus->probe_due - fn_now();
+
+			if (left <= 0) {
+				int level = fn_get_int(bus->fd);
+
+				if (walk) { /* go on while devices answer, like fn_count_devices() */
+					if (level > 0 && ++walk->address < FN_MAX_DEVICES) {
+						walk->release = fn_now() + (int64_t) FN_INT_RELEASE * 1000000;
+					}
+					else {
+						fn_bus_walked(walk, walk->address);
+						walk = NULL;
+					}
+				}
+				else if (level == 0) {
+					__atomic_store_n(&bus->resync, 1, __ATOMIC_RELEASE);
+				}
+				bus->probe_due = 0;
+				continue;
+			}
+			else if (timeout < 0 || left / 1000000 + 1 < timeout) {
+				timeout = left / 1000000 + 1;
+			}
+		}
+		else if (walk && (timeout < 0 || timeout > FN_BUS_POLL)) {
+			timeout = FN_BUS_POLL; /* until the last device releases the line */
+		}
+
+		__atomic_store_n(&bus->sleeping, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST); /* the store must be visible before we look at the ring */
+		if (fn_bus_ring_empty(bus)) {
+			if (epoll_wait(bus->epfd, &ev, 1, timeout) > 0 && ev.data.fd == bus->evfd) {
+				uint64_t cnt;
+				if (read(bus->evfd, &cnt, sizeof(cnt)) < 0) { }
+			}
+		}
+		__atomic_store_n(&bus->sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+
+	free(walk); /* abandoned */
+
+	return NULL;
+}
+
+struct fn_bus * fn_bus_attach(int fd) {
+	struct fn_bus *bus = calloc(1, sizeof(struct fn_bus));
+	struct epoll_event ev;
+	int i;
+
+	if (!bus) {
+		return NULL;
+	}
+
+	bus->fd = fd;
+	bus->running = 1;
+	fn_sched_init(&bus->sched, fd);
+
+	for (i = 0; i < FN_BUS_RING; i++) {
+		bus->ring[i].seq = i;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	pthread_mutex_init(&bus->mutex, NULL);
+	pthread_cond_init(&bus->cond, NULL);
+
+	bus->epfd = epoll_create(2);
+	bus->evfd = eventfd(0, EFD_NONBLOCK);
+
+	ev.events = EPOLLIN;
+	ev.data.fd = bus->evfd;
+
+	if (bus->epfd < 0 || bus->evfd < 0 || epoll_ctl(bus->epfd, EPOLL_CTL_ADD, bus->evfd, &ev) ||
+	    pthread_create(&bus->thread, NULL, fn_bus_writer, bus)) {
+		if (bus->epfd >= 0) close(bus->epfd);
+		if (bus->evfd >= 0) close(bus->evfd);
+		free(bus);
+		return NULL;
+	}
+
+	return bus;
+}
+
+struct fn_bus * fn_bus_open(const char *device) {
+	struct termios oldtio;
+	struct fn_bus *bus;
+	int fd = open(device, O_RDWR | O_NOCTTY);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	oldtio = fn_init(fd);
+
+	if (!(bus = fn_bus_attach(fd))) {
+		tcsetattr(fd, TCSANOW, &oldtio);
+		close(fd);
+		return NULL;
+	}
+
+	bus->oldtio = oldtio;
+	bus->owned = 1;
+
+	return bus;
+}
+
+void fn_bus_close(struct fn_bus *bus) {
+	/* the writer flushes everything queued before it leaves */
+	__atomic_store_n(&bus->running, 0, __ATOMIC_RELEASE);
+	fn_bus_wake(bus);
+	pthread_join(bus->thread, NULL);
+
+	close(bus->epfd);
+	close(bus->evfd);
+	free(bus->verify);
+
+	pthread_cond_destroy(&bus->cond);
+	pthread_mutex_destroy(&bus->mutex);
+
+	fcntl(bus->fd, F_SETFL, fcntl(bus->fd, F_GETFL) & ~O_NONBLOCK);
+
+	if (bus->owned) {
+		tcsetattr(bus->fd, TCSANOW, &bus->oldtio);
+		close(bus->fd);
+	}
+
+	free(bus);
+}
+
+int fn_bus_fd(struct fn_bus *bus) {
+	return bus->fd;
+}
+
+int fn_bus_error(struct fn_bus *bus) {
+	return __atomic_exchange_n(&bus->error, 0, __ATOMIC_ACQ_REL);
+}
+
+void fn_bus_sync(struct fn_bus *bus) {
+	__atomic_store_n(&bus->resync, 1, __ATOMIC_RELEASE);
+	fn_bus_wake(bus);
+}
+
+void fn_bus_probe(struct fn_bus *bus, uint8_t address) {
+	__atomic_store_n(&bus->probe, address + 1, __ATOMIC_RELEASE);
+	fn_bus_wake(bus);
+}
+
+/* count the devices between other traffic and cache the result,
+ * 'cb' is called from the writer thread if there are not 'count' */
+int fn_bus_verify(struct fn_bus *bus, const char *device, int count, fn_topology_cb_t cb, void *arg) {
+	struct fn_walk *walk = malloc(sizeof(struct fn_walk) + strlen(device) + 1);
+
+	if (!walk) {
+		return -1;
+	}
+
+	walk->count = count;
+	walk->cb = cb;
+	walk->arg = arg;
+	strcpy(walk->device, device);
+
+	free(__atomic_exchange_n(&bus->verify, walk, __ATOMIC_ACQ_REL)); /* one which has not started yet */
+	fn_bus_wake(bus);
+
+	return 0;
+}
+
+void fn_bus_set_notify(struct fn_bus *bus, fn_bus_notify_t cb, void *arg) {
+	pthread_mutex_lock(&bus->mutex);
+	bus->notify_arg = arg;
+	bus->notify = cb;
+	pthread_mutex_unlock(&bus->mutex);
+}
+
+long fn_bus_queued(struct fn_bus *bus) {
+	int64_t left = __atomic_load_n(&bus->drained, __ATOMIC_RELAXED) - fn_now();
+
+	return (left > 0) ? left / 1000 : 0;
+}
+
+void fn_bus_set_budget(struct fn_bus *bus, long usec) {
+	__atomic_store_n(&bus->budget, usec, __ATOMIC_RELEASE);
+	fn_bus_wake(bus);
+}
+
+int fn_bus_wait(struct fn_bus *bus, uint32_t ticket, int timeout) {
+	struct timespec deadline;
+	int ret = 1;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&bus->mutex);
+	__atomic_add_fetch(&bus->waiters, 1, __ATOMIC_SEQ_CST);
+	while ((int32_t) (__atomic_load_n(&bus->done, __ATOMIC_SEQ_CST) - ticket) < 0) {
+		if (pthread_cond_timedwait(&bus->cond, &bus->mutex, &deadline)) {
+			ret = 0; /* timeout */
+			break;
+		}
+	}
+	__atomic_sub_fetch(&bus->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&bus->mutex);
+
+	return ret;
+}
@@ -0,0 +1,246 @@
+/**
+ * fnordlicht C library - persistent cache
+ *
+ * remembers the bus topology between runs, whoever
+ * writes to the bus verifies it once it is running
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libfn.h"
+
+#define FN_TOPOLOGY_FILE "topology"
+#define FN_EEPROM_FILE "eeprom"
+
+/* empty variables count as unset, relative ones are invalid (as the XDG spec says) */
+static const char * fn_cache_env(const char *name) {
+	const char *value = getenv(name);
+
+	return (value && *value == '/') ? value : NULL;
+}
+
+int fn_cache_path(char *path, size_t len, const char *name) {
+	const char *dir = getenv("FN_CACHE_DIR");
+	const char *base;
+
+	if (dir && *dir) {
+		if (*dir != '/') {
+			errno = EINVAL;
+			return -1;
+		}
+
+		snprintf(path, len, "%s", dir);
+	}
+	else if ((base = fn_cache_env("XDG_CACHE_HOME"))) {
+		snprintf(path, len, "%s/libfn", base);
+	}
+	else if ((base = fn_cache_env("HOME"))) {
+		snprintf(path, len, "%s/.cache/libfn", base);
+	}
+	else {
+		return -1;
+	}
+
+	/* create the cache directory and its parents on demand */
+	char *sep;
+	for (sep = strchr(path + 1, '/'); sep; sep = strchr(sep + 1, '/')) {
+		*sep = '\0';
+		mkdir(path, 0755);
+		*sep = '/';
+	}
+	mkdir(path, 0755);
+
+	size_t p = strlen(path);
+	if (snprintf(path + p, len - p, "/%s", name) >= len - p) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* key devices by their canonical path, /dev/serial/by-id links resolve to the same tty */
+static void fn_topology_key(char *key, const char *device) {
+	if (!realpath(device, key)) {
+		snprintf(key, PATH_MAX, "%s", device);
+	}
+}
+
+int fn_topology_load(const char *device) {
+	char path[PATH_MAX], key[PATH_MAX], row[PATH_MAX+32];
+	int count = -1;
+	FILE *f;
+
+	if (fn_cache_path(path, sizeof(path), FN_TOPOLOGY_FILE) || !(f = fopen(path, "r"))) {
+		return -1;
+	}
+
+	fn_topology_key(key, device);
+	while (fgets(row, sizeof(row), f)) {
+		char *sp = strrchr(row, ' ');
+
+		if (sp && (size_t) (sp - row) == strlen(key) && strncmp(row, key, sp - row) == 0) {
+			count = atoi(sp + 1);
+		}
+	}
+
+	fclose(f);
+
+	return (count >= 0 && count <= FN_MAX_DEVICES) ? count : -1;
+}
+
+int fn_topology_store(const char *device, int count) {
+	char path[PATH_MAX], tmp[PATH_MAX+4], key[PATH_MAX], row[PATH_MAX+32];
+	FILE *in, *out;
+
+	if (fn_cache_path(path, sizeof(path), FN_TOPOLOGY_FILE)) {
+		return -1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	if (!(out = fopen(tmp, "w"))) {
+		return -1;
+	}
+
+	/* keep the entries of other devices */
+	fn_topology_key(key, device);
+	if ((in = fopen(path, "r"))) {
+		while (fgets(row, sizeof(row), in)) {
+			char *sp = strrchr(row, ' ');
+
+			if (sp && !((size_t) (sp - row) == strlen(key) && strncmp(row, key, sp - row) == 0)) {
+				fputs(row, out);
+			}
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s %d\n", key, count);
+
+	if (fclose(out) || rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* one file per device: eeprom-_dev_ttyUSB0 */
+static int fn_eeprom_path(char *path, size_t len, const char *device) {
+	char key[PATH_MAX], name[PATH_MAX+16], *p;
+
+	fn_topology_key(key, device);
+	for (p = key; *p; p++) {
+		if (*p == '/') *p = '_';
+	}
+
+	snprintf(name, sizeof(name), "%s-%s", FN_EEPROM_FILE, key);
+
+	return fn_cache_path(path, len, name);
+}
+
+int fn_eeprom_load(struct fn_eeprom *ee, const char *device) {
+	char path[PATH_MAX];
+
+	fn_eeprom_init(ee);
+	if (fn_eeprom_path(path, sizeof(path), device)) {
+		return -1;
+	}
+
+	/* nothing written yet */
+	if (access(path, F_OK)) {
+		return 0;
+	}
+
+	return fn_eeprom_parse(ee, path, 0);
+}
+
+int fn_eeprom_store(const struct fn_eeprom *ee, const char *device) {
+	char path[PATH_MAX], tmp[PATH_MAX+16];
+	int a, slot;
+	FILE *out;
+
+	if (fn_eeprom_path(path, sizeof(path), device)) {
+		return -1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	if (!(out = fopen(tmp, "w"))) {
+		return -1;
+	}
+
+	/* in the format of share/replay.eeprom */
+	fprintf(out, "# last written EEPROM contents of %s\n", device);
+	for (a = 0; a <= FN_MAX_DEVICES; a++) {
+		for (slot = 0; slot < CONFIG_EEPROM_COLORS; slot++) {
+			if (fn_mask_test(&ee->known[slot], a)) {
+				const struct remote_msg_save_rgb_t *s = &ee->slots[a][slot];
+
+				fprintf(out, "%d;%d;%02x%02x%02x;%u;%u;%u\n", a, slot,
+					s->color.red, s->color.green, s->color.blue, s->step, s->delay, s->pause);
+			}
+		}
+	}
+
+	if (fclose(out) || rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the count of the last walk, walks once if there is none yet,
+ * 'cached' tells if it should be verified by the writer of 'fd' */
+int fn_count_devices_cached(int fd, const char *device, int *cached) {
+	int count = fn_topology_load(device);
+
+	if (cached) {
+		*cached = (count >= 0);
+	}
+
+	if (count < 0) { /* cache miss: we have to walk the bus once */
+		count = fn_count_devices(fd);
+		fn_topology_store(device, count);
+	}
+
+	return count;
+}
+
+/* walks the bus right away: only from the thread which writes to 'fd', see fn_bus_verify() */
+int fn_topology_verify(int fd, const char *device, int count, fn_topology_cb_t cb, void *arg) {
+	int found = fn_count_devices(fd);
+
+	fn_topology_store(device, found);
+
+	if (found != count && cb) {
+		cb(device, count, found, arg);
+	}
+
+	return found;
+}
@@ -0,0 +1,200 @@
+/**
+ * fnordlicht C library - color calibration
+ *
+ * per lamp lookup tables which correct gamma and white point
+ * of the colors right before they go onto the wire
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "libfn.h"
+
+/* one table per channel and address, broadcasts use the '*' row */
+struct fn_calibration {
+	uint8_t lut[256][3][256];
+	uint8_t own[FN_MAX_DEVICES+1];	/* addresses whose tables differ from the '*' row */
+	int owners;
+};
+
+static struct fn_calibration *fn_calibration;
+static pthread_once_t fn_calibration_once = PTHREAD_ONCE_INIT;
+
+static void fn_calibration_env() {
+	const char *path = getenv("FN_CALIBRATION");
+
+	if (path && *path && fn_calibration_open(path) < 0) {
+		perror(path);
+	}
+}
+
+static void fn_calibration_table(uint8_t *lut, double gamma, double gain) {
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		lut[i] = 255 * gain * pow(i / 255.0, gamma) + 0.5;
+	}
+}
+
+/* "address gamma red green blue" rows, the gains scale each channel to the common white point */
+int fn_calibration_open(const char *path) {
+	double params[256][4];
+	uint8_t set[256] = { 0 };
+	double def[4] = { 1, 1, 1, 1 };
+	char row[1024];
+	int a, c, line = 0;
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		return -1;
+	}
+
+	while (fgets(row, sizeof(row), f)) {
+		char address[16];
+		double p[4];
+		char *q = row + strspn(row, " \t");
+
+		line++;
+		if (*q == '#' || *q == '\n' || *q == '\r' || *q == '\0') {
+			continue; /* comments and empty rows */
+		}
+
+		if (sscanf(q, "%15s %lf %lf %lf %lf", address, &p[0], &p[1], &p[2], &p[3]) != 5 ||
+		    p[0] <= 0 || p[1] < 0 || p[1] > 1 || p[2] < 0 || p[2] > 1 || p[3] < 0 || p[3] > 1) {
+			goto invalid;
+		}
+
+		if (strcmp(address, "*") == 0) {
+			memcpy(def, p, sizeof(def));
+		}
+		else {
+			char *end;
+			long addr = strtol(address, &end, 0);
+
+			if (*end || addr < 0 || addr > FN_MAX_DEVICES) {
+				goto invalid;
+			}
+
+			memcpy(params[addr], p, sizeof(p));
+			set[addr] = 1;
+		}
+	}
+
+	fclose(f);
+
+	struct fn_calibration *cal = malloc(sizeof(struct fn_calibration));
+	if (!cal) {
+		return -1;
+	}
+
+	for (a = 0; a < 256; a++) {
+		const double *p = (set[a]) ? params[a] : def;
+
+		for (c = 0; c < 3; c++) {
+			fn_calibration_table(cal->lut[a][c], p[0], p[1 + c]);
+		}
+	}
+
+	/* these lamps need a frame of their own after every color broadcast */
+	cal->owners = 0;
+	for (a = 0; a <= FN_MAX_DEVICES; a++) {
+		if (set[a] && memcmp(cal->lut[a], cal->lut[REMOTE_ADDR_BROADCAST], sizeof(cal->lut[a]))) {
+			cal->own[cal->owners++] = a;
+		}
+	}
+
+	/* the tables of an earlier profile are not freed: a bus writer may still look at them */
+	__atomic_store_n(&fn_calibration, cal, __ATOMIC_RELEASE);
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s:%d: invalid row\n", path, line);
+	fclose(f);
+	errno = EINVAL;
+	return -1;
+}
+
+/* only call this while no frames are being sent */
+void fn_calibration_close() {
+	pthread_once(&fn_calibration_once, fn_calibration_env);
+	free(__atomic_exchange_n(&fn_calibration, NULL, __ATOMIC_ACQ_REL));
+}
+
+static int fn_calibration_color(const struct remote_msg_t *msg) {
+	return msg->cmd == REMOTE_CMD_FADE_RGB || msg->cmd == REMOTE_CMD_SAVE_RGB;
+}
+
+static void fn_calibration_apply(const struct fn_calibration *cal, struct remote_msg_t *out, const struct remote_msg_t *in, uint8_t address) {
+	const uint8_t (*lut)[256] = cal->lut[address];
+	struct rgb_color_t *color = NULL;
+
+	*out = *in;
+	out->address = address;
+
+	switch (in->cmd) {
+		case REMOTE_CMD_FADE_RGB: color = &out->fade_rgb.color; break;
+		case REMOTE_CMD_SAVE_RGB: color = &out->save_rgb.color; break;
+	}
+
+	if (color) {
+		color->red = lut[0][color->red];
+		color->green = lut[1][color->green];
+		color->blue = lut[2][color->blue];
+	}
+}
+
+/* calibrates as many of the '*count' frames of 'in' as fit into the 'size' frames of 'out',
+ * a color broadcast is followed by unicasts to the lamps with a row of their own.
+ * '*count' is set to the frames taken, returns the frames written or 0 without a profile.
+ * 'size' must be at least FN_CALIBRATION_FANOUT */
+int fn_calibrate(struct remote_msg_t *out, int size, const struct remote_msg_t *in, int *count) {
+	const struct fn_calibration *cal;
+	int i, j, n = 0;
+
+	pthread_once(&fn_calibration_once, fn_calibration_env);
+
+	if (!(cal = __atomic_load_n(&fn_calibration, __ATOMIC_ACQUIRE))) {
+		return 0;
+	}
+
+	for (i = 0; i < *count; i++) {
+		int extra = (in[i].address == REMOTE_ADDR_BROADCAST && fn_calibration_color(&in[i])) ? cal->owners : 0;
+
+		if (n + 1 + extra > size) {
+			break; /* never split a broadcast from its unicasts */
+		}
+
+		fn_calibration_apply(cal, &out[n++], &in[i], in[i].address);
+		for (j = 0; j < extra; j++) {
+			fn_calibration_apply(cal, &out[n++], &in[i], cal->own[j]);
+		}
+	}
+
+	*count = i;
+
+	return n;
+}
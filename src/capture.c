@@ -0,0 +1,361 @@
+/**
+ * fnordlicht C library - traffic capture
+ *
+ * tees outgoing frames into an append-only file of fixed
+ * size records and decodes them symbolically
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libfn.h"
+
+#define FN_CAPTURE_CHUNK 64
+
+static int fn_capture_fd = -1;
+static pthread_once_t fn_capture_once = PTHREAD_ONCE_INIT;
+
+static void fn_capture_env() {
+	const char *path = getenv("FN_CAPTURE");
+
+	if (path && *path && fn_capture_open(path) < 0) {
+		perror(path);
+	}
+}
+
+int fn_capture_open(const char *path) {
+	struct fn_capture_header hdr;
+	struct stat st;
+	int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+	if (fd < 0 || fstat(fd, &st)) {
+		goto fail;
+	}
+
+	if (st.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, FN_CAPTURE_MAGIC, sizeof(hdr.magic));
+		hdr.record_size = sizeof(struct fn_capture_record);
+		hdr.created = (int64_t) time(NULL) * 1000000000;
+
+		if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+			goto fail;
+		}
+	}
+	else {
+		if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		    memcmp(hdr.magic, FN_CAPTURE_MAGIC, sizeof(hdr.magic)) ||
+		    hdr.record_size != sizeof(struct fn_capture_record)) {
+			errno = EINVAL;
+			goto fail;
+		}
+
+		/* cut off a record torn by a crash, we'd lose alignment otherwise */
+		off_t tail = (st.st_size - sizeof(hdr)) % sizeof(struct fn_capture_record);
+		if (tail && ftruncate(fd, st.st_size - tail)) {
+			goto fail;
+		}
+	}
+
+	int old = __atomic_exchange_n(&fn_capture_fd, fd, __ATOMIC_ACQ_REL);
+	if (old >= 0) {
+		close(old);
+	}
+
+	return 0;
+
+fail:
+	if (fd >= 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+
+	return -1;
+}
+
+void fn_capture_close() {
+	int fd = __atomic_exchange_n(&fn_capture_fd, -1, __ATOMIC_ACQ_REL);
+
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+void fn_capture(const struct remote_msg_t *msgs, int count, int flags) {
+	struct fn_capture_record recs[FN_CAPTURE_CHUNK];
+	int i, n, fd;
+
+	pthread_once(&fn_capture_once, fn_capture_env);
+
+	if ((fd = __atomic_load_n(&fn_capture_fd, __ATOMIC_ACQUIRE)) < 0) {
+		return;
+	}
+
+	int64_t now = fn_now();
+
+	for (; count > 0; count -= n, msgs += n) {
+		n = (count < FN_CAPTURE_CHUNK) ? count : FN_CAPTURE_CHUNK;
+
+		for (i = 0; i < n; i++) {
+			recs[i].time = now;
+			recs[i].flags = flags;
+			memcpy(recs[i].frame, &msgs[i], REMOTE_MSG_LEN);
+		}
+
+		/* O_APPEND keeps records of concurrent writers whole; a lost record must never stop the show */
+		if (write(fd, recs, n * sizeof(struct fn_capture_record)) < 0) { }
+	}
+}
+
+void fn_capture_sync(uint8_t address) {
+	struct remote_msg_t msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.address = address;
+
+	fn_capture(&msg, 1, FN_CAPTURE_SYNC);
+}
+
+int fn_capture_map(struct fn_capture *cap, const char *path) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	memset(cap, 0, sizeof(struct fn_capture));
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (fstat(fd, &st) || st.st_size < sizeof(struct fn_capture_header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	cap->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (cap->base == MAP_FAILED) {
+		cap->base = NULL;
+		return -1;
+	}
+
+	cap->size = st.st_size;
+	cap->header = cap->base;
+	cap->records = (const struct fn_capture_record *) (cap->header + 1);
+	cap->count = (st.st_size - sizeof(struct fn_capture_header)) / sizeof(struct fn_capture_record);
+
+	if (memcmp(cap->header->magic, FN_CAPTURE_MAGIC, sizeof(cap->header->magic)) ||
+	    cap->header->record_size != sizeof(struct fn_capture_record)) {
+		fn_capture_unmap(cap);
+		errno = EINVAL;
+		return -1;
+	}
+
+	madvise(cap->base, cap->size, MADV_SEQUENTIAL);
+
+	return 0;
+}
+
+void fn_capture_unmap(struct fn_capture *cap) {
+	if (cap->base) {
+		munmap(cap->base, cap->size);
+	}
+
+	memset(cap, 0, sizeof(struct fn_capture));
+}
+
+void fn_capture_frame(const struct fn_capture_record *rec, struct remote_msg_t *msg) {
+	memset(msg, 0, sizeof(struct remote_msg_t));
+	memcpy(msg, rec->frame, REMOTE_MSG_LEN);
+}
+
+static const char * fn_program_name(uint8_t script) {
+	switch (script) {
+		case 0: return "colorwheel";
+		case 1: return "random";
+		case 2: return "replay";
+		default: return "unknown";
+	}
+}
+
+int fn_msg_describe(char *buf, size_t len, const struct remote_msg_t *msg) {
+	int i, n;
+
+	if (msg->address == REMOTE_ADDR_BROADCAST) {
+		n = snprintf(buf, len, "all ");
+	}
+	else {
+		n = snprintf(buf, len, "%3u ", msg->address);
+	}
+
+#define OUT(...) n += snprintf(buf + n, (n < len) ? len - n : 0, __VA_ARGS__)
+
+	switch (msg->cmd) {
+		case REMOTE_CMD_FADE_RGB:
+			OUT("fade_rgb #%02x%02x%02x step=%u delay=%u",
+				msg->fade_rgb.color.red, msg->fade_rgb.color.green, msg->fade_rgb.color.blue,
+				msg->fade_rgb.step, msg->fade_rgb.delay);
+			break;
+
+		case REMOTE_CMD_FADE_HSV: {
+			struct remote_msg_fade_hsv_t hsv;
+			memcpy(&hsv, msg, sizeof(hsv)); /* overlays the whole message */
+
+			OUT("fade_hsv hue=%u sat=%u val=%u step=%u delay=%u",
+				hsv.color.hue, hsv.color.saturation, hsv.color.value, hsv.step, hsv.delay);
+			break;
+		}
+
+		case REMOTE_CMD_SAVE_RGB:
+			OUT("save_rgb slot=%u #%02x%02x%02x step=%u delay=%u pause=%u", msg->save_rgb.slot,
+				msg->save_rgb.color.red, msg->save_rgb.color.green, msg->save_rgb.color.blue,
+				msg->save_rgb.step, msg->save_rgb.delay, msg->save_rgb.pause);
+			break;
+
+		case REMOTE_CMD_SAVE_HSV: {
+			struct remote_msg_save_hsv_t hsv;
+			memcpy(&hsv, msg, sizeof(hsv));
+
+			OUT("save_hsv slot=%u hue=%u sat=%u val=%u step=%u delay=%u pause=%u", hsv.slot,
+				hsv.color.hue, hsv.color.saturation, hsv.color.value, hsv.step, hsv.delay, hsv.pause);
+			break;
+		}
+
+		case REMOTE_CMD_SAVE_CURRENT:
+			OUT("save_current slot=%u step=%u delay=%u pause=%u", msg->save_current.slot,
+				msg->save_current.step, msg->save_current.delay, msg->save_current.pause);
+			break;
+
+		case REMOTE_CMD_CONFIG_OFFSETS:
+			OUT("config_offsets step=%d delay=%d hue=%d sat=%u val=%u",
+				msg->config_offsets.step, msg->config_offsets.delay, msg->config_offsets.hue,
+				msg->config_offsets.saturation, msg->config_offsets.value);
+			break;
+
+		case REMOTE_CMD_START_PROGRAM: {
+			union program_params_t p;
+			memcpy(&p, &msg->start_program.params, sizeof(p));
+
+			OUT("start_program %s", fn_program_name(msg->start_program.script));
+			switch (msg->start_program.script) {
+				case 0:
+					OUT(" hue=%u%+d sat=%u val=%u step=%u delay=%u sleep=%u", p.colorwheel.hue_start,
+						p.colorwheel.hue_step, p.colorwheel.saturation, p.colorwheel.value,
+						p.colorwheel.fade_step, p.colorwheel.fade_delay, p.colorwheel.fade_sleep);
+					break;
+
+				case 1:
+					OUT(" seed=%u sat=%u val=%u step=%u delay=%u sleep=%u", p.random.seed,
+						p.random.saturation, p.random.value, p.random.fade_step,
+						p.random.fade_delay, p.random.fade_sleep);
+					break;
+
+				case 2:
+					OUT(" slots=%u-%u repeat=%u", p.replay.start, p.replay.end, p.replay.repeat);
+					break;
+			}
+			break;
+		}
+
+		case REMOTE_CMD_STOP:
+			OUT("stop fade=%u", msg->msg_stop.fade);
+			break;
+
+		case REMOTE_CMD_MODIFY_CURRENT:
+			OUT("modify_current step=%u delay=%u rgb=%+d,%+d,%+d hsv=%+d,%+d,%+d",
+				msg->modify_current.step, msg->modify_current.delay,
+				msg->modify_current.rgb.red, msg->modify_current.rgb.green, msg->modify_current.rgb.blue,
+				msg->modify_current.hsv.hue, msg->modify_current.hsv.saturation, msg->modify_current.hsv.value);
+			break;
+
+		case REMOTE_CMD_PULL_INT:
+			OUT("pull_int delay=%u", msg->pull_int.delay);
+			break;
+
+		case REMOTE_CMD_CONFIG_STARTUP:
+			OUT("config_startup mode=%u", msg->data[0]);
+			break;
+
+		case REMOTE_CMD_POWERDOWN:
+			OUT("powerdown");
+			break;
+
+		case REMOTE_CMD_BOOTLOADER:
+			OUT("bootloader magic=%02x%02x%02x%02x", msg->bootloader.magic[0],
+				msg->bootloader.magic[1], msg->bootloader.magic[2], msg->bootloader.magic[3]);
+			break;
+
+		case REMOTE_CMD_BOOT_CONFIG:
+			OUT("boot_config start=0x%04x buffersize=%u",
+				msg->boot_config.start_address, msg->boot_config.buffersize);
+			break;
+
+		case REMOTE_CMD_BOOT_INIT:
+			OUT("boot_init");
+			break;
+
+		case REMOTE_CMD_CRC_CHECK:
+			OUT("crc_check len=%u checksum=0x%04x delay=%u", msg->boot_crc_check.len,
+				msg->boot_crc_check.checksum, msg->boot_crc_check.delay);
+			break;
+
+		case REMOTE_CMD_CRC_FLASH:
+			OUT("crc_flash start=0x%04x len=%u checksum=0x%04x delay=%u", msg->boot_crc_flash.start,
+				msg->boot_crc_flash.len, msg->boot_crc_flash.checksum, msg->boot_crc_flash.delay);
+			break;
+
+		case REMOTE_CMD_FLASH:
+			OUT("flash");
+			break;
+
+		case REMOTE_CMD_ENTER_APP:
+			OUT("enter_app");
+			break;
+
+		case REMOTE_CMD_BOOT_DATA:
+		default:
+			if (msg->cmd == REMOTE_CMD_BOOT_DATA) {
+				OUT("boot_data ");
+			}
+			else {
+				OUT("unknown 0x%02x ", msg->cmd);
+			}
+
+			for (i = 0; i < REMOTE_MSG_LEN-2; i++) {
+				OUT("%02x", msg->data[i]);
+			}
+			break;
+	}
+
+#undef OUT
+
+	return n;
+}
@@ -0,0 +1,243 @@
+/**
+ * fnordlicht C library - color space kernels
+ *
+ * vector kernels, included by colorspace.c once per instruction set:
+ * FN_V() names the intrinsics, FN_VEC the register type
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define FN_LANES (sizeof(FN_VEC) / 2)	/* 16 bit lanes */
+#define FN_NAME(name) FN_NAME_(name, FN_ISA)
+#define FN_NAME_(name, isa) FN_NAME__(name, isa)
+#define FN_NAME__(name, isa) name##_##isa
+
+/* unsigned division by multiplying with the high half, exact for the ranges below */
+#define FN_DIV360(x) FN_V(srli_epi16)(FN_V(mulhi_epu16)(x, FN_V(set1_epi16)(11651)), 6)	/* x < 65536 */
+#define FN_DIV60(x) FN_V(mulhi_epu16)(x, FN_V(set1_epi16)(1093))				/* x < 360 */
+#define FN_DIV60L(x) FN_V(srli_epi16)(FN_V(mulhi_epu16)(x, FN_V(set1_epi16)(17477)), 4)	/* x < 15076 */
+#define FN_DIV255(x) FN_V(srli_epi16)(FN_V(mulhi_epu16)(x, FN_V(set1_epi16)(-32639)), 7)	/* x < 65154 */
+
+#define FN_SELECT(m, a, b) FN_OR(FN_AND(m, a), FN_ANDNOT(m, b))
+#define FN_SELECT_PS(m, a, b) FN_CASTPS(FN_SELECT(m, FN_CASTSI(a), FN_CASTSI(b)))
+
+static void FN_TARGET FN_NAME(fn_hsv2rgb)(struct rgb_color_t *rgb, const struct hsv_color_t *hsv, size_t n) {
+	const FN_VEC c255 = FN_V(set1_epi16)(255);
+	uint32_t out[FN_LANES];
+	size_t i, k;
+
+	for (i = 0; i + FN_LANES <= n; i += FN_LANES) {
+		FN_VEC lo = FN_LOADU(hsv + i);
+		FN_VEC hi = FN_LOADU(hsv + i + FN_LANES / 2);
+
+		/* 32 bit lanes to 16 bit, the sign extension keeps packs from saturating */
+		FN_VEC h = FN_V(packs_epi32)(FN_V(srai_epi32)(FN_V(slli_epi32)(lo, 16), 16), FN_V(srai_epi32)(FN_V(slli_epi32)(hi, 16), 16));
+		FN_VEC sv = FN_V(packs_epi32)(FN_V(srai_epi32)(lo, 16), FN_V(srai_epi32)(hi, 16));
+		FN_VEC s = FN_AND(sv, c255);
+		FN_VEC v = FN_V(srli_epi16)(sv, 8);
+
+		h = FN_V(sub_epi16)(h, FN_V(mullo_epi16)(FN_DIV360(h), FN_V(set1_epi16)(360)));
+
+		FN_VEC sector = FN_DIV60(h);
+		FN_VEC rem = FN_V(sub_epi16)(h, FN_V(mullo_epi16)(sector, FN_V(set1_epi16)(60)));
+		FN_VEC f = FN_DIV60L(FN_V(add_epi16)(FN_V(mullo_epi16)(rem, c255), FN_V(set1_epi16)(30)));
+
+		/* as in fn_hsv2rgb() */
+		FN_VEC r128 = FN_V(set1_epi16)(128);
+		FN_VEC p = FN_DIV255(FN_V(add_epi16)(FN_V(mullo_epi16)(v, FN_V(sub_epi16)(c255, s)), r128));
+		FN_VEC q = FN_DIV255(FN_V(add_epi16)(FN_V(mullo_epi16)(v, FN_V(sub_epi16)(c255,
+			FN_DIV255(FN_V(add_epi16)(FN_V(mullo_epi16)(s, f), r128)))), r128));
+		FN_VEC t = FN_DIV255(FN_V(mullo_epi16)(v, FN_V(sub_epi16)(c255,
+			FN_DIV255(FN_V(mullo_epi16)(s, FN_V(sub_epi16)(c255, f))))));
+
+		FN_VEC s0 = FN_V(cmpeq_epi16)(sector, FN_V(set1_epi16)(0));
+		FN_VEC s1 = FN_V(cmpeq_epi16)(sector, FN_V(set1_epi16)(1));
+		FN_VEC s2 = FN_V(cmpeq_epi16)(sector, FN_V(set1_epi16)(2));
+		FN_VEC s3 = FN_V(cmpeq_epi16)(sector, FN_V(set1_epi16)(3));
+		FN_VEC s4 = FN_V(cmpeq_epi16)(sector, FN_V(set1_epi16)(4));
+		FN_VEC s5 = FN_V(cmpeq_epi16)(sector, FN_V(set1_epi16)(5));
+
+		FN_VEC r = FN_OR(FN_OR(FN_AND(FN_OR(s0, s5), v), FN_AND(s1, q)), FN_OR(FN_AND(FN_OR(s2, s3), p), FN_AND(s4, t)));
+		FN_VEC g = FN_OR(FN_OR(FN_AND(FN_OR(s1, s2), v), FN_AND(s0, t)), FN_OR(FN_AND(FN_OR(s4, s5), p), FN_AND(s3, q)));
+		FN_VEC b = FN_OR(FN_OR(FN_AND(FN_OR(s3, s4), v), FN_AND(FN_OR(s0, s1), p)), FN_OR(FN_AND(s2, t), FN_AND(s5, q)));
+
+		/* back to the order of the input, 0x00bbggrr per color */
+		FN_VEC rg = FN_OR(r, FN_V(slli_epi16)(g, 8));
+		FN_STOREU(out, FN_V(unpacklo_epi16)(rg, b));
+		FN_STOREU(out + FN_LANES / 2, FN_V(unpackhi_epi16)(rg, b));
+
+		for (k = 0; k < FN_LANES; k++) {
+			memcpy(&rgb[i + k], &out[k], sizeof(struct rgb_color_t));
+		}
+	}
+
+	fn_hsv2rgb_scalar(rgb + i, hsv + i, n - i);
+}
+
+static void FN_TARGET FN_NAME(fn_rgb2hsv)(struct hsv_color_t *hsv, const struct rgb_color_t *rgb, size_t n) {
+	const FN_VECF one = FN_PS(set1)(1.0f), half = FN_PS(set1)(0.5f), c60 = FN_PS(set1)(60.0f);
+	const FN_VEC zero = FN_ZERO();
+	int32_t cr[FN_LANES / 2], cg[FN_LANES / 2], cb[FN_LANES / 2];
+	size_t i, k;
+
+	for (i = 0; i + FN_LANES / 2 <= n; i += FN_LANES / 2) {
+		for (k = 0; k < FN_LANES / 2; k++) {
+			cr[k] = rgb[i + k].red;
+			cg[k] = rgb[i + k].green;
+			cb[k] = rgb[i + k].blue;
+		}
+
+		FN_VEC r = FN_LOADU(cr), g = FN_LOADU(cg), b = FN_LOADU(cb);
+
+		/* the upper halves are zero: 16 bit min/max will do */
+		FN_VEC max = FN_V(max_epi16)(FN_V(max_epi16)(r, g), b);
+		FN_VEC min = FN_V(min_epi16)(FN_V(min_epi16)(r, g), b);
+		FN_VEC delta = FN_V(sub_epi32)(max, min);
+
+		FN_VEC maxz = FN_V(cmpeq_epi32)(max, zero);
+		FN_VEC deltaz = FN_V(cmpeq_epi32)(delta, zero);
+
+		FN_VECF fdelta = FN_PS(cvtepi32)(delta);
+		FN_VECF dmax = FN_SELECT_PS(maxz, one, FN_PS(cvtepi32)(max));
+		FN_VECF ddelta = FN_SELECT_PS(deltaz, one, fdelta);
+
+		/* the same operations in the same order as fn_rgb2hsv() */
+		FN_VEC s = FN_V(cvttps_epi32)(FN_PS(add)(FN_PS(div)(FN_PS(mul)(FN_PS(set1)(255.0f), fdelta), dmax), half));
+		s = FN_ANDNOT(maxz, s);
+
+		FN_VECF hr = FN_PS(div)(FN_PS(mul)(c60, FN_PS(cvtepi32)(FN_V(sub_epi32)(g, b))), ddelta);
+		FN_VECF hg = FN_PS(add)(FN_PS(div)(FN_PS(mul)(c60, FN_PS(cvtepi32)(FN_V(sub_epi32)(b, r))), ddelta), FN_PS(set1)(120.0f));
+		FN_VECF hb = FN_PS(add)(FN_PS(div)(FN_PS(mul)(c60, FN_PS(cvtepi32)(FN_V(sub_epi32)(r, g))), ddelta), FN_PS(set1)(240.0f));
+
+		FN_VECF h = FN_SELECT_PS(FN_V(cmpeq_epi32)(max, r), hr, FN_SELECT_PS(FN_V(cmpeq_epi32)(max, g), hg, hb));
+		h = FN_CASTPS(FN_ANDNOT(deltaz, FN_CASTSI(h)));
+		h = FN_PS(add)(h, FN_PS(and)(FN_CMPLT(h, FN_PS(setzero)()), FN_PS(set1)(360.0f)));
+
+		FN_VEC hue = FN_V(cvttps_epi32)(FN_PS(add)(h, half));
+		hue = FN_ANDNOT(FN_V(cmpeq_epi32)(hue, FN_V(set1_epi32)(360)), hue); /* h is below 360.5 */
+
+		FN_STOREU(hsv + i, FN_OR(FN_OR(hue, FN_V(slli_epi32)(s, 16)), FN_V(slli_epi32)(max, 24)));
+	}
+
+	fn_rgb2hsv_scalar(hsv + i, rgb + i, n - i);
+}
+
+/* plain bytes: the channels of all colors in a row */
+static void FN_TARGET FN_NAME(fn_lerp)(uint8_t *out, const uint8_t *a, const uint8_t *b, uint8_t t, size_t n) {
+	const FN_VEC zero = FN_ZERO(), r127 = FN_V(set1_epi16)(127);
+	const FN_VEC wa = FN_V(set1_epi16)(255 - t), wb = FN_V(set1_epi16)(t);
+	size_t i;
+
+	for (i = 0; i + sizeof(FN_VEC) <= n; i += sizeof(FN_VEC)) {
+		FN_VEC va = FN_LOADU(a + i), vb = FN_LOADU(b + i);
+
+		FN_VEC lo = FN_V(add_epi16)(FN_V(add_epi16)(FN_V(mullo_epi16)(FN_V(unpacklo_epi8)(va, zero), wa),
+			FN_V(mullo_epi16)(FN_V(unpacklo_epi8)(vb, zero), wb)), r127);
+		FN_VEC hi = FN_V(add_epi16)(FN_V(add_epi16)(FN_V(mullo_epi16)(FN_V(unpackhi_epi8)(va, zero), wa),
+			FN_V(mullo_epi16)(FN_V(unpackhi_epi8)(vb, zero), wb)), r127);
+
+		FN_STOREU(out + i, FN_V(packus_epi16)(FN_DIV255(lo), FN_DIV255(hi)));
+	}
+
+	fn_lerp_scalar(out + i, a + i, b + i, t, n - i);
+}
+
+static void FN_TARGET FN_NAME(fn_scale)(uint8_t *out, const uint8_t *in, uint8_t factor, size_t n) {
+	const FN_VEC zero = FN_ZERO(), r127 = FN_V(set1_epi16)(127);
+	const FN_VEC f = FN_V(set1_epi16)(factor);
+	size_t i;
+
+	for (i = 0; i + sizeof(FN_VEC) <= n; i += sizeof(FN_VEC)) {
+		FN_VEC x = FN_LOADU(in + i);
+
+		FN_VEC lo = FN_V(add_epi16)(FN_V(mullo_epi16)(FN_V(unpacklo_epi8)(x, zero), f), r127);
+		FN_VEC hi = FN_V(add_epi16)(FN_V(mullo_epi16)(FN_V(unpackhi_epi8)(x, zero), f), r127);
+
+		FN_STOREU(out + i, FN_V(packus_epi16)(FN_DIV255(lo), FN_DIV255(hi)));
+	}
+
+	fn_scale_scalar(out + i, in + i, factor, n - i);
+}
+
+/* channel sums of RGB24 pixels: three registers always hold whole pixels */
+static void FN_TARGET FN_NAME(fn_sum)(const uint8_t *p, size_t len, uint64_t *sum) {
+	const FN_VEC zero = FN_ZERO();
+	FN_VEC mask[3][3], acc[3] = { zero, zero, zero };
+	uint64_t lanes[sizeof(FN_VEC) / 8];
+	size_t i, k;
+	int r, c;
+
+	for (r = 0; r < 3; r++) {
+		for (c = 0; c < 3; c++) {
+			mask[r][c] = FN_V(cmpeq_epi8)(FN_LOADU(fn_channels + r * sizeof(FN_VEC)), FN_V(set1_epi8)(c));
+		}
+	}
+
+	for (i = 0; i + 3 * sizeof(FN_VEC) <= len; i += 3 * sizeof(FN_VEC)) {
+		for (r = 0; r < 3; r++) {
+			FN_VEC x = FN_LOADU(p + i + r * sizeof(FN_VEC));
+
+			for (c = 0; c < 3; c++) { /* sums of 8 bytes each */
+				acc[c] = FN_V(add_epi64)(acc[c], FN_V(sad_epu8)(FN_AND(x, mask[r][c]), zero));
+			}
+		}
+	}
+
+	for (c = 0; c < 3; c++) {
+		FN_STOREU(lanes, acc[c]);
+
+		for (k = 0; k < sizeof(FN_VEC) / 8; k++) {
+			sum[c] += lanes[k];
+		}
+	}
+
+	fn_sum_scalar(p + i, len - i, sum);
+}
+
+/* interleaved complex numbers: unpacking two registers pairs the real with the imaginary parts */
+static void FN_TARGET FN_NAME(fn_power)(float *out, const double *in, size_t n) {
+	const size_t lanes = sizeof(FN_VECD) / sizeof(double);
+	size_t i;
+
+	for (i = 0; i + lanes <= n; i += lanes) {
+		FN_VECD a = FN_PD(loadu)(in + 2 * i);
+		FN_VECD b = FN_PD(loadu)(in + 2 * i + lanes);
+
+		a = FN_PD(mul)(a, a);
+		b = FN_PD(mul)(b, b);
+
+		FN_STORE_PD_PS(out + i, FN_PD_ORDER(FN_PD(add)(FN_PD(unpacklo)(a, b), FN_PD(unpackhi)(a, b))));
+	}
+
+	fn_power_scalar(out + i, in + 2 * i, n - i);
+}
+
+#undef FN_LANES
+#undef FN_NAME
+#undef FN_NAME_
+#undef FN_NAME__
+#undef FN_DIV360
+#undef FN_DIV60
+#undef FN_DIV60L
+#undef FN_DIV255
+#undef FN_SELECT
+#undef FN_SELECT_PS
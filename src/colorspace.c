@@ -0,0 +1,301 @@
+/**
+ * fnordlicht C library - color space kernels
+ *
+ * converts and blends whole arrays of colors at once,
+ * with SSE2 and AVX2 variants picked at runtime
+ * (the power spectrum of fnvum uses the same machinery)
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "libfn.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define FN_SIMD_X86
+  #include <immintrin.h>
+#endif
+
+struct fn_kernels {
+	const char *name;
+	void (*hsv2rgb)(struct rgb_color_t *rgb, const struct hsv_color_t *hsv, size_t n);
+	void (*rgb2hsv)(struct hsv_color_t *hsv, const struct rgb_color_t *rgb, size_t n);
+	void (*lerp)(uint8_t *out, const uint8_t *a, const uint8_t *b, uint8_t t, size_t n);
+	void (*scale)(uint8_t *out, const uint8_t *in, uint8_t factor, size_t n);
+	void (*sum)(const uint8_t *p, size_t len, uint64_t *sum);
+	void (*power)(float *out, const double *in, size_t n);
+};
+
+static struct fn_kernels fn_kernels;
+static pthread_once_t fn_kernels_once = PTHREAD_ONCE_INIT;
+
+/* scalar reference, the vector kernels give the same results */
+struct hsv_color_t fn_rgb2hsv(struct rgb_color_t rgb) {
+	struct hsv_color_t hsv;
+	int max = rgb.red, min = rgb.red;
+	float h;
+
+	if (rgb.green > max) max = rgb.green;
+	if (rgb.blue > max) max = rgb.blue;
+	if (rgb.green < min) min = rgb.green;
+	if (rgb.blue < min) min = rgb.blue;
+
+	int delta = max - min;
+
+	hsv.value = max;
+	hsv.saturation = (max) ? (int) (255.0f * delta / max + 0.5f) : 0;
+
+	if (delta == 0) h = 0;
+	else if (max == rgb.red) h = 60.0f * (rgb.green - rgb.blue) / delta;
+	else if (max == rgb.green) h = 60.0f * (rgb.blue - rgb.red) / delta + 120.0f;
+	else h = 60.0f * (rgb.red - rgb.green) / delta + 240.0f;
+
+	if (h < 0) h += 360.0f;
+	hsv.hue = (int) (h + 0.5f) % 360;
+
+	return hsv;
+}
+
+static void fn_hsv2rgb_scalar(struct rgb_color_t *rgb, const struct hsv_color_t *hsv, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		rgb[i] = fn_hsv2rgb(hsv[i]);
+	}
+}
+
+static void fn_rgb2hsv_scalar(struct hsv_color_t *hsv, const struct rgb_color_t *rgb, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		hsv[i] = fn_rgb2hsv(rgb[i]);
+	}
+}
+
+static void fn_lerp_scalar(uint8_t *out, const uint8_t *a, const uint8_t *b, uint8_t t, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		out[i] = (a[i] * (255 - t) + b[i] * t + 127) / 255;
+	}
+}
+
+static void fn_scale_scalar(uint8_t *out, const uint8_t *in, uint8_t factor, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		out[i] = (in[i] * factor + 127) / 255;
+	}
+}
+
+static void fn_sum_scalar(const uint8_t *p, size_t len, uint64_t *sum) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sum[i % 3] += p[i];
+	}
+}
+
+/* squared magnitudes of interleaved complex numbers (re, im) */
+static void fn_power_scalar(float *out, const double *in, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		out[i] = in[2 * i] * in[2 * i] + in[2 * i + 1] * in[2 * i + 1];
+	}
+}
+
+#ifdef FN_SIMD_X86
+/* channel of each byte in a row of pixels */
+#define FN_RGB4 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2
+static const uint8_t fn_channels[96] = {
+	FN_RGB4, FN_RGB4, FN_RGB4, FN_RGB4, FN_RGB4, FN_RGB4, FN_RGB4, FN_RGB4
+};
+
+#define FN_ISA sse2
+#define FN_TARGET __attribute__ ((target ("sse2")))
+#define FN_VEC __m128i
+#define FN_VECF __m128
+#define FN_V(op) _mm_##op
+#define FN_PS(op) _mm_##op##_ps
+#define FN_LOADU(p) _mm_loadu_si128((const __m128i *) (p))
+#define FN_STOREU(p, x) _mm_storeu_si128((__m128i *) (p), x)
+#define FN_AND _mm_and_si128
+#define FN_OR _mm_or_si128
+#define FN_ANDNOT _mm_andnot_si128
+#define FN_CASTPS _mm_castsi128_ps
+#define FN_CASTSI _mm_castps_si128
+#define FN_ZERO _mm_setzero_si128
+#define FN_CMPLT _mm_cmplt_ps
+#define FN_VECD __m128d
+#define FN_PD(op) _mm_##op##_pd
+#define FN_PD_ORDER(x) (x)
+#define FN_STORE_PD_PS(p, x) _mm_storel_pi((__m64 *) (p), _mm_cvtpd_ps(x))
+#include "colorspace-simd.h"
+
+#undef FN_ISA
+#undef FN_TARGET
+#undef FN_VEC
+#undef FN_VECF
+#undef FN_V
+#undef FN_PS
+#undef FN_LOADU
+#undef FN_STOREU
+#undef FN_AND
+#undef FN_OR
+#undef FN_ANDNOT
+#undef FN_CASTPS
+#undef FN_CASTSI
+#undef FN_ZERO
+#undef FN_CMPLT
+#undef FN_VECD
+#undef FN_PD
+#undef FN_PD_ORDER
+#undef FN_STORE_PD_PS
+
+#define FN_ISA avx2
+#define FN_TARGET __attribute__ ((target ("avx2")))
+#define FN_VEC __m256i
+#define FN_VECF __m256
+#define FN_V(op) _mm256_##op
+#define FN_PS(op) _mm256_##op##_ps
+#define FN_LOADU(p) _mm256_loadu_si256((const __m256i *) (p))
+#define FN_STOREU(p, x) _mm256_storeu_si256((__m256i *) (p), x)
+#define FN_AND _mm256_and_si256
+#define FN_OR _mm256_or_si256
+#define FN_ANDNOT _mm256_andnot_si256
+#define FN_CASTPS _mm256_castsi256_ps
+#define FN_CASTSI _mm256_castps_si256
+#define FN_ZERO _mm256_setzero_si256
+#define FN_CMPLT(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define FN_VECD __m256d
+#define FN_PD(op) _mm256_##op##_pd
+#define FN_PD_ORDER(x) _mm256_permute4x64_pd(x, 0xd8) /* unpack works per 128 bit lane */
+#define FN_STORE_PD_PS(p, x) _mm_storeu_ps(p, _mm256_cvtpd_ps(x))
+#include "colorspace-simd.h"
+#endif
+
+
+static void fn_kernels_init() {
+	const char *force = getenv("FN_SIMD"); /* for benchmarks: scalar, sse2 or avx2 */
+
+	fn_kernels = (struct fn_kernels) { "scalar", fn_hsv2rgb_scalar, fn_rgb2hsv_scalar, fn_lerp_scalar, fn_scale_scalar, fn_sum_scalar, fn_power_scalar };
+
+#ifdef FN_SIMD_X86
+	__builtin_cpu_init();
+
+	if (force && strcmp(force, "scalar") == 0) {
+		return;
+	}
+	else if (__builtin_cpu_supports("avx2") && !(force && strcmp(force, "sse2") == 0)) {
+		fn_kernels = (struct fn_kernels) { "avx2", fn_hsv2rgb_avx2, fn_rgb2hsv_avx2, fn_lerp_avx2, fn_scale_avx2, fn_sum_avx2, fn_power_avx2 };
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		fn_kernels = (struct fn_kernels) { "sse2", fn_hsv2rgb_sse2, fn_rgb2hsv_sse2, fn_lerp_sse2, fn_scale_sse2, fn_sum_sse2, fn_power_sse2 };
+	}
+#endif
+}
+
+const char * fn_color_kernels() {
+	pthread_once(&fn_kernels_once, fn_kernels_init);
+
+	return fn_kernels.name;
+}
+
+void fn_hsv2rgb_batch(struct rgb_color_t *rgb, const struct hsv_color_t *hsv, size_t n) {
+	pthread_once(&fn_kernels_once, fn_kernels_init);
+	fn_kernels.hsv2rgb(rgb, hsv, n);
+}
+
+void fn_rgb2hsv_batch(struct hsv_color_t *hsv, const struct rgb_color_t *rgb, size_t n) {
+	pthread_once(&fn_kernels_once, fn_kernels_init);
+	fn_kernels.rgb2hsv(hsv, rgb, n);
+}
+
+void fn_rgb_lerp(struct rgb_color_t *out, const struct rgb_color_t *a, const struct rgb_color_t *b, uint8_t t, size_t n) {
+	pthread_once(&fn_kernels_once, fn_kernels_init);
+	fn_kernels.lerp(out->rgb, a->rgb, b->rgb, t, 3 * n);
+}
+
+void fn_rgb_scale(struct rgb_color_t *out, const struct rgb_color_t *in, uint8_t factor, size_t n) {
+	pthread_once(&fn_kernels_once, fn_kernels_init);
+	fn_kernels.scale(out->rgb, in->rgb, factor, 3 * n);
+}
+
+void fn_power_spectrum(float *power, const double *spectrum, size_t n) {
+	pthread_once(&fn_kernels_once, fn_kernels_init);
+	fn_kernels.power(power, spectrum, n);
+}
+
+/* average color of a box within a RGB24 image */
+struct rgb_color_t fn_rgb_box(const uint8_t *image, size_t stride, int x, int y, int w, int h) {
+	struct rgb_color_t avg = { { { 0, 0, 0 } } };
+	uint64_t sum[3] = { 0, 0, 0 };
+	uint64_t n = (uint64_t) w * h;
+	int row, c;
+
+	if (n == 0) {
+		return avg;
+	}
+
+	pthread_once(&fn_kernels_once, fn_kernels_init);
+
+	for (row = y; row < y + h; row++) {
+		fn_kernels.sum(image + row * stride + 3 * x, 3 * w, sum);
+	}
+
+	for (c = 0; c < 3; c++) {
+		avg.rgb[c] = (sum[c] + n / 2) / n;
+	}
+
+	return avg;
+}
+
+/* how far apart two colors look, red and blue are weighted by the mean red ("redmean") */
+int fn_rgb_distance(struct rgb_color_t a, struct rgb_color_t b) {
+	int rmean = (a.red + b.red) / 2;
+	int dr = a.red - b.red, dg = a.green - b.green, db = a.blue - b.blue;
+
+	return (((512 + rmean) * dr * dr) >> 8) + 4 * dg * dg + (((767 - rmean) * db * db) >> 8);
+}
+
+void fn_gamma_table(uint8_t *lut, double gamma) {
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		lut[i] = 255 * pow(i / 255.0, gamma) + 0.5;
+	}
+}
+
+/* a table lookup per channel, nothing a vector unit could do faster */
+void fn_rgb_lut(struct rgb_color_t *out, const struct rgb_color_t *in, const uint8_t *lut, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		out[i].red = lut[in[i].red];
+		out[i].green = lut[in[i].green];
+		out[i].blue = lut[in[i].blue];
+	}
+}
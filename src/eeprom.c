@@ -0,0 +1,203 @@
+/**
+ * fnordlicht C library - EEPROM planner
+ *
+ * compares the wanted EEPROM contents with what was written
+ * before and uploads only the difference, identical rows
+ * of several devices are merged into broadcasts
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "libfn.h"
+
+void fn_eeprom_init(struct fn_eeprom *ee) {
+	memset(ee, 0, sizeof(struct fn_eeprom));
+}
+
+static int fn_eeprom_same(const struct fn_eeprom *a, uint8_t aa, const struct fn_eeprom *b, uint8_t ba, int slot) {
+	return memcmp(&a->slots[aa][slot], &b->slots[ba][slot], sizeof(struct remote_msg_save_rgb_t)) == 0;
+}
+
+void fn_eeprom_apply(struct fn_eeprom *ee, const struct remote_msg_t *msg, int count) {
+	int a, slot = msg->save_rgb.slot;
+
+	if (msg->cmd != REMOTE_CMD_SAVE_RGB || slot >= CONFIG_EEPROM_COLORS) {
+		return;
+	}
+
+	for (a = 0; a <= FN_MAX_DEVICES; a++) {
+		if (a == msg->address || (msg->address == REMOTE_ADDR_BROADCAST && a < count)) {
+			memcpy(&ee->slots[a][slot], &msg->save_rgb, sizeof(struct remote_msg_save_rgb_t));
+			fn_mask_set(&ee->known[slot], a);
+		}
+	}
+}
+
+/* "address;slot;color;step;delay;pause" rows, like share/replay.eeprom */
+int fn_eeprom_parse(struct fn_eeprom *ee, const char *path, int count) {
+	char row[1024];
+	int line = 0, rows = 0;
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		return -1;
+	}
+
+	while (fgets(row, sizeof(row), f)) {
+		struct remote_msg_t msg;
+		unsigned int address, slot, red, green, blue, step, delay, pause;
+		char *p = row + strspn(row, " \t");
+
+		line++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+			continue; /* comments and empty rows */
+		}
+
+		if (sscanf(p, "%u;%u;%2x%2x%2x;%u;%u;%u", &address, &slot, &red, &green, &blue, &step, &delay, &pause) != 8 ||
+		    address > 255 || slot >= CONFIG_EEPROM_COLORS || step > 255 || delay > 255 || pause > 65535) {
+			fprintf(stderr, "%s:%d: invalid row\n", path, line);
+			fclose(f);
+			errno = EINVAL;
+			return -1;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.address = address;
+		msg.cmd = REMOTE_CMD_SAVE_RGB;
+		msg.save_rgb.slot = slot;
+		msg.save_rgb.color.red = red;
+		msg.save_rgb.color.green = green;
+		msg.save_rgb.color.blue = blue;
+		msg.save_rgb.step = step;
+		msg.save_rgb.delay = delay;
+		msg.save_rgb.pause = pause;
+
+		/* later rows override earlier ones, broadcast rows included */
+		fn_eeprom_apply(ee, &msg, count);
+		rows++;
+	}
+
+	fclose(f);
+
+	return rows;
+}
+
+/* frames which bring one slot of the chain from cur to want */
+int fn_eeprom_plan(const struct fn_eeprom *cur, const struct fn_eeprom *want, int count, int slot, struct remote_msg_t *burst) {
+	fn_mask_t changed, done;
+	int a, b, n = 0, best = -1, best_votes = 0;
+
+	fn_mask_zero(&changed);
+	fn_mask_zero(&done);
+
+	for (a = 0; a <= FN_MAX_DEVICES; a++) {
+		if (fn_mask_test(&want->known[slot], a) &&
+		    (!fn_mask_test(&cur->known[slot], a) || !fn_eeprom_same(cur, a, want, a, slot))) {
+			fn_mask_set(&changed, a);
+		}
+	}
+
+	int pending = fn_mask_popcount(&changed);
+	if (pending == 0) {
+		return 0;
+	}
+
+	/* a broadcast overwrites the whole chain: only if we know what every device should hold */
+	if (count > 0 && fn_mask_covers(&want->known[slot], count)) {
+		for (a = 0; a < count; a++) {
+			int votes = 0;
+
+			if (!fn_mask_test(&changed, a)) {
+				continue;
+			}
+
+			for (b = 0; b < count; b++) {
+				votes += fn_eeprom_same(want, a, want, b, slot);
+			}
+
+			if (votes > best_votes) {
+				best = a;
+				best_votes = votes;
+			}
+		}
+
+		/* broadcast + overrides must be cheaper than one frame per changed device */
+		if (best >= 0 && 1 + count - best_votes < pending) {
+			burst[n].address = REMOTE_ADDR_BROADCAST;
+			burst[n].cmd = REMOTE_CMD_SAVE_RGB;
+			memcpy(&burst[n++].save_rgb, &want->slots[best][slot], sizeof(struct remote_msg_save_rgb_t));
+
+			for (a = 0; a < count; a++) {
+				if (fn_eeprom_same(want, a, want, best, slot)) {
+					fn_mask_set(&done, a);
+				}
+				else {
+					fn_mask_set(&changed, a); /* overwritten by the broadcast */
+				}
+			}
+		}
+	}
+
+	for (a = 0; a <= FN_MAX_DEVICES; a++) {
+		if (fn_mask_test(&changed, a) && !fn_mask_test(&done, a)) {
+			burst[n].address = a;
+			burst[n].cmd = REMOTE_CMD_SAVE_RGB;
+			memcpy(&burst[n++].save_rgb, &want->slots[a][slot], sizeof(struct remote_msg_save_rgb_t));
+		}
+	}
+
+	return n;
+}
+
+int fn_eeprom_sync(int fd, struct fn_eeprom *cur, const struct fn_eeprom *want, int count) {
+	struct remote_msg_t burst[FN_MAX_DEVICES+2];
+	int a, slot, frames = 0;
+
+	memset(burst, 0, sizeof(burst));
+
+	for (slot = 0; slot < CONFIG_EEPROM_COLORS; slot++) {
+		int n = fn_eeprom_plan(cur, want, count, slot, burst);
+		if (n == 0) {
+			continue;
+		}
+
+		if ((int) fn_send_frames(fd, burst, n) < 0) {
+			return -1;
+		}
+
+		/* remember what the devices hold now */
+		for (a = 0; a <= FN_MAX_DEVICES; a++) {
+			if (fn_mask_test(&want->known[slot], a)) {
+				memcpy(&cur->slots[a][slot], &want->slots[a][slot], sizeof(struct remote_msg_save_rgb_t));
+				fn_mask_set(&cur->known[slot], a);
+			}
+		}
+
+		frames += n;
+	}
+
+	return frames;
+}
@@ -0,0 +1,282 @@
+/**
+ * fnordlicht C library - effect engine
+ *
+ * renders animations for the whole chain on a fixed clock
+ * and sends only as many frames as the bus can carry
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <sys/timerfd.h>
+
+#include "libfn.h"
+
+static struct rgb_color_t fn_effect_mix(struct rgb_color_t a, struct rgb_color_t b, double w) {
+	struct rgb_color_t c;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		c.rgb[i] = a.rgb[i] + (b.rgb[i] - a.rgb[i]) * w + 0.5;
+	}
+
+	return c;
+}
+
+/* position within the current cycle (0..1) */
+static double fn_effect_phase(int64_t t, double speed) {
+	double p = t * 1e-9 * speed;
+
+	return p - floor(p);
+}
+
+/* a from/to gradient moving along the chain */
+static void fn_effect_gradient(struct rgb_color_t *colors, int count, int64_t t, const struct fn_effect_params *p) {
+	double phase = fn_effect_phase(t, p->speed);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		double x = (double) i / p->scale + phase;
+
+		x -= floor(x);
+		colors[i] = fn_effect_mix(p->from, p->to, 1 - fabs(2 * x - 1));
+	}
+}
+
+/* a lamp in 'to' running over 'from' with a tail of 'scale' lamps */
+static void fn_effect_chase(struct rgb_color_t *colors, int count, int64_t t, const struct fn_effect_params *p) {
+	double head = fn_effect_phase(t, p->speed) * count;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		double d = head - i;
+
+		if (d < 0) d += count;
+		colors[i] = fn_effect_mix(p->from, p->to, (d < p->scale) ? 1 - d / p->scale : 0);
+	}
+}
+
+/* overlapping sine waves on the hue circle */
+static void fn_effect_plasma(struct rgb_color_t *colors, int count, int64_t t, const struct fn_effect_params *p) {
+	struct hsv_color_t hsv[FN_MAX_DEVICES+1];
+	double s = 2 * M_PI * t * 1e-9 * p->speed;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		double x = 2 * M_PI * i / p->scale;
+		double v = sin(x + s) + sin(0.5 * x - 1.3 * s) + sin(0.3 * x + 0.7 * s);
+
+		hsv[i].hue = (v + 3) * 60;
+		hsv[i].saturation = 255;
+		hsv[i].value = 255;
+	}
+
+	fn_hsv2rgb_batch(colors, hsv, count);
+}
+
+static double fn_effect_random(uint32_t x) {
+	x ^= x >> 16; x *= 0x7feb352d;
+	x ^= x >> 15; x *= 0x846ca68b;
+	x ^= x >> 16;
+
+	return x / 4294967295.0;
+}
+
+/* every lamp wanders between 'from' and 'to' on its own */
+static void fn_effect_noise(struct rgb_color_t *colors, int count, int64_t t, const struct fn_effect_params *p) {
+	double x = t * 1e-9 * p->speed;
+	uint32_t k = floor(x);
+	double f = x - k;
+	int i;
+
+	f = f * f * (3 - 2 * f); /* smoothstep between the random values */
+
+	for (i = 0; i < count; i++) {
+		double a = fn_effect_random(k * 257 + i);
+		double b = fn_effect_random((k + 1) * 257 + i);
+
+		colors[i] = fn_effect_mix(p->from, p->to, a + (b - a) * f);
+	}
+}
+
+const struct fn_effect fn_effects[] = {
+	{ "gradient",	fn_effect_gradient },
+	{ "chase",	fn_effect_chase },
+	{ "plasma",	fn_effect_plasma },
+	{ "noise",	fn_effect_noise },
+	{ } /* stop condition for iterator */
+};
+
+const struct fn_effect * fn_effect_find(const char *name) {
+	const struct fn_effect *e;
+
+	for (e = fn_effects; e->name; e++) {
+		if (strcmp(e->name, name) == 0) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+int fn_fx_init(struct fn_fx *fx, struct fn_bus *bus, int count, int rate, const struct fn_effect *effect) {
+	struct itimerspec its;
+
+	memset(fx, 0, sizeof(struct fn_fx));
+
+	if (count < 1 || count > FN_MAX_DEVICES || rate < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fx->bus = bus;
+	fx->count = count;
+	fx->effect = effect;
+	fx->interval = 1000000000 / rate;
+	memset(&fx->params.to, 255, sizeof(struct rgb_color_t));
+	fx->params.speed = 0.2;
+	fx->params.scale = count;
+
+	fx->timer = -1;
+	fx->start = fn_now();
+
+	if (!effect) {
+		return 0; /* the caller fills fx->want and calls fn_fx_output() */
+	}
+
+	if ((fx->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	its.it_interval.tv_sec = fx->interval / 1000000000;
+	its.it_interval.tv_nsec = fx->interval % 1000000000;
+	its.it_value = its.it_interval;
+
+	if (timerfd_settime(fx->timer, 0, &its, NULL)) {
+		close(fx->timer);
+		return -1;
+	}
+
+	return 0;
+}
+
+void fn_fx_close(struct fn_fx *fx) {
+	if (fx->timer >= 0) {
+		close(fx->timer);
+	}
+}
+
+/* budget: how many frames fit into one tick, lamps which look most wrong go first */
+int fn_fx_output(struct fn_fx *fx) {
+	struct remote_msg_t burst[FN_MAX_DEVICES+1];
+	int error[FN_MAX_DEVICES+1];
+	int i, j, n = 0, pending = 0, same = 1;
+
+	long budget = (fx->interval - fn_bus_queued(fx->bus) * 1000) / FN_FRAME_NSEC;
+	if (budget <= 0) {
+		fx->starved++;
+		return 0;
+	}
+
+	for (i = 0; i < fx->count; i++) {
+		error[i] = (fn_mask_test(&fx->known, i)) ? fn_rgb_distance(fx->want[i], fx->shown[i]) : INT_MAX; /* never sent */
+		pending += (error[i] > fx->threshold);
+		same &= (memcmp(&fx->want[i], &fx->want[0], sizeof(struct rgb_color_t)) == 0);
+	}
+
+	if (pending == 0) {
+		return 0;
+	}
+
+	memset(burst, 0, sizeof(burst));
+
+	/* the whole chain shows the same: one broadcast, unless it would reach lamps past ours */
+	if (same && (pending > 1 || fx->count == 1) && fx->chain > 0 && fx->count >= fx->chain) {
+		burst[0].address = REMOTE_ADDR_BROADCAST;
+		burst[0].cmd = REMOTE_CMD_FADE_RGB;
+		burst[0].fade_rgb.color = fx->want[0];
+		fn_timeline_fade(fx->shown[0], fx->want[0], fn_mask_covers(&fx->known, fx->count) ? fx->interval : 0,
+			&burst[0].fade_rgb.step, &burst[0].fade_rgb.delay);
+
+		for (i = 0; i < fx->count; i++) {
+			fx->shown[i] = fx->want[0];
+		}
+
+		fn_mask_fill(&fx->known, fx->count);
+		n = 1;
+	}
+	else {
+		/* lamps left behind get a slower fade: they'll wait for their next turn */
+		int64_t revisit = fx->interval * ((pending + budget - 1) / budget);
+
+		for (; n < budget && n < pending; n++) {
+			int worst = 0;
+
+			for (j = 1; j < fx->count; j++) {
+				if (error[j] > error[worst]) {
+					worst = j;
+				}
+			}
+
+			burst[n].address = worst;
+			burst[n].cmd = REMOTE_CMD_FADE_RGB;
+			burst[n].fade_rgb.color = fx->want[worst];
+			fn_timeline_fade(fx->shown[worst], fx->want[worst], (error[worst] < INT_MAX) ? revisit : 0, &burst[n].fade_rgb.step, &burst[n].fade_rgb.delay);
+
+			fx->shown[worst] = fx->want[worst];
+			fn_mask_set(&fx->known, worst);
+			error[worst] = -1;
+		}
+
+		fx->deferred += pending - n;
+	}
+
+	if (!fn_bus_submit_frames(fx->bus, burst, n)) {
+		fn_mask_zero(&fx->known); /* ring full: some of them got lost */
+		fx->starved++;
+		return 0;
+	}
+
+	fx->frames += n;
+
+	return n;
+}
+
+int fn_fx_tick(struct fn_fx *fx) {
+	uint64_t expired;
+
+	if (read(fx->timer, &expired, sizeof(expired)) != sizeof(expired)) {
+		return -1;
+	}
+
+	fx->ticks++;
+	fx->overruns += expired - 1;
+
+	fx->effect->render(fx->want, fx->count, fn_now() - fx->start, &fx->params);
+
+	return fn_fx_output(fx);
+}
@@ -0,0 +1,381 @@
+/**
+ * fnordlicht C library - firmware updates
+ *
+ * flashes all devices of a chain at once by broadcasting the
+ * image to their bootloaders and only retries devices whose
+ * checksums do not match
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libfn.h"
+
+#define FN_BOOT_DATA_LEN (REMOTE_MSG_LEN-2)
+
+static uint16_t fn_crc16_table[256];
+static pthread_once_t fn_crc16_once = PTHREAD_ONCE_INIT;
+
+/* avr-libc's _crc16_update(), one byte at a time */
+static void fn_crc16_init() {
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint16_t crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		}
+		fn_crc16_table[i] = crc;
+	}
+}
+
+uint16_t fn_crc16(uint16_t crc, const uint8_t *data, size_t len) {
+	pthread_once(&fn_crc16_once, fn_crc16_init);
+
+	while (len--) {
+		crc = (crc >> 8) ^ fn_crc16_table[(crc ^ *data++) & 0xff];
+	}
+
+	return crc;
+}
+
+static int fn_flash_hex_byte(const char *p) {
+	unsigned int v;
+
+	return (sscanf(p, "%2x", &v) == 1) ? (int) v : -1;
+}
+
+int fn_flash_load(const char *path, uint8_t *image, uint16_t *start) {
+	FILE *f = fopen(path, "rb");
+	int c, lo = FN_FLASH_SIZE, hi = 0;
+
+	if (!f) {
+		return -1;
+	}
+
+	memset(image, 0xff, FN_FLASH_SIZE); /* erased flash */
+
+	if ((c = fgetc(f)) != ':') { /* raw binary, starts at 0 */
+		ungetc(c, f);
+		lo = 0;
+		hi = fread(image, 1, FN_FLASH_SIZE, f);
+
+		if (fgetc(f) != EOF) {
+			hi = -1; /* too large */
+		}
+	}
+	else { /* intel hex */
+		char row[600];
+		uint32_t base = 0;
+
+		ungetc(c, f);
+		while (fgets(row, sizeof(row), f)) {
+			if (row[0] != ':') {
+				continue;
+			}
+
+			int i, n = fn_flash_hex_byte(row + 1);
+			int addr = (fn_flash_hex_byte(row + 3) << 8) | fn_flash_hex_byte(row + 5);
+			int type = fn_flash_hex_byte(row + 7);
+			uint8_t sum = 0, data[256];
+
+			if (n < 0 || addr < 0 || type < 0 || strlen(row) < 11 + 2 * n) {
+				hi = -1;
+				break;
+			}
+
+			for (i = 0; i < n + 5; i++) {
+				int b = fn_flash_hex_byte(row + 1 + 2 * i);
+				if (b < 0) break;
+				if (i >= 4 && i < n + 4) data[i - 4] = b;
+				sum += b;
+			}
+
+			if (i < n + 5 || sum != 0) {
+				hi = -1; /* checksum mismatch */
+				break;
+			}
+
+			if (type == 0x00) {
+				if (base + addr + n > FN_FLASH_SIZE) {
+					hi = -1;
+					break;
+				}
+
+				memcpy(image + base + addr, data, n);
+				if (base + addr < lo) lo = base + addr;
+				if (base + addr + n > hi) hi = base + addr + n;
+			}
+			else if (type == 0x01) {
+				break; /* end of file */
+			}
+			else if (type == 0x02 && n == 2) { /* extended segment address */
+				base = ((data[0] << 8) | data[1]) << 4;
+			}
+			else if (type == 0x04 && n == 2) { /* extended linear address */
+				base = ((data[0] << 8) | data[1]) << 16;
+			}
+		}
+	}
+
+	fclose(f);
+
+	if (hi <= lo) {
+		return -1;
+	}
+
+	/* the bootloader writes whole pages */
+	lo -= lo % FN_FLASH_PAGE;
+	hi += (FN_FLASH_PAGE - hi % FN_FLASH_PAGE) % FN_FLASH_PAGE;
+
+	*start = lo;
+
+	return hi - lo;
+}
+
+/* the chain's interrupt line is a wired or: did anybody complain? */
+static int fn_flash_complaint(int fd) {
+	tcdrain(fd);
+
+	int ret = fn_wait_int(fd, 1, FN_INT_TIMEOUT, NULL);
+	if (ret == 1) {
+		fn_wait_int(fd, 0, FN_INT_RELEASE, NULL);
+	}
+
+	return ret;
+}
+
+static int fn_flash_send(int fd, const fn_mask_t *mask, int count, struct remote_msg_t *msgs, int n) {
+	struct remote_msg_t burst[(FN_MAX_DEVICES+1) * 4];
+	int i, m = 0;
+
+	/* frames addressed to several devices are expanded, broadcast if all are healthy */
+	for (i = 0; i < n; i++) {
+		if (msgs[i].address == REMOTE_ADDR_BROADCAST) {
+			m += fn_mask_expand(mask, &msgs[i], count, burst + m);
+		}
+		else {
+			burst[m++] = msgs[i];
+		}
+
+		if (m > (FN_MAX_DEVICES+1) * 3 || i == n - 1) {
+			if ((int) fn_send_frames(fd, burst, m) < 0) {
+				return -1;
+			}
+			m = 0;
+		}
+	}
+
+	return 0;
+}
+
+/* load one page into the bootloader's buffer and ask for its checksum */
+static int fn_flash_page(int fd, const fn_mask_t *mask, int count, uint8_t address, const uint8_t *data, uint16_t offset, int len) {
+	struct remote_msg_t msgs[4 + FN_FLASH_PAGE / FN_BOOT_DATA_LEN + 1];
+	int i, n = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	msgs[n].cmd = REMOTE_CMD_BOOT_CONFIG;
+	msgs[n].boot_config.start_address = offset;
+	msgs[n++].boot_config.buffersize = len;
+
+	msgs[n++].cmd = REMOTE_CMD_BOOT_INIT;
+
+	for (i = 0; i < len; i += FN_BOOT_DATA_LEN) {
+		msgs[n].cmd = REMOTE_CMD_BOOT_DATA;
+		memset(msgs[n].data, 0xff, FN_BOOT_DATA_LEN);
+		memcpy(msgs[n++].data, data + i, (len - i < FN_BOOT_DATA_LEN) ? len - i : FN_BOOT_DATA_LEN);
+	}
+
+	msgs[n].cmd = REMOTE_CMD_CRC_CHECK;
+	msgs[n].boot_crc_check.len = len;
+	msgs[n].boot_crc_check.checksum = fn_crc16(0xffff, data, len);
+	msgs[n++].boot_crc_check.delay = 1;
+
+	for (i = 0; i < n; i++) {
+		msgs[i].address = address;
+	}
+
+	return fn_flash_send(fd, mask, count, msgs, n);
+}
+
+/* find out who complained, ask everybody in turn */
+static int fn_flash_blame(int fd, fn_mask_t *mask, int count, struct remote_msg_t *check, fn_mask_t *blamed) {
+	int a, n = 0;
+
+	fn_mask_zero(blamed);
+
+	for (a = 0; a < count; a++) {
+		if (!fn_mask_test(mask, a)) {
+			continue;
+		}
+
+		check->address = a;
+		if ((int) fn_send(fd, check) < 0) {
+			return -1;
+		}
+
+		if (fn_flash_complaint(fd) == 1) {
+			fn_mask_set(blamed, a);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+int fn_flash(int fd, int count, const uint8_t *image, uint16_t start, int len, fn_mask_t *failed, fn_flash_progress_t cb, void *arg) {
+	struct remote_msg_t msg, check;
+	fn_mask_t healthy, blamed;
+	int a, r, ret, offset;
+
+	fn_mask_fill(&healthy, count);
+	if (failed) {
+		fn_mask_zero(failed);
+	}
+
+	/* enter the bootloaders, they need a new sync afterwards */
+	memset(&msg, 0, sizeof(msg));
+	msg.address = REMOTE_ADDR_BROADCAST;
+	msg.cmd = REMOTE_CMD_BOOTLOADER;
+	msg.bootloader.magic[0] = BOOTLOADER_MAGIC_BYTE1;
+	msg.bootloader.magic[1] = BOOTLOADER_MAGIC_BYTE2;
+	msg.bootloader.magic[2] = BOOTLOADER_MAGIC_BYTE3;
+	msg.bootloader.magic[3] = BOOTLOADER_MAGIC_BYTE4;
+
+	fn_sync(fd);
+	if ((int) fn_send(fd, &msg) < 0) {
+		return -1;
+	}
+
+	tcdrain(fd);
+	usleep(FN_FLASH_REBOOT * 1000);
+	fn_sync(fd);
+
+	/* pages go to everybody at once, only the ones who got them wrong get them again */
+	for (offset = 0; offset < len; offset += FN_FLASH_PAGE) {
+		int plen = (len - offset < FN_FLASH_PAGE) ? len - offset : FN_FLASH_PAGE;
+		const uint8_t *page = image + start + offset;
+
+		if (fn_flash_page(fd, &healthy, count, REMOTE_ADDR_BROADCAST, page, start + offset, plen) < 0) {
+			return -1;
+		}
+
+		if ((ret = fn_flash_complaint(fd)) == 1) {
+			memset(&check, 0, sizeof(check));
+			check.cmd = REMOTE_CMD_CRC_CHECK;
+			check.boot_crc_check.len = plen;
+			check.boot_crc_check.checksum = fn_crc16(0xffff, page, plen);
+			check.boot_crc_check.delay = 1;
+
+			if (fn_flash_blame(fd, &healthy, count, &check, &blamed) < 0) {
+				return -1;
+			}
+
+			for (a = 0; a < count; a++) {
+				if (!fn_mask_test(&blamed, a)) {
+					continue;
+				}
+
+				for (r = 0; r < FN_FLASH_RETRIES; r++) {
+					if (fn_flash_page(fd, &healthy, count, a, page, start + offset, plen) < 0) {
+						return -1;
+					}
+
+					if (fn_flash_complaint(fd) == 0) {
+						break;
+					}
+				}
+
+				if (r == FN_FLASH_RETRIES) { /* give up, it stays in its bootloader */
+					fn_mask_clear(&healthy, a);
+					if (failed) fn_mask_set(failed, a);
+				}
+			}
+		}
+		else if (ret < 0 && offset == 0) {
+			fprintf(stderr, "interrupt line not available: checksums can not be verified\n");
+		}
+
+		/* write the buffer into flash */
+		memset(&msg, 0, sizeof(msg));
+		msg.address = REMOTE_ADDR_BROADCAST;
+		msg.cmd = REMOTE_CMD_FLASH;
+
+		if (fn_mask_popcount(&healthy) == 0) {
+			break;
+		}
+		else if (fn_flash_send(fd, &healthy, count, &msg, 1) < 0) {
+			return -1;
+		}
+
+		tcdrain(fd);
+		usleep(FN_FLASH_WRITE * 1000);
+
+		if (cb) {
+			cb(offset + plen, len, arg);
+		}
+	}
+
+	/* verify the whole image */
+	memset(&check, 0, sizeof(check));
+	check.address = REMOTE_ADDR_BROADCAST;
+	check.cmd = REMOTE_CMD_CRC_FLASH;
+	check.boot_crc_flash.start = start;
+	check.boot_crc_flash.len = len;
+	check.boot_crc_flash.checksum = fn_crc16(0xffff, image + start, len);
+	check.boot_crc_flash.delay = 1;
+
+	if (fn_flash_send(fd, &healthy, count, &check, 1) < 0) {
+		return -1;
+	}
+
+	if (fn_flash_complaint(fd) == 1) {
+		if (fn_flash_blame(fd, &healthy, count, &check, &blamed) < 0) {
+			return -1;
+		}
+
+		for (a = 0; a < count; a++) {
+			if (fn_mask_test(&blamed, a)) {
+				fn_mask_clear(&healthy, a);
+				if (failed) fn_mask_set(failed, a);
+			}
+		}
+	}
+
+	/* start the new firmware */
+	memset(&msg, 0, sizeof(msg));
+	msg.address = REMOTE_ADDR_BROADCAST;
+	msg.cmd = REMOTE_CMD_ENTER_APP;
+
+	if (fn_mask_popcount(&healthy) && fn_flash_send(fd, &healthy, count, &msg, 1) < 0) {
+		return -1;
+	}
+
+	tcdrain(fd);
+
+	return count - fn_mask_popcount(&healthy);
+}
@@ -84,6 +84,8 @@ static struct option long_options[] = {
 	{"host",	required_argument,	0,		'H'},
 	{"filename",	required_argument,	0,		'F'},
 	{"verbose",	no_argument,		0,		'v'},
+	{"group",	required_argument,	0,		'g'},
+	{"full",	no_argument,		0,		'u'},
 	{} /* stop condition for iterator */
 };
 
@@ -101,8 +103,10 @@ static char *long_options_descs[] = {
 	"show this help",
 	"serial port or TCP port if --host is specified",
 	"hostname or IP of terminal server",
-	"with replay eeprom",
+	"with replay eeprom (CSV or compiled by fnscene)",
 	"enable verbose output",
+	"bus group config, addresses and masks refer to logical lamps",
+	"upload all rows of the EEPROM file, not only the changed ones",
 	NULL /* stop condition for iterator */
 };
 
@@ -127,6 +131,46 @@ void print_cmd(struct remote_msg_t * msg) {
 	printf("\n");
 }
 
+/* broadcast rows in EEPROM files are expanded to every device of the chain */
+int chain_length(int fd, enum connection_t con_mode, const char *port) {
+	int count = (con_mode == RS232) ? fn_topology_load(port) : -1;
+
+	if (count < 0 && con_mode == RS232) {
+		count = fn_count_devices(fd);
+		fn_topology_store(port, count);
+	}
+
+	/* unknown: assume every address is in use */
+	return (count > 0) ? count : FN_MAX_DEVICES + 1;
+}
+
+/* saves behind the back of the EEPROM planner */
+void update_eeprom_cache(const char *key, struct remote_msg_t *msg, const char *mask) {
+	struct fn_eeprom *ee = malloc(sizeof(struct fn_eeprom));
+	struct remote_msg_t m = *msg;
+	fn_mask_t bits;
+	int count = fn_topology_load(key);
+
+	if (!ee || fn_eeprom_load(ee, key) < 0) {
+		free(ee);
+		return;
+	}
+
+	if (strlen(mask) && fn_mask_parse(&bits, mask) >= 0) {
+		for (m.address = 0; m.address <= FN_MAX_DEVICES; m.address++) {
+			if (fn_mask_test(&bits, m.address)) {
+				fn_eeprom_apply(ee, &m, 0);
+			}
+		}
+	}
+	else {
+		fn_eeprom_apply(ee, &m, (count > 0) ? count : FN_MAX_DEVICES + 1);
+	}
+
+	fn_eeprom_store(ee, key);
+	free(ee);
+}
+
 void usage(char **argv) {
 	printf("Usage: fnctl command [options]\n\n");
 	printf("Commands:\n");
@@ -152,17 +196,20 @@ void usage(char **argv) {
 int main(int argc, char ** argv) {
 	/* options */
 	uint8_t address = 255;
+	int lamp = -1;
 	uint8_t step = 255;
 	uint8_t slot = 0;
 	uint8_t delay = 0;
 	uint8_t pause = 0;
 
-	char mask[255] = "";
+	char mask[FN_GROUP_LAMPS+1] = "";
 	char filename[1024] = "";
+	char group[1024] = "";
 
 	char host[255] = "";
 	char port[255] = DEFAULT_DEVICE;
 	int verbose = 0;
+	int full = 0;
 
 	struct rgb_color_t color;
 	struct remote_msg_t msg;
@@ -172,7 +219,8 @@ int main(int argc, char ** argv) {
 
 	/* connection */
 	enum connection_t con_mode = RS232;
-	int fd;
+	int fd = -1;
+	struct fn_group *g = NULL;
 	struct addrinfo hints, *res;
 	struct termios oldtio;
 
@@ -193,18 +241,19 @@ int main(int argc, char ** argv) {
 		/* getopt_long stores the option index here. */
 		int option_index = 0;
 
-		int c = getopt_long(argc, argv, "hva:m:f:d:t:s:f:w:r:d:p:c:P:H:F:", long_options, &option_index);
+		int c = getopt_long(argc, argv, "hvua:m:f:d:t:s:f:w:r:d:p:c:P:H:F:g:", long_options, &option_index);
 
 		/* detect the end of the options. */
 		if (c == -1) break;
 
 		switch (c) {
 			case 'a':
-				address = atoi(optarg);
+				lamp = atoi(optarg);
+				address = lamp;
 				break;
 
      			case 'm':
-				strcpy(mask, optarg);
+				strncpy(mask, optarg, sizeof(mask) - 1);
 				break;
 
      			case 's':
@@ -277,6 +326,14 @@ int main(int argc, char ** argv) {
 				verbose = 1;
 				break;
 
+			case 'g':
+				strncpy(group, optarg, sizeof(group) - 1);
+				break;
+
+			case 'u':
+				full = 1;
+				break;
+
 			case 'h':
 			case '?':
 				usage(argv);
@@ -284,8 +341,26 @@ int main(int argc, char ** argv) {
 		}
 	}
 
+	/* the EEPROM cache is kept per serial port or terminal server */
+	char cache_key[512];
+	if (con_mode == NET) snprintf(cache_key, sizeof(cache_key), "%s:%s", host, port);
+	else snprintf(cache_key, sizeof(cache_key), "%s", port);
+
 	/* connect to fnordlichter */
-	if (con_mode == NET) {
+	if (strlen(group)) {
+		if (cp->cmd >= 0xA0) {
+			fprintf(stderr, "%s is not supported for bus groups\n", argv[1]);
+			exit(EXIT_FAILURE);
+		}
+
+		if (verbose) printf("connect to group: %s\n", group);
+		g = fn_group_open(group);
+		if (g == NULL) {
+			perror(group);
+			exit(EXIT_FAILURE);
+		}
+	}
+	else if (con_mode == NET) {
 		if (verbose) printf("connect via net: %s:%s\n", host, port);
 		memset(&hints, 0, sizeof hints);
 		hints.ai_family = AF_UNSPEC;	/* both IPv4 & IPv6 */
@@ -310,8 +385,13 @@ int main(int argc, char ** argv) {
 		oldtio = fn_init(fd);
 	}
 
-	fn_sync(fd);
-	usleep(25000); /* sleeping for 25ms */
+	if (g) {
+		fn_group_sync(g);
+	}
+	else {
+		fn_sync(fd);
+		usleep(25000); /* sleeping for 25ms */
+	}
 
 	/* check address */
 	if (address > FN_MAX_DEVICES+1) {
@@ -362,46 +442,51 @@ int main(int argc, char ** argv) {
 			break;
 
 		/* local commands */
-		case LOCAL_CMD_COUNT:
-			printf("%d\n", fn_count_devices(fd));
+		case LOCAL_CMD_COUNT: {
+			int count = fn_count_devices(fd);
+			if (con_mode == RS232) fn_topology_store(port, count); /* refresh cache for the daemons */
+			printf("%d\n", count);
 			break;
+		}
 
 		case LOCAL_CMD_EEPROM: {
-			FILE *eeprom_file = fopen(filename, "r");
-			char row[1024];
+			struct fn_eeprom *cur = malloc(sizeof(struct fn_eeprom));
+			struct fn_eeprom *want = malloc(sizeof(struct fn_eeprom));
+			int count = chain_length(fd, con_mode, port);
 
-			if (eeprom_file == NULL) {
-				perror ("error opening eeprom file");
+			if (!cur || !want) {
+				perror("failed to allocate EEPROM planner");
 				exit(EXIT_FAILURE);
 			}
 
-			while(!feof(eeprom_file)) {
-				if (fgets(row, 1024, eeprom_file) && *row != '#') { /* ignore comments */
-					struct remote_msg_t msg;
-					memset(&msg, 0, sizeof msg);
-
-					unsigned int slot, address, red, green, blue, step, delay, pause;
-					sscanf(row, "%u;%u;%2x%2x%2x;%u;%u;%u", &address, &slot, &red, &green, &blue, &step, &delay, &pause);
-
-					/* validate and set settings */
-					msg.cmd = REMOTE_CMD_SAVE_RGB;
-					msg.address = (address > 255) ? 255 : address;
-					msg.save_rgb.slot = (slot > 255) ? 255 : slot;
-					msg.save_rgb.color.red = (red > 255) ? 255 : red;
-					msg.save_rgb.color.green = (green > 255) ? 255 : green;
-					msg.save_rgb.color.blue = (blue > 255) ? 255 : blue;
-					msg.save_rgb.step = (step > 255) ? 255 : step;
-					msg.save_rgb.delay = (delay > 255) ? 255 : delay;
-					msg.save_rgb.pause = (pause > 65535) ? 65535 : pause;
-
-					int p = fn_send(fd, &msg);
-					if (verbose) print_cmd(&msg);
-					if (p < 0) {
-						fprintf(stderr, "failed on writing %d bytes to fnordlichts", REMOTE_MSG_LEN);
-						exit(EXIT_FAILURE);
-					}
-				}
+			/* compiled scenes or the CSV itself */
+			struct fn_scene sc;
+			fn_eeprom_init(want);
+			if (fn_scene_map(&sc, filename) == 0) {
+				fn_scene_eeprom(&sc, want, count);
+				fn_scene_unmap(&sc);
+			}
+			else if (fn_eeprom_parse(want, filename, count) < 0) {
+				perror("error opening eeprom file");
+				exit(EXIT_FAILURE);
+			}
+
+			/* what we wrote the last time */
+			if (full || fn_eeprom_load(cur, cache_key) < 0) {
+				fn_eeprom_init(cur);
 			}
+
+			int p = fn_eeprom_sync(fd, cur, want, count);
+			if (p < 0) {
+				fprintf(stderr, "failed on writing %d bytes to fnordlichts", REMOTE_MSG_LEN);
+				exit(EXIT_FAILURE);
+			}
+
+			if (verbose) printf("sent %d frames for %d devices\n", p, count);
+			fn_eeprom_store(cur, cache_key);
+
+			free(cur);
+			free(want);
 			break;
 		}
 
@@ -412,7 +497,35 @@ int main(int argc, char ** argv) {
 	}
 
 	/* send remote commands to bus */
-	if (cp->cmd < 0xA0) {
+	if (cp->cmd < 0xA0 && g) { /* logical lamps, fanned out to the buses of the group */
+		int p;
+		msg.cmd = cp->cmd;
+
+		if (strlen(mask)) {
+			p = fn_group_submit_mask(g, mask, &msg);
+		}
+		else if (lamp < 0) {
+			p = fn_group_submit_all(g, &msg);
+		}
+		else {
+			p = (fn_group_submit(g, lamp, &msg)) ? 1 : (lamp < g->lamps && g->map[lamp].bus >= 0) ? -1 : 0;
+		}
+
+		if (verbose) printf("queued %d frames for %d buses\n", p, g->count);
+		if (p == -2) {
+			fprintf(stderr, "invalid mask! only '0' and '1' are allowed\n");
+			exit(EXIT_FAILURE);
+		}
+		else if (p < 0) {
+			fprintf(stderr, "failed on queuing frames for fnordlichts\n");
+			exit(EXIT_FAILURE);
+		}
+		else if (p == 0) {
+			fprintf(stderr, "no lamp selected\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else if (cp->cmd < 0xA0) {
 		msg.cmd = cp->cmd;
 
 		if (strlen(mask)) { /* use mask */
@@ -441,10 +554,15 @@ int main(int argc, char ** argv) {
 				exit(EXIT_FAILURE);
 			}
 		}
+
+		if (msg.cmd == REMOTE_CMD_SAVE_RGB) {
+			update_eeprom_cache(cache_key, &msg, mask);
+		}
 	}
 
 	/* reset port to old state */
-	if (con_mode == RS232) tcsetattr(fd, TCSANOW, &oldtio);
+	if (g) fn_group_close(g); /* flushes all buses */
+	else if (con_mode == RS232) tcsetattr(fd, TCSANOW, &oldtio);
 
 	return EXIT_SUCCESS;
 }
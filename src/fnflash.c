@@ -0,0 +1,164 @@
+/**
+ * fnordlicht firmware updater
+ *
+ * uploads an Intel HEX or binary image to all devices
+ * of a chain at once
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "libfn.h"
+
+#define DEFAULT_DEVICE "/dev/ttyUSB0"
+
+static struct option long_options[] = {
+	{"port",	required_argument,	0,		'P'},
+	{"count",	required_argument,	0,		'c'},
+	{"verbose",	no_argument,		0,		'v'},
+	{"help",	no_argument,		0,		'h'},
+	{} /* stop condition for iterator */
+};
+
+static char *long_options_descs[] = {
+	"serial port",
+	"number of devices (default: count them)",
+	"show progress",
+	"show this help",
+	NULL /* stop condition for iterator */
+};
+
+void usage(char **argv) {
+	printf("Usage: fnflash [options] image.hex|image.bin\n\n");
+	printf("Options:\n");
+
+	struct option *op = long_options;
+	char **desc = long_options_descs;
+	while (op->name && desc) {
+		printf("  -%c, --%s\t%s\n", op->val, op->name, *desc);
+		op++;
+		desc++;
+	}
+}
+
+void progress(int done, int total, void *arg) {
+	int64_t *begin = arg;
+	double secs = (fn_now() - *begin) / 1e9;
+
+	printf("\r%5d / %d bytes, %.1f s", done, total, secs);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	char port[255] = DEFAULT_DEVICE;
+	int count = -1, verbose = 0;
+
+	while (1) {
+		int c = getopt_long(argc, argv, "P:c:vh", long_options, NULL);
+		if (c == -1) break;
+
+		switch (c) {
+			case 'P': strncpy(port, optarg, sizeof(port) - 1); break;
+			case 'c': count = atoi(optarg); break;
+			case 'v': verbose = 1; break;
+
+			case 'h':
+			case '?':
+				usage(argv);
+				exit((c == '?') ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "image required\n");
+		usage(argv);
+		exit(EXIT_FAILURE);
+	}
+
+	static uint8_t image[FN_FLASH_SIZE];
+	uint16_t start;
+	int len = fn_flash_load(argv[optind], image, &start);
+	if (len < 0) {
+		fprintf(stderr, "%s: invalid or too large image\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = open(port, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror(port);
+		exit(EXIT_FAILURE);
+	}
+
+	struct termios oldtio = fn_init(fd);
+
+	/* walk the bus rather than trust the cache: lamps past a stale count would get the pages, but never be checked */
+	if (count < 0) {
+		count = fn_count_devices(fd);
+		fn_topology_store(port, count);
+	}
+
+	if (count <= 0 || count > FN_MAX_DEVICES) {
+		fprintf(stderr, "no devices found, use --count\n");
+		tcsetattr(fd, TCSANOW, &oldtio);
+		exit(EXIT_FAILURE);
+	}
+
+	if (verbose) {
+		printf("flashing %d bytes at 0x%04x to %d devices\n", len, start, count);
+	}
+
+	fn_mask_t failed;
+	int64_t begin = fn_now();
+	int ret = fn_flash(fd, count, image, start, len, &failed, verbose ? progress : NULL, &begin);
+
+	if (verbose) {
+		printf("\n");
+	}
+
+	if (ret < 0) {
+		perror("failed to flash");
+	}
+	else if (ret > 0) {
+		int a;
+
+		fprintf(stderr, "%d devices failed, they stay in their bootloader:", ret);
+		for (a = 0; a < count; a++) {
+			if (fn_mask_test(&failed, a)) {
+				fprintf(stderr, " %d", a);
+			}
+		}
+		fprintf(stderr, "\n");
+	}
+	else if (verbose) {
+		printf("done in %.1f s\n", (fn_now() - begin) / 1e9);
+	}
+
+	tcsetattr(fd, TCSANOW, &oldtio);
+	close(fd);
+
+	return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
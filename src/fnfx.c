@@ -0,0 +1,232 @@
+/**
+ * fnordlicht effect player
+ *
+ * runs one of the libfn effect generators on the whole chain
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "libfn.h"
+
+#define DEFAULT_DEVICE "/dev/ttyUSB0"
+
+static struct option long_options[] = {
+	{"port",	required_argument,	0,		'P'},
+	{"count",	required_argument,	0,		'c'},
+	{"rate",	required_argument,	0,		'r'},
+	{"from",	required_argument,	0,		'f'},
+	{"to",		required_argument,	0,		't'},
+	{"speed",	required_argument,	0,		's'},
+	{"scale",	required_argument,	0,		'l'},
+	{"verbose",	no_argument,		0,		'v'},
+	{"help",	no_argument,		0,		'h'},
+	{} /* stop condition for iterator */
+};
+
+static char *long_options_descs[] = {
+	"serial port",
+	"number of devices (default: count them)",
+	"frames per second (default: 25)",
+	"first color (ex. 000000)",
+	"second color (ex. ffffff)",
+	"cycles per second (default: 0.2)",
+	"lamps per cycle or tail length (default: chain length)",
+	"print statistics every second",
+	"show this help",
+	NULL /* stop condition for iterator */
+};
+
+static volatile sig_atomic_t terminate = 0;
+
+void usage(char **argv) {
+	const struct fn_effect *e;
+
+	printf("Usage: fnfx [options] effect\n\n");
+	printf("Effects:");
+	for (e = fn_effects; e->name; e++) {
+		printf(" %s", e->name);
+	}
+	printf("\n\nOptions:\n");
+
+	struct option *op = long_options;
+	char **desc = long_options_descs;
+	while (op->name && desc) {
+		printf("  -%c, --%s\t%s\n", op->val, op->name, *desc);
+		op++;
+		desc++;
+	}
+}
+
+void quit(int sig) {
+	terminate = 1;
+}
+
+int parse_color(const char *identifier, struct rgb_color_t *color) {
+	unsigned int red, green, blue;
+
+	if (strlen(identifier) != 6 || sscanf(identifier, "%2x%2x%2x", &red, &green, &blue) != 3) {
+		fprintf(stderr, "invalid color definition: %s\n", identifier);
+		return -1;
+	}
+
+	color->red = red;
+	color->green = green;
+	color->blue = blue;
+
+	return 0;
+}
+
+void print_stats(const struct fn_fx *fx) {
+	printf("%lu ticks, %lu frames, %lu deferred, %lu starved, %lu overruns\n",
+		fx->ticks, fx->frames, fx->deferred, fx->starved, fx->overruns);
+}
+
+int main(int argc, char *argv[]) {
+	char port[255] = DEFAULT_DEVICE;
+	char *from = NULL, *to = NULL;
+	double speed = 0, scale = 0;
+	int count = -1, rate = 25, verbose = 0;
+	struct fn_fx fx;
+
+	while (1) {
+		int c = getopt_long(argc, argv, "P:c:r:f:t:s:l:vh", long_options, NULL);
+		if (c == -1) break;
+
+		switch (c) {
+			case 'P': strncpy(port, optarg, sizeof(port) - 1); break;
+			case 'c': count = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'f': from = optarg; break;
+			case 't': to = optarg; break;
+			case 's': speed = atof(optarg); break;
+			case 'l': scale = atof(optarg); break;
+			case 'v': verbose = 1; break;
+
+			case 'h':
+			case '?':
+				usage(argv);
+				exit((c == '?') ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "effect required\n");
+		usage(argv);
+		exit(EXIT_FAILURE);
+	}
+
+	const struct fn_effect *effect = fn_effect_find(argv[optind]);
+	if (!effect) {
+		fprintf(stderr, "unknown effect: %s\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = open(port, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror(port);
+		exit(EXIT_FAILURE);
+	}
+
+	struct termios oldtio = fn_init(fd);
+	int cached = 0, chain;
+
+	/* count before the writer thread owns the port */
+	if (count < 0) {
+		count = chain = fn_count_devices_cached(fd, port, &cached);
+	}
+	else {
+		chain = fn_topology_load(port);
+	}
+
+	struct fn_bus *bus = fn_bus_attach(fd);
+	if (!bus) {
+		perror(port);
+		tcsetattr(fd, TCSANOW, &oldtio);
+		exit(EXIT_FAILURE);
+	}
+
+	if (cached) { /* refreshes the cache for the next run */
+		fn_bus_verify(bus, port, count, NULL, NULL);
+	}
+
+	if (fn_fx_init(&fx, bus, count, rate, effect)) {
+		fprintf(stderr, "no devices found or invalid rate: %s\n", strerror(errno));
+		fn_bus_close(bus);
+		tcsetattr(fd, TCSANOW, &oldtio);
+		exit(EXIT_FAILURE);
+	}
+
+	fx.chain = chain;
+
+	if ((from && parse_color(from, &fx.params.from)) || (to && parse_color(to, &fx.params.to))) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (speed > 0) fx.params.speed = speed;
+	if (scale > 0) fx.params.scale = scale;
+
+	struct sigaction action;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = 0;
+	action.sa_handler = quit;
+
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	int ret = EXIT_SUCCESS;
+	while (!terminate) {
+		if (fn_fx_tick(&fx) < 0 && errno != EINTR) {
+			perror("failed to send");
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		int err = fn_bus_error(bus);
+		if (err) {
+			fprintf(stderr, "failed to send: %s\n", strerror(err));
+		}
+
+		if (verbose && fx.ticks % rate == 0) {
+			print_stats(&fx);
+		}
+	}
+
+	if (verbose) {
+		print_stats(&fx);
+	}
+
+	fn_fx_close(&fx);
+	fn_bus_close(bus);
+
+	tcsetattr(fd, TCSANOW, &oldtio);
+	close(fd);
+
+	return ret;
+}
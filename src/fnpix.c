@@ -0,0 +1,258 @@
+/**
+ * fnordlicht pixel mapper
+ *
+ * shows raw RGB24 video frames on lamps arranged on a plane:
+ * every lamp gets the average color of its area of the frame
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include "libfn.h"
+
+#define DEFAULT_DEVICE "/dev/ttyUSB0"
+
+struct area {
+	int address;
+	int x, y, w, h;	/* pixels */
+};
+
+static struct option long_options[] = {
+	{"port",	required_argument,	0,		'P'},
+	{"layout",	required_argument,	0,		'l'},
+	{"width",	required_argument,	0,		'W'},
+	{"height",	required_argument,	0,		'H'},
+	{"rate",	required_argument,	0,		'r'},
+	{"threshold",	required_argument,	0,		't'},
+	{"verbose",	no_argument,		0,		'v'},
+	{"help",	no_argument,		0,		'h'},
+	{} /* stop condition for iterator */
+};
+
+static char *long_options_descs[] = {
+	"serial port",
+	"file with the area of every lamp",
+	"frame width in pixels (default: 1920)",
+	"frame height in pixels (default: 1080)",
+	"frames per second of the input (default: 30)",
+	"smallest color difference worth a frame (default: 48)",
+	"print statistics every second",
+	"show this help",
+	NULL /* stop condition for iterator */
+};
+
+void usage(char **argv) {
+	printf("Usage: fnpix [options] -l layout [input]\n\n");
+	printf("Reads raw RGB24 frames from the input (default: stdin), for example:\n");
+	printf("  ffmpeg -re -i video.mp4 -f rawvideo -pix_fmt rgb24 -s 1920x1080 - | fnpix -l layout\n\n");
+	printf("Layout rows are \"address x y width height\" in fractions of the frame (0.0-1.0).\n\n");
+	printf("Options:\n");
+
+	struct option *op = long_options;
+	char **desc = long_options_descs;
+	while (op->name && desc) {
+		printf("  -%c, --%s\t%s\n", op->val, op->name, *desc);
+		op++;
+		desc++;
+	}
+}
+
+int load_layout(const char *path, int width, int height, struct area *areas) {
+	char row[1024];
+	int line = 0, n = 0;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		return -1;
+	}
+
+	while (fgets(row, sizeof(row), f)) {
+		unsigned int address;
+		double x, y, w, h;
+		char *p = row + strspn(row, " \t");
+
+		line++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+			continue; /* comments and empty rows */
+		}
+
+		if (sscanf(p, "%u %lf %lf %lf %lf", &address, &x, &y, &w, &h) != 5 || address >= FN_MAX_DEVICES ||
+		    x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > 1 || y + h > 1 || n > FN_MAX_DEVICES) {
+			fprintf(stderr, "%s:%d: invalid row\n", path, line);
+			fclose(f);
+			errno = EINVAL;
+			return -1;
+		}
+
+		areas[n].address = address;
+		areas[n].x = x * width;
+		areas[n].y = y * height;
+		areas[n].w = w * width + 0.5;
+		areas[n].h = h * height + 0.5;
+
+		/* at least one pixel, never past the edge */
+		if (areas[n].w < 1) areas[n].w = 1;
+		if (areas[n].h < 1) areas[n].h = 1;
+		if (areas[n].x + areas[n].w > width) areas[n].w = width - areas[n].x;
+		if (areas[n].y + areas[n].h > height) areas[n].h = height - areas[n].y;
+
+		n++;
+	}
+
+	fclose(f);
+
+	return n;
+}
+
+/* a whole frame or nothing */
+ssize_t read_frame(int fd, uint8_t *frame, size_t len) {
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t q = read(fd, frame + done, len - done);
+
+		if (q < 0 && errno == EINTR) {
+			continue;
+		}
+		else if (q <= 0) {
+			return q;
+		}
+
+		done += q;
+	}
+
+	return done;
+}
+
+int main(int argc, char *argv[]) {
+	char port[255] = DEFAULT_DEVICE;
+	char *layout = NULL;
+	int width = 1920, height = 1080, rate = 30, threshold = 48, verbose = 0;
+	static struct area areas[FN_MAX_DEVICES+1];
+	struct fn_fx fx;
+
+	while (1) {
+		int c = getopt_long(argc, argv, "P:l:W:H:r:t:vh", long_options, NULL);
+		if (c == -1) break;
+
+		switch (c) {
+			case 'P': strncpy(port, optarg, sizeof(port) - 1); break;
+			case 'l': layout = optarg; break;
+			case 'W': width = atoi(optarg); break;
+			case 'H': height = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 't': threshold = atoi(optarg); break;
+			case 'v': verbose = 1; break;
+
+			case 'h':
+			case '?':
+				usage(argv);
+				exit((c == '?') ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	if (!layout || width <= 0 || height <= 0) {
+		fprintf(stderr, "layout and frame size required\n");
+		usage(argv);
+		exit(EXIT_FAILURE);
+	}
+
+	int i, count = 0, n = load_layout(layout, width, height, areas);
+	if (n <= 0) {
+		fprintf(stderr, "%s: no lamps\n", layout);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (areas[i].address >= count) {
+			count = areas[i].address + 1;
+		}
+	}
+
+	int in = (optind < argc) ? open(argv[optind], O_RDONLY) : STDIN_FILENO;
+	if (in < 0) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t len = (size_t) width * height * 3;
+	uint8_t *frame = malloc(len);
+	if (!frame) {
+		perror("failed to allocate frame");
+		exit(EXIT_FAILURE);
+	}
+
+	struct fn_bus *bus = fn_bus_open(port);
+	if (!bus) {
+		perror(port);
+		exit(EXIT_FAILURE);
+	}
+
+	/* no generator: we fill in the colors */
+	if (fn_fx_init(&fx, bus, count, rate, NULL)) {
+		perror("invalid rate");
+		exit(EXIT_FAILURE);
+	}
+
+	fx.threshold = threshold; /* lamps missing in the layout stay black */
+	fx.chain = fn_topology_load(port); /* so do the ones past it */
+
+	int64_t busy = 0, last = fn_now();
+	unsigned long frames = 0;
+
+	while (read_frame(in, frame, len) > 0) {
+		int64_t begin = fn_now();
+
+		for (i = 0; i < n; i++) {
+			struct area *a = &areas[i];
+			fx.want[a->address] = fn_rgb_box(frame, 3 * width, a->x, a->y, a->w, a->h);
+		}
+
+		fn_fx_output(&fx);
+
+		int err = fn_bus_error(bus);
+		if (err) {
+			fprintf(stderr, "failed to send: %s\n", strerror(err));
+		}
+
+		frames++;
+		busy += fn_now() - begin;
+
+		if (verbose && begin - last >= 1000000000) {
+			printf("%lu frames in, %lu frames out, %lu deferred, %.2f ms per frame\n",
+				frames, fx.frames, fx.deferred, busy / 1e6 / frames);
+			last = begin;
+		}
+	}
+
+	fn_fx_close(&fx);
+	fn_bus_close(bus);
+	free(frame);
+
+	return EXIT_SUCCESS;
+}
@@ -53,11 +53,12 @@ char * http_get_body(char * response) {
 }
 
 struct rgb_color_t calc_gradient(double quota, struct rgb_color_t start, struct rgb_color_t end) {
-	struct rgb_color_t gradient = start;
+	struct rgb_color_t gradient;
 
-	gradient.red = (end.red - start.red) * quota;
-	gradient.green = (end.green - start.green) * quota;
-	gradient.blue = (end.blue - start.blue) * quota;
+	if (quota < 0) quota = 0;
+	if (quota > 1) quota = 1;
+
+	fn_rgb_lerp(&gradient, &start, &end, quota * 255 + 0.5, 1);
 
 	return gradient;
 }
@@ -0,0 +1,245 @@
+/**
+ * fnordlicht capture replay and decoder
+ *
+ * replays traffic recorded with FN_CAPTURE or fn_capture_open()
+ * in real time, faster or as fast as the bus allows
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libfn.h"
+
+#define DEFAULT_DEVICE "/dev/ttyUSB0"
+
+static struct option long_options[] = {
+	{"port",	required_argument,	0,		'P'},
+	{"speed",	required_argument,	0,		'x'},
+	{"max",		no_argument,		0,		'm'},
+	{"loop",	required_argument,	0,		'l'},
+	{"decode",	no_argument,		0,		'd'},
+	{"verbose",	no_argument,		0,		'v'},
+	{"help",	no_argument,		0,		'h'},
+	{} /* stop condition for iterator */
+};
+
+static char *long_options_descs[] = {
+	"serial port",
+	"playback speed factor (ex. 2 or 0.5)",
+	"as fast as the bus allows",
+	"replay the capture n times (0 for endless)",
+	"print the capture symbolically instead of sending it",
+	"print every frame while replaying",
+	"show this help",
+	NULL /* stop condition for iterator */
+};
+
+void usage(char **argv) {
+	printf("Usage: fnreplay [options] capture\n\n");
+	printf("Options:\n");
+
+	struct option *op = long_options;
+	char **desc = long_options_descs;
+	while (op->name && desc) {
+		printf("  -%c, --%s\t%s\n", op->val, op->name, *desc);
+		op++;
+		desc++;
+	}
+}
+
+void print_record(const struct fn_capture_record *rec, int64_t offset) {
+	struct remote_msg_t msg;
+	char desc[256];
+
+	fn_capture_frame(rec, &msg);
+
+	if (rec->flags & FN_CAPTURE_SYNC) {
+		snprintf(desc, sizeof(desc), "sync address=%u", msg.address);
+	}
+	else {
+		fn_msg_describe(desc, sizeof(desc), &msg);
+	}
+
+	printf("%12.3f %s %s\n", offset / 1e6, (rec->flags & FN_CAPTURE_BUS) ? "bus " : "    ", desc);
+}
+
+/* the time since the previous record, captures may span several boots */
+int64_t record_gap(const struct fn_capture *cap, size_t i) {
+	int64_t gap = (i > 0) ? cap->records[i].time - cap->records[i-1].time : 0;
+
+	return (gap > 0) ? gap : 0;
+}
+
+void decode(const struct fn_capture *cap) {
+	time_t created = cap->header->created / 1000000000;
+	int64_t offset = 0;
+	size_t i;
+
+	printf("# %zu records, created %s", cap->count, ctime(&created));
+	printf("# %10s\n", "ms");
+
+	for (i = 0; i < cap->count; i++) {
+		if (i > 0 && cap->records[i].time < cap->records[i-1].time) {
+			printf("# restart\n");
+		}
+
+		offset += record_gap(cap, i);
+		print_record(&cap->records[i], offset);
+	}
+}
+
+int replay(int fd, const struct fn_capture *cap, double speed, int verbose) {
+	struct remote_msg_t burst[FN_SCHED_SLOTS];
+	int64_t start = fn_now(), offset = 0;
+	size_t i = 0, j;
+
+	while (i < cap->count) {
+		/* frames handed to the kernel at once are replayed at once */
+		offset += record_gap(cap, i);
+
+		if (speed > 0) {
+			int64_t due = start + offset / speed;
+			struct timespec ts = { due / 1000000000, due % 1000000000 };
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+
+		if (cap->records[i].flags & FN_CAPTURE_SYNC) {
+			if (verbose) print_record(&cap->records[i], offset);
+			if ((int) fn_sync(fd) < 0) {
+				return -1;
+			}
+
+			i++;
+			continue;
+		}
+
+		int n = 0;
+		for (j = i; j < cap->count && n < FN_SCHED_SLOTS; j++) {
+			if ((cap->records[j].flags & FN_CAPTURE_SYNC) || (j > i && record_gap(cap, j) > 0 && speed > 0)) {
+				break;
+			}
+
+			if (verbose) print_record(&cap->records[j], offset);
+			fn_capture_frame(&cap->records[j], &burst[n++]);
+		}
+
+		if ((int) fn_send_frames(fd, burst, n) < 0) {
+			return -1;
+		}
+
+		i = j;
+	}
+
+	/* wait until the last frame is on the wire */
+	tcdrain(fd);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	char port[255] = DEFAULT_DEVICE;
+	double speed = 1;
+	int loops = 1, decode_only = 0, verbose = 0;
+	struct fn_capture cap;
+
+	while (1) {
+		int c = getopt_long(argc, argv, "P:x:ml:dvh", long_options, NULL);
+		if (c == -1) break;
+
+		switch (c) {
+			case 'P': strncpy(port, optarg, sizeof(port) - 1); break;
+			case 'x':
+				speed = atof(optarg);
+				if (speed <= 0) {
+					fprintf(stderr, "invalid speed: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'm': speed = 0; break;
+			case 'l': loops = atoi(optarg); break;
+			case 'd': decode_only = 1; break;
+			case 'v': verbose = 1; break;
+
+			case 'h':
+			case '?':
+				usage(argv);
+				exit((c == '?') ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "capture file required\n");
+		usage(argv);
+		exit(EXIT_FAILURE);
+	}
+
+	/* captured frames are calibrated already */
+	fn_calibration_close();
+
+	if (fn_capture_map(&cap, argv[optind])) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (decode_only) {
+		decode(&cap);
+		fn_capture_unmap(&cap);
+		return EXIT_SUCCESS;
+	}
+
+	int fd = open(port, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror(port);
+		exit(EXIT_FAILURE);
+	}
+
+	struct termios oldtio = fn_init(fd);
+	int64_t begin = fn_now();
+	int i, ret = EXIT_SUCCESS;
+
+	for (i = 0; loops == 0 || i < loops; i++) {
+		if (replay(fd, &cap, speed, verbose)) {
+			perror("failed to replay capture");
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	if (verbose) {
+		printf("replayed %d x %zu records in %.3f s\n", i, cap.count, (fn_now() - begin) / 1e9);
+	}
+
+	tcsetattr(fd, TCSANOW, &oldtio);
+	close(fd);
+	fn_capture_unmap(&cap);
+
+	return ret;
+}
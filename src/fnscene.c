@@ -0,0 +1,229 @@
+/**
+ * fnordlicht scene compiler and player
+ *
+ * compiles CSV sequences into the binary scene format
+ * and plays the timed keyframes of a show
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libfn.h"
+
+#define DEFAULT_DEVICE "/dev/ttyUSB0"
+
+static struct option long_options[] = {
+	{"compile",	required_argument,	0,		'c'},
+	{"port",	required_argument,	0,		'P'},
+	{"speed",	required_argument,	0,		'x'},
+	{"loop",	required_argument,	0,		'l'},
+	{"dump",	no_argument,		0,		'd'},
+	{"verbose",	no_argument,		0,		'v'},
+	{"help",	no_argument,		0,		'h'},
+	{} /* stop condition for iterator */
+};
+
+static char *long_options_descs[] = {
+	"compile the CSV scene into this file",
+	"serial port",
+	"playback speed factor (ex. 2 or 0.5)",
+	"play the show n times (0 for endless)",
+	"print the compiled scene",
+	"print every keyframe while playing",
+	"show this help",
+	NULL /* stop condition for iterator */
+};
+
+void usage(char **argv) {
+	printf("Usage: fnscene [options] scene\n\n");
+	printf("Scenes are CSV files with EEPROM rows (\"address;slot;color;step;delay;pause\")\n");
+	printf("and keyframes of a show (\"@ms;address;color;step;delay\").\n");
+	printf("Rows like \"~ms;address;color\" become fades which reach the color at that time.\n\n");
+	printf("Options:\n");
+
+	struct option *op = long_options;
+	char **desc = long_options_descs;
+	while (op->name && desc) {
+		printf("  -%c, --%s\t%s\n", op->val, op->name, *desc);
+		op++;
+		desc++;
+	}
+}
+
+void print_record(const struct fn_scene_record *rec, int slot) {
+	if (slot) {
+		printf("%u;%u;%02x%02x%02x;%u;%u;%u\n", rec->address, rec->time,
+			rec->color.red, rec->color.green, rec->color.blue, rec->step, rec->delay, rec->pause);
+	}
+	else {
+		printf("@%u;%u;%02x%02x%02x;%u;%u\n", rec->time, rec->address,
+			rec->color.red, rec->color.green, rec->color.blue, rec->step, rec->delay);
+	}
+}
+
+void dump(const struct fn_scene *sc) {
+	size_t i;
+
+	printf("# %zu EEPROM rows, %zu keyframes, %.3f s\n", sc->slot_count, sc->keyframe_count, sc->header->duration / 1e3);
+
+	for (i = 0; i < sc->slot_count; i++) {
+		print_record(&sc->slots[i], 1);
+	}
+
+	for (i = 0; i < sc->keyframe_count; i++) {
+		print_record(&sc->keyframes[i], 0);
+	}
+}
+
+int play(int fd, const struct fn_scene *sc, double speed, int verbose) {
+	struct remote_msg_t burst[FN_SCHED_SLOTS];
+	int64_t start = fn_now();
+	size_t i = 0, j;
+	int n;
+
+	while (i < sc->keyframe_count) {
+		int64_t due = start + (int64_t) (sc->keyframes[i].time * 1e6 / speed);
+		struct timespec ts = { due / 1000000000, due % 1000000000 };
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+		j = fn_scene_batch(sc, i, burst, FN_SCHED_SLOTS, &n);
+		if ((int) fn_send_frames(fd, burst, n) < 0) {
+			return -1;
+		}
+
+		for (; verbose && i < j; i++) {
+			print_record(&sc->keyframes[i], 0);
+		}
+
+		i = j;
+	}
+
+	/* the last fades may still be on their way */
+	int64_t end = start + (int64_t) (sc->header->duration * 1e6 / speed);
+	struct timespec ts = { end / 1000000000, end % 1000000000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+	tcdrain(fd);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	char port[255] = DEFAULT_DEVICE;
+	char output[1024] = "";
+	double speed = 1;
+	int loops = 1, dump_only = 0, verbose = 0;
+	struct fn_scene sc;
+
+	while (1) {
+		int c = getopt_long(argc, argv, "c:P:x:l:dvh", long_options, NULL);
+		if (c == -1) break;
+
+		switch (c) {
+			case 'c': strncpy(output, optarg, sizeof(output) - 1); break;
+			case 'P': strncpy(port, optarg, sizeof(port) - 1); break;
+			case 'x':
+				speed = atof(optarg);
+				if (speed <= 0) {
+					fprintf(stderr, "invalid speed: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'l': loops = atoi(optarg); break;
+			case 'd': dump_only = 1; break;
+			case 'v': verbose = 1; break;
+
+			case 'h':
+			case '?':
+				usage(argv);
+				exit((c == '?') ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "scene required\n");
+		usage(argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (strlen(output)) {
+		int n = fn_scene_compile(argv[optind], output);
+		if (n < 0) {
+			perror(argv[optind]);
+			exit(EXIT_FAILURE);
+		}
+
+		if (verbose) printf("compiled %d rows into %s\n", n, output);
+		return EXIT_SUCCESS;
+	}
+
+	if (fn_scene_map(&sc, argv[optind])) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (dump_only) {
+		dump(&sc);
+		fn_scene_unmap(&sc);
+		return EXIT_SUCCESS;
+	}
+
+	if (sc.keyframe_count == 0) {
+		fprintf(stderr, "%s has no keyframes, upload its EEPROM rows with: fnctl eeprom -F %s\n", argv[optind], argv[optind]);
+		fn_scene_unmap(&sc);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = open(port, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror(port);
+		exit(EXIT_FAILURE);
+	}
+
+	struct termios oldtio = fn_init(fd);
+	int i, ret = EXIT_SUCCESS;
+
+	fn_sync(fd);
+
+	for (i = 0; loops == 0 || i < loops; i++) {
+		if (play(fd, &sc, speed, verbose)) {
+			perror("failed to play scene");
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	tcsetattr(fd, TCSANOW, &oldtio);
+	close(fd);
+	fn_scene_unmap(&sc);
+
+	return ret;
+}
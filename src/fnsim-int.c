@@ -0,0 +1,68 @@
+/**
+ * fnordlicht bus simulator - interrupt line
+ *
+ * ptys have no modem lines: preloaded into a program talking
+ * to fnsim, this answers TIOCMGET from the file fnsim publishes
+ * its interrupt line in (FN_INT_FILE)
+ *
+ * LD_PRELOAD=fnsim-int.so FN_INT_FILE=/tmp/fnsim.int fnctl ...
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/ioctl.h>
+
+#include "libfn.h"
+
+int ioctl(int fd, unsigned long request, ...) {
+	static int (*next)(int, unsigned long, ...);
+	const char *path = getenv("FN_INT_FILE");
+	va_list ap;
+	void *arg;
+	int ret, efd;
+	char level;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!next) {
+		next = dlsym(RTLD_NEXT, "ioctl");
+	}
+
+	ret = next(fd, request, arg);
+
+	/* only where the real line is missing */
+	if (ret < 0 && request == TIOCMGET && path && (efd = open(path, O_RDONLY)) >= 0) {
+		*(int *) arg = (read(efd, &level, 1) == 1 && level == '1') ? FN_INT_LINE : 0;
+		close(efd);
+		ret = 0;
+	}
+
+	return ret;
+}
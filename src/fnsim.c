@@ -0,0 +1,812 @@
+/**
+ * fnordlicht bus simulator
+ *
+ * emulates a chain of fnordlichts behind a pseudo terminal
+ * to run the tools without hardware
+ *
+ * implements the fnordlicht bus protocol
+ * @see https://raw.github.com/fd0/fnordlicht/master/doc/PROTOCOL
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <termios.h>
+
+#include "libfn.h"
+
+#define PAUSE_TICKS	10	/* pauses and sleeps are given in 100ms */
+#define INT_TICKS	5	/* PULL_INT delay is given in 50ms */
+#define BYTE_NSEC	(10 * 1000000000LL / FN_BITRATE)	/* 8N1 */
+
+#ifndef PKGLIBDIR
+#define PKGLIBDIR	"/usr/local/lib/libfn"	/* where fnsim-int.so gets installed */
+#endif
+
+enum program_state_t {
+	PROGRAM_NONE,
+	PROGRAM_FADING,		/* waiting for the current fade to finish */
+	PROGRAM_SLEEPING	/* waiting for 'wake' */
+};
+
+struct device_t {
+	uint8_t address;
+	bool powered;
+	bool bootloader;
+
+	/* bootloader */
+	uint16_t boot_address;
+	uint8_t boot_size;
+	int boot_fill;
+	uint8_t boot_buffer[256];
+	uint8_t *flash;			/* allocated on first write */
+
+	/* fader */
+	struct rgb_color_t current;
+	struct rgb_color_t target;
+	uint8_t step;
+	uint8_t delay;
+
+	/* EEPROM */
+	struct remote_msg_save_rgb_t eeprom[CONFIG_EEPROM_COLORS];
+	struct remote_msg_config_offsets_t offsets;
+	struct remote_msg_config_startup_t startup;
+
+	/* static programs */
+	int program;
+	enum program_state_t state;
+	unsigned long wake;
+	union program_params_t params;
+	int16_t hue;
+	int slot;
+	int direction;
+
+	unsigned long int_until;	/* tick until which INT is pulled */
+
+	/* command to color latency */
+	int64_t fade_since;
+};
+
+struct stats_t {
+	unsigned long bytes;
+	unsigned long frames;
+	unsigned long syncs;
+	unsigned long unknown;
+	unsigned long corrupted;
+	unsigned long pages;
+
+	unsigned long fades;
+	int64_t latency_sum;
+	int64_t latency_max;
+};
+
+static struct option long_options[] = {
+	{"count",	required_argument,	0,		'n'},
+	{"link",	required_argument,	0,		'l'},
+	{"int",		required_argument,	0,		'i'},
+	{"status",	required_argument,	0,		's'},
+	{"unpaced",	no_argument,		0,		'u'},
+	{"errors",	required_argument,	0,		'e'},
+	{"verbose",	no_argument,		0,		'v'},
+	{"help",	no_argument,		0,		'h'},
+	{} /* stop condition for iterator */
+};
+
+static char *long_options_descs[] = {
+	"number of simulated fnordlichts (default: 10)",
+	"create a symlink to the pseudo terminal",
+	"file to publish the interrupt line (read by fnsim-int.so)",
+	"file to dump the device state to (every 100ms)",
+	"consume bytes as fast as possible instead of 19200 baud",
+	"corrupt this percentage of bootloader data frames",
+	"print every received frame",
+	"show this help",
+	NULL /* stop condition for iterator */
+};
+
+volatile bool terminate = false;
+volatile bool dump = false;
+
+struct device_t *devices;
+int device_count = 10;
+unsigned long ticks = 0;
+struct stats_t stats;
+int verbose = 0;
+int errors = 0;
+
+void quit(int sig) {
+	terminate = true;
+}
+
+void request_dump(int sig) {
+	dump = true;
+}
+
+void usage(char **argv) {
+	printf("Usage: fnsim [options]\n\n");
+	printf("Options:\n");
+
+	struct option *op = long_options;
+	char **desc = long_options_descs;
+	while (op->name && desc) {
+		printf("  -%c, --%s\t%s\n", op->val, op->name, *desc);
+		op++;
+		desc++;
+	}
+}
+
+void fade(struct device_t *dev, struct rgb_color_t color, uint8_t step, uint8_t delay) {
+	dev->target = color;
+	dev->step = step;
+	dev->delay = delay;
+}
+
+bool fade_done(struct device_t *dev) {
+	return memcmp(&dev->current, &dev->target, sizeof(struct rgb_color_t)) == 0;
+}
+
+void program_next(struct device_t *dev) {
+	switch (dev->program) {
+		case 0: { /* colorwheel */
+			struct colorwheel_params_t *p = &dev->params.colorwheel;
+			struct hsv_color_t hsv = { { { (dev->hue % 360 + 360) % 360, p->saturation, p->value } } };
+
+			fade(dev, fn_hsv2rgb(hsv), p->fade_step, p->fade_delay);
+			dev->hue += p->hue_step;
+			break;
+		}
+
+		case 1: { /* random */
+			struct random_params_t *p = &dev->params.random;
+			int16_t hue, tries = 0;
+			int d;
+
+			do { /* angular distance to the previous hue */
+				hue = rand() % 360;
+				d = abs(hue - dev->hue) % 360;
+				d = (d > 180) ? 360 - d : d;
+			} while (d < p->min_distance && ++tries < 100);
+
+			struct hsv_color_t hsv = { { { hue, p->saturation, p->value } } };
+			fade(dev, fn_hsv2rgb(hsv), p->fade_step, p->fade_delay);
+			dev->hue = hue;
+			break;
+		}
+
+		case 2: { /* replay */
+			struct replay_params_t *p = &dev->params.replay;
+
+			if (dev->slot > p->end || dev->slot < p->start) {
+				if (p->repeat == REPEAT_START) {
+					dev->slot = p->start;
+				}
+				else if (p->repeat == REPEAT_REVERSE) {
+					dev->direction = -dev->direction;
+					dev->slot += 2 * dev->direction;
+				}
+				else {
+					dev->program = -1;
+					dev->state = PROGRAM_NONE;
+					return;
+				}
+			}
+
+			struct remote_msg_save_rgb_t *e = &dev->eeprom[dev->slot % CONFIG_EEPROM_COLORS];
+			fade(dev, e->color, e->step, e->delay);
+			dev->slot += dev->direction;
+			break;
+		}
+
+		default:
+			dev->program = -1;
+			dev->state = PROGRAM_NONE;
+			return;
+	}
+
+	dev->state = PROGRAM_FADING;
+}
+
+void program_start(struct device_t *dev, uint8_t script, union program_params_t *params) {
+	dev->program = script;
+	dev->params = *params;
+	dev->direction = 1;
+
+	switch (script) {
+		case 0:
+			dev->hue = params->colorwheel.hue_start +
+				params->colorwheel.add_addr * dev->address * params->colorwheel.hue_step;
+			break;
+
+		case 1:
+			srand(params->random.seed + ((params->random.use_address) ? dev->address : 0));
+			dev->hue = -360;
+			break;
+
+		case 2:
+			dev->slot = params->replay.start;
+			break;
+	}
+
+	program_next(dev);
+}
+
+void program_tick(struct device_t *dev) {
+	switch (dev->state) {
+		case PROGRAM_FADING:
+			if (fade_done(dev)) {
+				unsigned long sleep = 0;
+
+				switch (dev->program) {
+					case 0: sleep = dev->params.colorwheel.fade_sleep * PAUSE_TICKS; break;
+					case 1: sleep = dev->params.random.fade_sleep * PAUSE_TICKS; break;
+					case 2: sleep = dev->eeprom[(dev->slot - dev->direction) % CONFIG_EEPROM_COLORS].pause * PAUSE_TICKS; break;
+				}
+
+				dev->state = PROGRAM_SLEEPING;
+				dev->wake = ticks + sleep;
+			}
+			break;
+
+		case PROGRAM_SLEEPING:
+			if (ticks >= dev->wake) {
+				program_next(dev);
+			}
+			break;
+
+		case PROGRAM_NONE:
+			break;
+	}
+}
+
+void fader_tick(struct device_t *dev) {
+	int i;
+
+	if (fade_done(dev) || dev->step == 0 || ticks % ((dev->delay) ? dev->delay : 1)) {
+		return;
+	}
+
+	for (i = 0; i < 3; i++) {
+		int d = dev->target.rgb[i] - dev->current.rgb[i];
+
+		if (d > dev->step) dev->current.rgb[i] += dev->step;
+		else if (-d > dev->step) dev->current.rgb[i] -= dev->step;
+		else dev->current.rgb[i] = dev->target.rgb[i];
+	}
+
+	if (fade_done(dev) && dev->fade_since) {
+		int64_t latency = fn_now() - dev->fade_since;
+
+		stats.fades++;
+		stats.latency_sum += latency;
+		if (latency > stats.latency_max) stats.latency_max = latency;
+
+		dev->fade_since = 0;
+	}
+}
+
+/* crc mismatches are reported by pulling the interrupt line */
+void boot_verify(struct device_t *dev, const uint8_t *data, uint16_t len, uint16_t checksum, uint8_t delay) {
+	if (fn_crc16(0xffff, data, len) != checksum) {
+		dev->int_until = ticks + delay * INT_TICKS;
+	}
+}
+
+void handle_boot_msg(struct device_t *dev, struct remote_msg_t *msg) {
+	switch (msg->cmd) {
+		case REMOTE_CMD_BOOT_CONFIG:
+			dev->boot_address = msg->boot_config.start_address;
+			dev->boot_size = msg->boot_config.buffersize;
+			dev->boot_fill = 0;
+			break;
+
+		case REMOTE_CMD_BOOT_INIT:
+			dev->boot_fill = 0;
+			memset(dev->boot_buffer, 0xff, sizeof(dev->boot_buffer));
+			break;
+
+		case REMOTE_CMD_BOOT_DATA: {
+			int n = sizeof(dev->boot_buffer) - dev->boot_fill;
+			if (n > REMOTE_MSG_LEN-2) n = REMOTE_MSG_LEN-2;
+
+			memcpy(dev->boot_buffer + dev->boot_fill, msg->data, n);
+			if (errors && rand() % 100 < errors) { /* line noise */
+				dev->boot_buffer[dev->boot_fill] ^= 0x01;
+				stats.corrupted++;
+			}
+			dev->boot_fill += n;
+			break;
+		}
+
+		case REMOTE_CMD_CRC_CHECK: {
+			uint16_t len = msg->boot_crc_check.len;
+			if (len > sizeof(dev->boot_buffer)) len = sizeof(dev->boot_buffer);
+
+			boot_verify(dev, dev->boot_buffer, len, msg->boot_crc_check.checksum, msg->boot_crc_check.delay);
+			break;
+		}
+
+		case REMOTE_CMD_FLASH: {
+			int size = (dev->boot_size) ? dev->boot_size : 256;
+
+			if (!dev->flash && (dev->flash = malloc(FN_FLASH_SIZE))) {
+				memset(dev->flash, 0xff, FN_FLASH_SIZE);
+			}
+
+			if (dev->flash && dev->boot_address + size <= FN_FLASH_SIZE) {
+				memcpy(dev->flash + dev->boot_address, dev->boot_buffer, size);
+				dev->boot_address += size;
+				stats.pages++;
+			}
+			break;
+		}
+
+		case REMOTE_CMD_CRC_FLASH: {
+			uint16_t start = msg->boot_crc_flash.start, len = msg->boot_crc_flash.len;
+			uint16_t checksum = msg->boot_crc_flash.checksum;
+
+			if (!dev->flash || start + len > FN_FLASH_SIZE) {
+				dev->int_until = ticks + msg->boot_crc_flash.delay * INT_TICKS;
+			}
+			else {
+				boot_verify(dev, dev->flash + start, len, checksum, msg->boot_crc_flash.delay);
+			}
+			break;
+		}
+
+		case REMOTE_CMD_ENTER_APP:
+			dev->bootloader = false;
+			break;
+	}
+}
+
+void handle_msg(struct device_t *dev, struct remote_msg_t *msg, int64_t received) {
+	/* any frame wakes a device from powerdown */
+	dev->powered = true;
+
+	if (dev->bootloader) {
+		handle_boot_msg(dev, msg);
+		return;
+	}
+
+	switch (msg->cmd) {
+		case REMOTE_CMD_FADE_RGB:
+			dev->program = -1;
+			dev->state = PROGRAM_NONE;
+			fade(dev, msg->fade_rgb.color, msg->fade_rgb.step, msg->fade_rgb.delay);
+			dev->fade_since = (fade_done(dev)) ? 0 : received;
+			break;
+
+		case REMOTE_CMD_FADE_HSV: {
+			struct remote_msg_fade_hsv_t hsv;
+			memcpy(&hsv, msg, sizeof(hsv)); /* overlays the whole message */
+
+			dev->program = -1;
+			dev->state = PROGRAM_NONE;
+			fade(dev, fn_hsv2rgb(hsv.color), hsv.step, hsv.delay);
+			dev->fade_since = (fade_done(dev)) ? 0 : received;
+			break;
+		}
+
+		case REMOTE_CMD_SAVE_RGB:
+			if (msg->save_rgb.slot < CONFIG_EEPROM_COLORS) {
+				dev->eeprom[msg->save_rgb.slot] = msg->save_rgb;
+			}
+			break;
+
+		case REMOTE_CMD_SAVE_HSV: {
+			struct remote_msg_save_hsv_t hsv;
+			memcpy(&hsv, msg, sizeof(hsv));
+
+			if (hsv.slot < CONFIG_EEPROM_COLORS) {
+				struct remote_msg_save_rgb_t *e = &dev->eeprom[hsv.slot];
+				e->slot = hsv.slot;
+				e->step = hsv.step;
+				e->delay = hsv.delay;
+				e->pause = hsv.pause;
+				e->color = fn_hsv2rgb(hsv.color);
+			}
+			break;
+		}
+
+		case REMOTE_CMD_SAVE_CURRENT:
+			if (msg->save_current.slot < CONFIG_EEPROM_COLORS) {
+				struct remote_msg_save_rgb_t *e = &dev->eeprom[msg->save_current.slot];
+				e->slot = msg->save_current.slot;
+				e->step = msg->save_current.step;
+				e->delay = msg->save_current.delay;
+				e->pause = msg->save_current.pause;
+				e->color = dev->current;
+			}
+			break;
+
+		case REMOTE_CMD_CONFIG_OFFSETS:
+			dev->offsets = msg->config_offsets;
+			break;
+
+		case REMOTE_CMD_CONFIG_STARTUP:
+			memcpy(&dev->startup, msg->data, sizeof(dev->startup));
+			break;
+
+		case REMOTE_CMD_START_PROGRAM: {
+			union program_params_t params;
+			memcpy(&params, &msg->start_program.params, sizeof(params));
+			program_start(dev, msg->start_program.script, &params);
+			break;
+		}
+
+		case REMOTE_CMD_STOP:
+			dev->program = -1;
+			dev->state = PROGRAM_NONE;
+			if (msg->msg_stop.fade) {
+				dev->target = dev->current;
+			}
+			break;
+
+		case REMOTE_CMD_MODIFY_CURRENT: {
+			int i;
+			for (i = 0; i < 3; i++) {
+				int v = dev->target.rgb[i] + msg->modify_current.rgb.rgb[i];
+				dev->target.rgb[i] = (v < 0) ? 0 : (v > 255) ? 255 : v;
+			}
+			dev->step = msg->modify_current.step;
+			dev->delay = msg->modify_current.delay;
+			break;
+		}
+
+		case REMOTE_CMD_PULL_INT:
+			dev->int_until = ticks + msg->pull_int.delay * INT_TICKS;
+			break;
+
+		case REMOTE_CMD_POWERDOWN:
+			dev->powered = false;
+			dev->program = -1;
+			dev->state = PROGRAM_NONE;
+			memset(&dev->current, 0, sizeof(struct rgb_color_t));
+			memset(&dev->target, 0, sizeof(struct rgb_color_t));
+			break;
+
+		case REMOTE_CMD_BOOTLOADER:
+			if (msg->bootloader.magic[0] == BOOTLOADER_MAGIC_BYTE1 && msg->bootloader.magic[1] == BOOTLOADER_MAGIC_BYTE2 &&
+			    msg->bootloader.magic[2] == BOOTLOADER_MAGIC_BYTE3 && msg->bootloader.magic[3] == BOOTLOADER_MAGIC_BYTE4) {
+				dev->bootloader = true;
+			}
+			break;
+
+		default:
+			stats.unknown++;
+			break;
+	}
+}
+
+void dispatch(struct remote_msg_t *msg, int64_t received) {
+	int i;
+
+	stats.frames++;
+
+	if (verbose) {
+		printf("frame: ");
+		for (i = 0; i < REMOTE_MSG_LEN; i++) {
+			printf("%02X", *((uint8_t *) msg+i));
+		}
+		printf("\n");
+	}
+
+	for (i = 0; i < device_count; i++) {
+		if (msg->address == REMOTE_ADDR_BROADCAST || msg->address == devices[i].address) {
+			handle_msg(&devices[i], msg, received);
+		}
+	}
+}
+
+/* byte stream parser, mirrors the firmware's remote.c */
+void parse(uint8_t byte, int64_t received) {
+	static struct remote_msg_t msg;
+	static int offset = 0, sync_len = 0;
+	static bool want_address = false;
+	int i;
+
+	stats.bytes++;
+
+	if (want_address) {
+		/* every device takes the address byte and forwards it incremented */
+		for (i = 0; i < device_count; i++) {
+			devices[i].address = byte + i;
+		}
+
+		want_address = false;
+		offset = 0;
+		stats.syncs++;
+		return;
+	}
+
+	sync_len = (byte == REMOTE_SYNC_BYTE) ? sync_len + 1 : 0;
+	if (sync_len == REMOTE_SYNC_LEN) {
+		want_address = true;
+		sync_len = 0;
+		return;
+	}
+
+	((uint8_t *) &msg)[offset++] = byte;
+	if (offset == REMOTE_MSG_LEN) {
+		offset = 0;
+
+		if (msg.cmd != REMOTE_CMD_RESYNC) {
+			dispatch(&msg, received);
+		}
+	}
+}
+
+void write_int(int fd, bool level) {
+	static int last = -1;
+
+	if (fd >= 0 && level != last) {
+		if (pwrite(fd, (level) ? "1" : "0", 1, 0) < 0) {
+			perror("failed to publish interrupt line");
+		}
+		last = level;
+	}
+}
+
+void write_status(FILE *f) {
+	int i;
+
+	fprintf(f, "# address;current;target;step;delay;program;int\n");
+	for (i = 0; i < device_count; i++) {
+		struct device_t *dev = &devices[i];
+
+		fprintf(f, "%d;%02x%02x%02x;%02x%02x%02x;%d;%d;%d;%d%s%s\n", dev->address,
+			dev->current.red, dev->current.green, dev->current.blue,
+			dev->target.red, dev->target.green, dev->target.blue,
+			dev->step, dev->delay, dev->program, dev->int_until > ticks,
+			(dev->powered) ? "" : ";off", (dev->bootloader) ? ";bootloader" : "");
+	}
+}
+
+void dump_status(const char *path) {
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+	if (f) {
+		write_status(f);
+		fclose(f);
+		rename(tmp, path);
+	}
+}
+
+void print_stats(int64_t elapsed) {
+	double secs = elapsed / 1e9;
+
+	printf("%lu bytes, %lu frames (%.1f frames/s), %lu syncs, %lu unknown\n",
+		stats.bytes, stats.frames, stats.frames / secs, stats.syncs, stats.unknown);
+
+	if (stats.fades) {
+		printf("command to color latency: avg %.1f ms, max %.1f ms over %lu fades\n",
+			stats.latency_sum / 1e6 / stats.fades, stats.latency_max / 1e6, stats.fades);
+	}
+
+	if (stats.pages) {
+		printf("%lu pages flashed, %lu data frames corrupted\n", stats.pages, stats.corrupted);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	char link[1024] = "";
+	char int_path[1024] = "";
+	char status_path[1024] = "";
+	bool paced = true;
+	int i, int_fd = -1;
+
+	while (1) {
+		int c = getopt_long(argc, argv, "n:l:i:s:ue:vh", long_options, NULL);
+		if (c == -1) break;
+
+		switch (c) {
+			case 'n':
+				device_count = atoi(optarg);
+				if (device_count < 1 || device_count > FN_MAX_DEVICES) {
+					fprintf(stderr, "invalid device count: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'l': strncpy(link, optarg, sizeof(link) - 1); break;
+			case 'i': strncpy(int_path, optarg, sizeof(int_path) - 1); break;
+			case 's': strncpy(status_path, optarg, sizeof(status_path) - 1); break;
+			case 'u': paced = false; break;
+			case 'e': errors = atoi(optarg); break;
+			case 'v': verbose = 1; break;
+
+			case 'h':
+			case '?':
+				usage(argv);
+				exit((c == '?') ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	/* bind signals */
+	struct sigaction action;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = 0;
+
+	action.sa_handler = quit;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	action.sa_handler = request_dump;
+	sigaction(SIGUSR1, &action, NULL);
+
+	/* create pseudo terminal */
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master)) {
+		perror("failed to create pseudo terminal");
+		exit(EXIT_FAILURE);
+	}
+
+	/* keep the slave open, so the master doesn't hang up between clients */
+	char *slave_name = ptsname(master);
+	int slave = open(slave_name, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(slave_name);
+		exit(EXIT_FAILURE);
+	}
+
+	struct termios tio;
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	if (strlen(link)) {
+		unlink(link);
+		if (symlink(slave_name, link)) {
+			perror(link);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (strlen(int_path)) {
+		int_fd = open(int_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (int_fd < 0) {
+			perror(int_path);
+			exit(EXIT_FAILURE);
+		}
+		write_int(int_fd, false);
+	}
+
+	/* initialize devices */
+	devices = calloc(device_count, sizeof(struct device_t));
+	for (i = 0; i < device_count; i++) {
+		devices[i].address = i;
+		devices[i].powered = true;
+		devices[i].program = -1;
+		devices[i].step = 255;
+	}
+
+	printf("simulating %d fnordlichts on %s\n", device_count, (strlen(link)) ? link : slave_name);
+	if (int_fd >= 0) printf("interrupt line: LD_PRELOAD=%s/fnsim-int.so FN_INT_FILE=%s\n", PKGLIBDIR, int_path);
+	fflush(stdout);
+
+	int64_t start = fn_now();
+	int64_t next_tick = start + FN_TICK_NSEC;
+	int64_t budget_since = start;
+	int64_t credit = 0; /* bytes the line could have carried */
+
+	while (!terminate) {
+		int64_t now = fn_now();
+		struct pollfd pfd = { .fd = master, .events = POLLIN };
+		int timeout = (next_tick > now) ? (next_tick - now) / 1000000 + 1 : 0;
+
+		/* when paced, stop reading until the wire could carry more bytes */
+		if (paced && credit <= 0) {
+			pfd.events = 0;
+			timeout = 1;
+		}
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		now = fn_now();
+
+		if (paced) {
+			int64_t earned = (now - budget_since) / BYTE_NSEC;
+
+			budget_since += earned * BYTE_NSEC;
+			credit += earned;
+			if (credit > 2) { /* idle line does not save up, the UART buffers two bytes */
+				credit = 2;
+			}
+		}
+
+		if (pfd.revents & POLLIN) {
+			uint8_t buf[256];
+			size_t max = (paced && credit < sizeof(buf)) ? credit : sizeof(buf);
+			ssize_t q = read(master, buf, max);
+
+			for (i = 0; i < q; i++) {
+				parse(buf[i], now);
+			}
+
+			if (q > 0 && paced) {
+				credit -= q;
+			}
+		}
+
+		/* advance firmware time */
+		while (now >= next_tick) {
+			bool line = false;
+			int d;
+
+			ticks++;
+			next_tick += FN_TICK_NSEC;
+
+			for (d = 0; d < device_count; d++) {
+				fader_tick(&devices[d]);
+				program_tick(&devices[d]);
+
+				if (devices[d].int_until > ticks) {
+					line = true;
+				}
+			}
+
+			write_int(int_fd, line);
+
+			if (strlen(status_path) && ticks % PAUSE_TICKS == 0) {
+				dump_status(status_path);
+			}
+		}
+
+		if (dump) {
+			write_status(stdout);
+			print_stats(fn_now() - start);
+			fflush(stdout);
+			dump = false;
+		}
+	}
+
+	print_stats(fn_now() - start);
+
+	/* housekeeping */
+	if (strlen(link)) unlink(link);
+	if (int_fd >= 0) {
+		close(int_fd);
+		unlink(int_path);
+	}
+	close(slave);
+	close(master);
+	for (i = 0; i < device_count; i++) {
+		free(devices[i].flash);
+	}
+	free(devices);
+
+	return EXIT_SUCCESS;
+}
@@ -2,6 +2,11 @@
  * fnordlicht vu meter
  *
  * vizualize pulsaudio
+ *
+ * capture, analysis and lamp output run in their own threads and pass
+ * blocks through lock-free rings, the window is drawn by the main thread
+ * and never holds up the lamps
+ *
  * @see http://www.steffenvogel.de/2010/11/12/fnordlicht-vu-meter/
  *
  * @copyright	2013 Steffen Vogel
@@ -35,6 +40,10 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <complex.h>
+#include <signal.h>
+#include <pthread.h>
+#include <limits.h>
+#include <getopt.h>
 
 /* third party libs */
 #include <SDL/SDL.h>
@@ -45,130 +54,316 @@
 
 #include "libfn.h"
 
-#define N		2048
 #define SAMPLING_RATE	44100
 
 #define MIN_FREQ	70
 #define MAX_FREQ	9000
 
-#define MIN_K		(MIN_FREQ*N/SAMPLING_RATE)
-#define MAX_K		(MAX_FREQ*N /SAMPLING_RATE)
+#define MAX_WINDOW	8192
+#define MAX_BINS	(MAX_FREQ*MAX_WINDOW/SAMPLING_RATE + 1)
 
 #define LINE_WIDTH	1
-#define SCREEN_WIDTH	LINE_WIDTH*(MAX_K - MIN_K)
+#define SCREEN_WIDTH	LINE_WIDTH*(max_k - min_k)
 #define SCREEN_HEIGHT	SCREEN_WIDTH/2
 #define VUM_HEIGHT	SCREEN_HEIGHT/6
+#define SPECTRUM_GAIN	64	/* full scale sine: 64 times the window height */
+
+#define ATTACK		0.01	/* s */
+#define RELEASE		0.3
+#define DYNAMIC_RANGE	60	/* dB between a dark lamp and a full scale sine */
+
+#define ONSET_BANDS	16
+#define MIN_BPM		60
+#define MAX_BPM		180
 
 #define TITLE		"fnordlicht visualization"
+#define WISDOM_FILE	"fftw.wisdom"
+
+#define PCM_BLOCKS	64	/* ~370 ms of audio at the default hop */
+#define ANALYSIS_SLOTS	4
+
+/* capture -> dsp */
+struct pcm_block {
+	int64_t captured;	/* when the last sample arrived (CLOCK_MONOTONIC, ns) */
+	int16_t samples[];	/* one hop */
+};
+
+/* dsp -> lamps and dsp -> window */
+struct analysis {
+	int64_t captured;
+	float level;
+	float ampl[MAX_BINS];	/* min_k .. max_k, 1.0 is a full scale sine */
+	uint16_t hue[MAX_BINS];
+	float band[FN_MAX_DEVICES];	/* brightness per lamp (0..1) */
+
+	int onset;		/* something started in this hop */
+	int64_t beat;		/* the next beat (CLOCK_MONOTONIC, ns), 0 without a tempo */
+	int64_t period;		/* ns */
+};
+
+/* sliding window over the last samples, analysed every hop */
+struct analyser {
+	int window, hop;
+	int16_t *history;
+	long sum;		/* of the absolute samples in history */
+
+	double *hann;
+	double *in;
+	complex *out;		/* window/2 + 1 bins */
+	fftw_plan plan;
+
+	struct fn_bands bands;	/* one per lamp, ONSET_BANDS for beats */
+	struct fn_onset onset;
+};
+
+/* what the window shows, so that only changes get drawn */
+struct display {
+	SDL_Surface *screen;	/* 32 bit pixels */
+	uint32_t palette[360];	/* pixel value per hue */
+	uint32_t background;
+
+	int height[MAX_BINS];	/* pixels */
+	uint16_t hue[MAX_BINS];
+	int level;
+	uint16_t level_hue;
+
+	SDL_Rect dirty[MAX_BINS + 1];
+	int ndirty;
+};
+
+enum mode {
+	MODE_LEVEL,	/* whole chain flashes on loud audio */
+	MODE_SPECTRUM,	/* one band per lamp */
+	MODE_BEAT	/* whole chain flashes on the beat */
+};
+
+static struct option long_options[] = {
+	{"port",	required_argument,	0,		'P'},
+	{"count",	required_argument,	0,		'c'},
+	{"window",	required_argument,	0,		'w'},
+	{"hop",		required_argument,	0,		'H'},
+	{"mode",	required_argument,	0,		'm'},
+	{"fps",		required_argument,	0,		'f'},
+	{"headless",	no_argument,		0,		'n'},
+	{"help",	no_argument,		0,		'h'},
+	{} /* stop condition for iterator */
+};
+
+static char *long_options_descs[] = {
+	"serial port",
+	"number of devices (default: count them)",
+	"samples per FFT (default: 2048)",
+	"samples between two FFTs (default: 256)",
+	"level, spectrum or beat (default: level)",
+	"window refreshs per second (default: 60)",
+	"no window, lamps only",
+	"show this help",
+	NULL /* stop condition for iterator */
+};
+
+struct fn_shadow fn_shadow;
+
+static volatile sig_atomic_t terminate = 0;
+
+static struct fn_ring pcm_ring, lamp_ring, display_ring;
+static struct analyser analyser;
+static pa_simple *pa = NULL;
+static int fd = -1, fn_num = -1;
+static const char *verify = NULL;	/* port with a cached count, the lamp stage walks it */
+static int min_k, max_k;
+static enum mode mode = MODE_LEVEL;
+static int headless = 0;
+
+/* audio to lamp latency */
+static int64_t latency_sum = 0, latency_max = 0;
+static unsigned long latency_count = 0, skipped = 0;
+
+void usage(char **argv) {
+	printf("Usage: fnvum [options] [port [count]]\n\n");
+	printf("Options:\n");
+
+	struct option *op = long_options;
+	char **desc = long_options_descs;
+	while (op->name && desc) {
+		printf("  -%c, --%s\t%s\n", op->val, op->name, *desc);
+		op++;
+		desc++;
+	}
+}
 
-double normalize_auditory(double freq, double spl) {
-	return spl; // TODO implement
+struct rgb_color_t level2color(double level) {
+	struct hsv_color_t hsv;
+
+	hsv.hue = level * 360;
+	hsv.saturation = 255;
+	hsv.value = 255;
+
+	return fn_hsv2rgb(hsv);
 }
 
-struct rgb_color_t hsv2rgb(struct hsv_color_t hsv) {
-	struct rgb_color_t rgb;
+/* the bands stay as they are, the next start picks the new count up */
+void topology_changed(const char *device, int old_count, int new_count, void *arg) {
+	printf("found %d fnordlichts (was %d)\n", new_count, old_count);
+}
 
-	uint16_t h = hsv.hue % 360;
-	uint8_t s = hsv.saturation;
-	uint8_t v = hsv.value;
+/* the whole window once, black */
+int display_init(struct display *d, SDL_Surface *screen) {
+	struct hsv_color_t hsv[360];
+	struct rgb_color_t rgb[360];
+	int i;
 
-	uint16_t f = ((h % 60) * 255 + 30)/60;
-	uint16_t p = (v * (255-s)+128)/255;
-	uint16_t q = ((v * (255 - (s*f+128)/255))+128)/255;
-	uint16_t t = (v * (255 - ((s * (255 - f))/255)))/255;
-	uint8_t i = h/60;
+	memset(d, 0, sizeof(struct display));
+	d->screen = screen;
 
-	switch (i) {
-		case 0:	rgb.red = v; rgb.green = t; rgb.blue = p; break;
-		case 1:	rgb.red = q; rgb.green = v; rgb.blue = p; break;
-		case 2:	rgb.red = p; rgb.green = v; rgb.blue = t; break;
-		case 3:	rgb.red = p; rgb.green = q; rgb.blue = v; break;
-		case 4:	rgb.red = t; rgb.green = p; rgb.blue = v; break;
-		case 5:	rgb.red = v; rgb.green = p; rgb.blue = q; break;
+	/* one pixel value per hue: no SDL_MapRGB() while drawing */
+	for (i = 0; i < 360; i++) {
+		hsv[i].hue = i;
+		hsv[i].saturation = 255;
+		hsv[i].value = 255;
 	}
 
-	return rgb;
+	fn_hsv2rgb_batch(rgb, hsv, 360);
+
+	for (i = 0; i < 360; i++) {
+		d->palette[i] = SDL_MapRGB(screen->format, rgb[i].red, rgb[i].green, rgb[i].blue);
+	}
+
+	d->background = SDL_MapRGB(screen->format, 0, 0, 0);
+
+	SDL_FillRect(screen, &screen->clip_rect, d->background);
+	SDL_Flip(screen);
+
+	return 0;
 }
 
-struct rgb_color_t phasor2color(complex phasor) {
-	struct hsv_color_t hsv;
+/* straight into the locked 32 bit surface */
+void fill(struct display *d, int x0, int x1, int y0, int y1, uint32_t pixel) {
+	int x, y;
 
-	hsv.hue = 180*(carg(phasor)+M_PI)/M_PI;
-	hsv.saturation = 255;
-	hsv.value = 255;
+	for (y = y0; y < y1; y++) {
+		uint32_t *row = (uint32_t *) ((uint8_t *) d->screen->pixels + y * d->screen->pitch);
 
-	return hsv2rgb(hsv);
+		for (x = x0; x < x1; x++) {
+			row[x] = pixel;
+		}
+	}
 }
 
-struct rgb_color_t level2color(double level) {
-	struct hsv_color_t hsv;
+/* neighbouring columns share one rectangle */
+void mark_dirty(struct display *d, int x0, int x1, int y0, int y1) {
+	SDL_Rect *r = d->ndirty ? &d->dirty[d->ndirty - 1] : NULL;
 
-	hsv.hue = level * 360;
-	hsv.saturation = 255;
-	hsv.value = 255;
+	if (r && r->x + r->w == x0) {
+		int top = (y0 < r->y) ? y0 : r->y;
+		int bottom = (y1 > r->y + r->h) ? y1 : r->y + r->h;
 
-	return hsv2rgb(hsv);
+		r->w = x1 - r->x;
+		r->y = top;
+		r->h = bottom - top;
+	}
+	else {
+		r = &d->dirty[d->ndirty++];
+		r->x = x0;
+		r->y = y0;
+		r->w = x1 - x0;
+		r->h = y1 - y0;
+	}
 }
 
-void show_spectrum(SDL_Surface * dst, complex * fft_data) {
-	struct rgb_color_t rgb;
-	uint32_t background = SDL_MapRGB(dst->format, 0, 0, 0);
-	uint32_t foreground;
-	SDL_FillRect(dst, &dst->clip_rect, background);
+/* the part [from, to) of a bar which has to be redrawn, 0 if none */
+int bar_changed(int *shown, uint16_t *shown_hue, int length, uint16_t hue, int *from, int *to) {
+	if (length == *shown && (hue == *shown_hue || length == 0)) {
+		return 0; /* nothing visible changes */
+	}
+
+	*from = (hue != *shown_hue) ? 0 : (length < *shown) ? length : *shown; /* new color: the whole bar */
+	*to = (length > *shown) ? length : *shown;
 
-	SDL_Rect rect;
-	rect.w = LINE_WIDTH;
+	*shown = length;
+	*shown_hue = hue;
 
-	int k;
-	for (k = MIN_K; k <= MAX_K; k++) {
-		double ampl = cabs(fft_data[k]) / 500000;
-		rect.x = (k - MIN_K) * LINE_WIDTH;
-		rect.h = ampl * (SCREEN_HEIGHT - VUM_HEIGHT);
-		rect.y = (SCREEN_HEIGHT - VUM_HEIGHT) - rect.h;
+	return 1;
+}
+
+void show_spectrum(struct display *d, const struct analysis *a) {
+	int area = SCREEN_HEIGHT - VUM_HEIGHT;
+	int i, from, to, columns = d->screen->w / LINE_WIDTH;
 
-		rgb = phasor2color(fft_data[k]);
-		foreground = SDL_MapRGB(dst->format, rgb.red, rgb.green, rgb.blue);
+	for (i = 0; i < columns && i <= max_k - min_k; i++) {
+		int h = a->ampl[i] * SPECTRUM_GAIN * area;
+		uint16_t hue = a->hue[i] % 360;
 
-	        SDL_FillRect(dst, &rect, foreground);
+		if (h > area) h = area;
+
+		if (!bar_changed(&d->height[i], &d->hue[i], h, hue, &from, &to)) {
+			continue;
+		}
+
+		/* bars grow upwards from the level meter */
+		int x = i * LINE_WIDTH;
+		fill(d, x, x + LINE_WIDTH, area - to, area - h, d->background);
+		fill(d, x, x + LINE_WIDTH, area - h, area - from, d->palette[hue]);
+		mark_dirty(d, x, x + LINE_WIDTH, area - to, area - from);
 	}
 }
 
-void fade_spectrum(int fd, complex * fft_data, int fn_num) {
-	struct remote_msg_t fn_cmd;
-	memset(&fn_cmd, 0, sizeof (struct remote_msg_t));
+void show_level(struct display *d, float level) {
+	int w = level * d->screen->w;
+	uint16_t hue = (int) (level * 360) % 360; /* as level2color() */
+	int from, to;
 
-	fn_cmd.cmd = REMOTE_CMD_FADE_RGB;
-	fn_cmd.fade_rgb.step = 200;
-	fn_cmd.fade_rgb.delay = 0;
+	if (w > d->screen->w) w = d->screen->w;
+	if (w < 0) w = 0;
 
-	int k;
-	for (k = 0; k < fn_num; k++) {
-		double ampl = 0;
-		int i;
-		for (i = MIN_K+k*(MAX_K-MIN_K)/fn_num; i < (k+1)*(MAX_K-MIN_K)/fn_num; i++) {
-			ampl += cabs(fft_data[i]);
-		}
-		ampl /= 1000000*fn_num;
+	if (!bar_changed(&d->level, &d->level_hue, w, hue, &from, &to)) {
+		return;
+	}
+
+	fill(d, from, w, SCREEN_HEIGHT - VUM_HEIGHT, SCREEN_HEIGHT, d->palette[hue]);
+	fill(d, w, to, SCREEN_HEIGHT - VUM_HEIGHT, SCREEN_HEIGHT, d->background);
+
+	SDL_Rect *r = &d->dirty[d->ndirty++];
+	r->x = from;
+	r->y = SCREEN_HEIGHT - VUM_HEIGHT;
+	r->w = to - from;
+	r->h = VUM_HEIGHT;
+}
+
+/* one frame: the newest analysis, only the changed pixels reach the screen */
+void show(struct display *d, const struct analysis *a) {
+	d->ndirty = 0;
 
-		fn_cmd.fade_rgb.color.red = 255 * ampl;
-		fn_cmd.fade_rgb.color.green = 255 * ampl;
-		fn_cmd.fade_rgb.color.blue = 255 * ampl;
+	if (SDL_MUSTLOCK(d->screen) && SDL_LockSurface(d->screen) < 0) {
+		return;
+	}
+
+	show_spectrum(d, a);
+	show_level(d, a->level);
 
-		fn_cmd.address = k;
-		fn_send(fd, &fn_cmd);
+	if (SDL_MUSTLOCK(d->screen)) {
+		SDL_UnlockSurface(d->screen);
 	}
+
+	SDL_UpdateRects(d->screen, d->ndirty, d->dirty);
 }
 
-void show_level(SDL_Surface *dst, float level) {
-	SDL_Rect rect = {0, SCREEN_HEIGHT - VUM_HEIGHT, SCREEN_WIDTH, VUM_HEIGHT};
+void fade_spectrum(int fd, const struct analysis *a, int fn_num) {
+	struct remote_msg_t fn_cmds[FN_MAX_DEVICES];
+	memset(fn_cmds, 0, fn_num * sizeof (struct remote_msg_t));
 
-	struct rgb_color_t rgb = level2color(level);
-	uint32_t background = SDL_MapRGB(dst->format, 0, 0, 0);
-	uint32_t foreground = SDL_MapRGB(dst->format, rgb.red, rgb.green, rgb.blue);
+	int k;
+	for (k = 0; k < fn_num; k++) {
+		fn_cmds[k].address = k;
+		fn_cmds[k].cmd = REMOTE_CMD_FADE_RGB;
+		fn_cmds[k].fade_rgb.step = 200;
+		fn_cmds[k].fade_rgb.delay = 0;
+
+		fn_cmds[k].fade_rgb.color.red = 255 * a->band[k];
+		fn_cmds[k].fade_rgb.color.green = 255 * a->band[k];
+		fn_cmds[k].fade_rgb.color.blue = 255 * a->band[k];
+	}
 
-	SDL_FillRect(dst, &rect, background);
-	rect.w *= level;
-	SDL_FillRect(dst, &rect, foreground);
+	fn_send_each(fd, fn_cmds, fn_num); /* whole chain in one burst */
 }
 
 void fade_level(int fd, double level) {
@@ -187,7 +382,342 @@ void fade_level(int fd, double level) {
 	fn_cmd.fade_rgb.color.green = rgb.green * level;
 	fn_cmd.fade_rgb.color.blue = rgb.blue * level;
 
-	fn_send(fd, &fn_cmd);
+	fn_send_shadow(fd, &fn_shadow, &fn_cmd); /* skipped if the lamps already show it */
+}
+
+int load_wisdom() {
+	char path[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	if (fn_cache_path(path, sizeof(path), WISDOM_FILE) || !(f = fopen(path, "r"))) {
+		return -1;
+	}
+
+	ret = fftw_import_wisdom_from_file(f) ? 0 : -1;
+	fclose(f);
+
+	return ret;
+}
+
+int store_wisdom() {
+	char path[PATH_MAX], tmp[PATH_MAX+16];
+	FILE *f;
+
+	if (fn_cache_path(path, sizeof(path), WISDOM_FILE)) {
+		return -1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	if (!(f = fopen(tmp, "w"))) {
+		return -1;
+	}
+
+	fftw_export_wisdom_to_file(f);
+	fclose(f);
+
+	return rename(tmp, path);
+}
+
+int analyser_init(struct analyser *an, int window, int hop, int lamps) {
+	int i;
+
+	memset(an, 0, sizeof(struct analyser));
+
+	an->window = window;
+	an->hop = hop;
+	an->history = calloc(window, sizeof(int16_t));
+	an->hann = fftw_malloc(window * sizeof(double));
+	an->in = fftw_malloc(window * sizeof(double));
+	an->out = fftw_malloc((window / 2 + 1) * sizeof(complex));
+
+	if (!an->history || !an->hann || !an->in || !an->out) {
+		return -1;
+	}
+
+	for (i = 0; i < window; i++) {
+		an->hann[i] = 0.5 - 0.5 * cos(2 * M_PI * i / window);
+	}
+
+	/* measuring takes a while, but only once per window size */
+	load_wisdom();
+	an->plan = fftw_plan_dft_r2c_1d(window, an->in, an->out, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+	if (!an->plan) {
+		printf("planning FFT of %d samples...\n", window);
+
+		if (!(an->plan = fftw_plan_dft_r2c_1d(window, an->in, an->out, FFTW_MEASURE))) {
+			return -1;
+		}
+
+		if (store_wisdom()) {
+			perror("failed to store FFTW wisdom");
+		}
+	}
+
+	if (lamps > 0) {
+		double norm = 4.0 / (window * 32768.0); /* same as the amplitudes in analyser_push() */
+
+		if (fn_bands_init(&an->bands, lamps, window, SAMPLING_RATE, MIN_FREQ, MAX_FREQ, norm * norm)) {
+			return -1;
+		}
+
+		fn_bands_smoothing(&an->bands, (double) hop / SAMPLING_RATE, ATTACK, RELEASE);
+	}
+
+	if (mode == MODE_BEAT) {
+		fn_bands_smoothing(&an->bands, (double) hop / SAMPLING_RATE, 0, 0); /* the flux wants every rise */
+
+		if (fn_onset_init(&an->onset, lamps, (double) hop / SAMPLING_RATE, MIN_BPM, MAX_BPM)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void analyser_free(struct analyser *an) {
+	if (an->plan) {
+		fftw_destroy_plan(an->plan);
+	}
+
+	fn_bands_free(&an->bands);
+	fn_onset_free(&an->onset);
+	free(an->history);
+	fftw_free(an->hann);
+	fftw_free(an->in);
+	fftw_free(an->out);
+}
+
+/* slide the window by one hop and analyse it */
+void analyser_push(struct analyser *an, const int16_t *samples, struct analysis *a) {
+	int i, k, keep = an->window - an->hop;
+	double norm = 4.0 / (an->window * 32768.0); /* hann halves the amplitude, the other half is in the negative bins */
+
+	for (i = 0; i < an->hop; i++) {
+		an->sum += abs(samples[i]) - abs(an->history[i]);
+	}
+
+	memmove(an->history, an->history + an->hop, keep * sizeof(int16_t));
+	memcpy(an->history + keep, samples, an->hop * sizeof(int16_t));
+
+	for (i = 0; i < an->window; i++) {
+		an->in[i] = an->history[i] * an->hann[i];
+	}
+
+	fftw_execute(an->plan);
+
+	a->level = (float) an->sum / (an->window * pow(2, 15)) * 2;
+
+	for (k = min_k; k <= max_k; k++) {
+		a->ampl[k - min_k] = cabs(an->out[k]) * norm;
+		a->hue[k - min_k] = 180*(carg(an->out[k])+M_PI)/M_PI;
+	}
+
+	if (an->onset.bands) {
+		fn_bands_update(&an->bands, (const double *) an->out);
+
+		/* the hann window centers on the middle of the window */
+		a->onset = fn_onset_update(&an->onset, an->bands.energy, a->captured - (int64_t) an->window * 500000000 / SAMPLING_RATE);
+		a->beat = an->onset.next;
+		a->period = an->onset.period;
+	}
+	else if (an->bands.count) {
+		fn_bands_update(&an->bands, (const double *) an->out);
+
+		/* loudness in dB below a full scale sine, the hann window spreads its power of 1 to 1.5 */
+		for (k = 0; k < an->bands.count; k++) {
+			float b = (10 * log10f(an->bands.energy[k] / 1.5f + 1e-12f) + DYNAMIC_RANGE) / DYNAMIC_RANGE;
+			a->band[k] = (b < 0) ? 0 : (b > 1) ? 1 : b;
+		}
+	}
+}
+
+/* capture stage: keeps PulseAudio drained, no matter how far behind the others are */
+void * capture_thread(void *arg) {
+	size_t len = analyser.hop * sizeof(int16_t);
+	struct pcm_block *scratch = malloc(sizeof(struct pcm_block) + len);
+	int error;
+
+	while (!terminate) {
+		struct pcm_block *b = fn_ring_claim(&pcm_ring);
+		if (!b) {
+			b = scratch; /* analysis fell behind: drop this hop */
+		}
+
+		if (pa_simple_read(pa, b->samples, len, &error) < 0) {
+			fprintf(stderr, __FILE__": pa_simple_read() failed: %s\n", pa_strerror(error));
+			terminate = 1;
+			break;
+		}
+
+		b->captured = fn_now();
+
+		if (b != scratch) {
+			fn_ring_publish(&pcm_ring);
+		}
+	}
+
+	free(scratch);
+
+	return NULL;
+}
+
+/* analysis stage: one result per hop for the lamps and the window */
+void * dsp_thread(void *arg) {
+	struct analysis a;
+
+	memset(&a, 0, sizeof(a));
+
+	while (!terminate) {
+		const struct pcm_block *b;
+
+		if (!fn_ring_wait(&pcm_ring, 100)) {
+			continue;
+		}
+
+		b = fn_ring_peek(&pcm_ring);
+		a.captured = b->captured;
+		analyser_push(&analyser, b->samples, &a);
+		fn_ring_release(&pcm_ring);
+
+		/* a full ring drops the result: the consumer is stuck anyway */
+		struct analysis *slot;
+		if (fd >= 0 && (slot = fn_ring_claim(&lamp_ring))) {
+			*slot = a;
+			fn_ring_publish(&lamp_ring);
+		}
+
+		if (!headless && (slot = fn_ring_claim(&display_ring))) {
+			*slot = a;
+			fn_ring_publish(&display_ring);
+		}
+	}
+
+	return NULL;
+}
+
+/* skip everything but the newest result */
+const struct analysis * latest(struct fn_ring *r, unsigned long *skipped) {
+	while (fn_ring_pending(r) > 1) {
+		fn_ring_release(r);
+		if (skipped) (*skipped)++;
+	}
+
+	return fn_ring_peek(r);
+}
+
+/* a flash of the next color, fading out until the next beat */
+void flash_beat(int fd, int count) {
+	struct remote_msg_t fn_cmd;
+	struct hsv_color_t hsv = { .hue = (count * 45) % 360, .saturation = 255, .value = 255 };
+
+	memset(&fn_cmd, 0, sizeof(struct remote_msg_t));
+
+	fn_cmd.cmd = REMOTE_CMD_FADE_RGB;
+	fn_cmd.address = REMOTE_ADDR_BROADCAST;
+	fn_cmd.fade_rgb.color = fn_hsv2rgb(hsv);
+	fn_cmd.fade_rgb.step = 255;
+	fn_cmd.fade_rgb.delay = 0;
+	fn_send_shadow(fd, &fn_shadow, &fn_cmd);
+
+	memset(&fn_cmd.fade_rgb.color, 0, sizeof(struct rgb_color_t));
+	fn_cmd.fade_rgb.step = 4;
+	fn_send_shadow(fd, &fn_shadow, &fn_cmd);
+}
+
+/* only the lamp stage writes to the port, so it verifies the cached count before the first frame */
+void verify_topology() {
+	if (verify) {
+		fn_topology_verify(fd, verify, fn_num, topology_changed, NULL);
+	}
+}
+
+/* beats: every result counts, the flash is sent ahead so that it lands on the beat */
+void * beat_thread(void *arg) {
+	int64_t due = 0, flashed = 0;
+	int beats = 0;
+
+	verify_topology();
+
+	while (!terminate) {
+		const struct analysis *a;
+		int timeout = 100;
+
+		if (due) {
+			int64_t left = due - fn_now();
+			timeout = (left > 0) ? (left + 999999) / 1000000 : 0;
+		}
+
+		if (fn_ring_wait(&lamp_ring, timeout)) {
+			while ((a = fn_ring_peek(&lamp_ring))) {
+				if (a->period && a->beat - FN_FRAME_NSEC > flashed + a->period / 2) {
+					due = a->beat - FN_FRAME_NSEC; /* one frame of wire time */
+				}
+				else if (!a->period && a->onset) {
+					due = fn_now(); /* no tempo yet: just react */
+				}
+
+				fn_ring_release(&lamp_ring);
+			}
+		}
+
+		if (due && fn_now() >= due) {
+			flash_beat(fd, beats++);
+
+			int64_t late = fn_now() - due;
+			latency_sum += late;
+			latency_count++;
+			if (late > latency_max) latency_max = late;
+
+			flashed = due;
+			due = 0;
+		}
+	}
+
+	return NULL;
+}
+
+/* output stage: only waits for the analysis and the serial port */
+void * lamp_thread(void *arg) {
+	verify_topology();
+
+	while (!terminate) {
+		const struct analysis *a;
+
+		if (!fn_ring_wait(&lamp_ring, 100)) {
+			continue;
+		}
+
+		a = latest(&lamp_ring, &skipped);
+
+		switch (mode) {
+			case MODE_SPECTRUM:
+				fade_spectrum(fd, a, analyser.bands.count); /* the chain may have grown since */
+				break;
+
+			case MODE_LEVEL:
+				if (a->level > 0.67) fade_level(fd, 1);
+				else fade_level(fd, 0);
+				//if (a->level > 0.05) fade_level(fd, a->level);
+				break;
+
+			case MODE_BEAT:
+				break; /* beat_thread() */
+		}
+
+		int64_t latency = fn_now() - a->captured;
+		latency_sum += latency;
+		latency_count++;
+		if (latency > latency_max) latency_max = latency;
+
+		fn_ring_release(&lamp_ring);
+	}
+
+	return NULL;
+}
+
+void quit(int sig) {
+	terminate = 1;
 }
 
 int main(int argc, char *argv[]) {
@@ -198,18 +728,62 @@ int main(int argc, char *argv[]) {
 		.channels = 1
 	};
 
-	pa_simple *s = NULL;
 	SDL_Surface *screen = NULL;
 	SDL_Event event;
+	static struct display display;
+	pthread_t capture, dsp, lamps;
+
+	char *port = NULL;
+	int error, window = 2048, hop = 256, fps = 60;
+
+	while (1) {
+		int c = getopt_long(argc, argv, "P:c:w:H:m:f:nh", long_options, NULL);
+		if (c == -1) break;
+
+		switch (c) {
+			case 'P': port = optarg; break;
+			case 'c': fn_num = atoi(optarg); break;
+			case 'w': window = atoi(optarg); break;
+			case 'H': hop = atoi(optarg); break;
+			case 'f': fps = atoi(optarg); break;
+			case 'n': headless = 1; break;
+			case 'm':
+				if (strcmp(optarg, "level") == 0) mode = MODE_LEVEL;
+				else if (strcmp(optarg, "spectrum") == 0) mode = MODE_SPECTRUM;
+				else if (strcmp(optarg, "beat") == 0) mode = MODE_BEAT;
+				else {
+					fprintf(stderr, "unknown mode: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'h':
+			case '?':
+				usage(argv);
+				exit((c == '?') ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	/* old style: fnvum port [count] */
+	if (optind < argc) port = argv[optind++];
+	if (optind < argc) fn_num = atoi(argv[optind++]);
 
-	int error, counter = 0, fd = -1, fn_num;
-	int16_t * pcm_data;
-	complex * fft_data;
-        fftw_plan fft_plan;
+	if (fn_num > FN_MAX_DEVICES) {
+		fprintf(stderr, "at most %d fnordlichts\n", FN_MAX_DEVICES);
+		exit(EXIT_FAILURE);
+	}
+
+	if (window < 64 || window > MAX_WINDOW || hop < 1 || hop > window || fps < 1) {
+		fprintf(stderr, "window must be 64 to %d samples, hop 1 to window samples\n", MAX_WINDOW);
+		exit(EXIT_FAILURE);
+	}
+
+	min_k = MIN_FREQ * window / SAMPLING_RATE;
+	max_k = MAX_FREQ * window / SAMPLING_RATE;
 
 	/* init fnordlichts */
-	if (argc > 1) {
-		fd = open(argv[1], O_RDWR | O_NOCTTY);
+	if (port) {
+		fd = open(port, O_RDWR | O_NOCTTY);
 		if (fd < 0) {
 			perror(argv[0]);
 			exit(-1);
@@ -217,92 +791,142 @@ int main(int argc, char *argv[]) {
 
 		fn_init(fd);
 		fn_sync(fd);
+		fn_shadow_init(&fn_shadow, FN_SHADOW_SUPPRESS);
 
-		if (argc > 2) {
-			fn_num = atoi(argv[2]);
+		if (fn_num >= 0) {
 			printf("set to %d fnordlichts\n", fn_num);
 		}
 		else {
-			fn_num = fn_count_devices(fd);
+			int cached;
+
+			fn_num = fn_count_devices_cached(fd, port, &cached);
 			printf("found %d fnordlichts\n", fn_num);
+
+			if (cached) verify = port;
 			usleep(25000);
 		}
 	}
 
-	/* init screen & window */
-	if(SDL_Init(SDL_INIT_VIDEO) < 0) {
-		fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
+	/* init fftw */
+	int bands = (mode == MODE_BEAT) ? ONSET_BANDS : (mode == MODE_SPECTRUM && fd >= 0) ? fn_num : 0;
+	if (analyser_init(&analyser, window, hop, bands)) {
+		fprintf(stderr, "failed to set up the FFT\n");
 		exit(-1);
 	}
 
-	/* open sdl window */
-	SDL_WM_SetCaption(TITLE, NULL);
-	screen = SDL_SetVideoMode(SCREEN_WIDTH, SCREEN_HEIGHT, 16, SDL_SWSURFACE|SDL_ANYFORMAT);
-	if (screen == NULL) {
-		fprintf(stderr, "Unable to set video: %s\n", SDL_GetError());
+	/* init screen & window */
+	if (!headless) {
+		if(SDL_Init(SDL_INIT_VIDEO) < 0) {
+			fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
+			exit(-1);
+		}
+
+		/* open sdl window, SDL converts if the display has another depth */
+		SDL_WM_SetCaption(TITLE, NULL);
+		screen = SDL_SetVideoMode(SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_SWSURFACE);
+		if (screen == NULL) {
+			fprintf(stderr, "Unable to set video: %s\n", SDL_GetError());
+			exit(-1);
+		}
+
+		display_init(&display, screen);
+	}
+
+	if (fn_ring_init(&pcm_ring, sizeof(struct pcm_block) + hop * sizeof(int16_t), PCM_BLOCKS) ||
+	    fn_ring_init(&lamp_ring, sizeof(struct analysis), ANALYSIS_SLOTS) ||
+	    fn_ring_init(&display_ring, sizeof(struct analysis), ANALYSIS_SLOTS)) {
+		perror("failed to allocate rings");
 		exit(-1);
 	}
 
-	/* init fftw & get buffers*/
-	pcm_data = (int16_t *) malloc(N * sizeof (int16_t));
-        fft_data = (complex *) fftw_malloc(N * sizeof (complex));
-	fft_plan = fftw_plan_dft_1d(N, fft_data, fft_data, FFTW_FORWARD, 0);
+	/* small fragments: PulseAudio hands out every hop as soon as it is complete */
+	pa_buffer_attr attr = {
+		.maxlength = (uint32_t) -1,
+		.tlength = (uint32_t) -1,
+		.prebuf = (uint32_t) -1,
+		.minreq = (uint32_t) -1,
+		.fragsize = hop * sizeof(int16_t)
+	};
 
 	/* Create the recording stream */
-	if (!(s = pa_simple_new(NULL, TITLE, PA_STREAM_RECORD, NULL, "record", &ss, NULL, NULL, &error))) {
+	if (!(pa = pa_simple_new(NULL, TITLE, PA_STREAM_RECORD, NULL, "record", &ss, NULL, &attr, &error))) {
 		fprintf(stderr, __FILE__": pa_simple_new() failed: %s\n", pa_strerror(error));
 		exit(-1);
 	}
-	pa_simple_flush(s, &error); /* flush audio buffer */
-	
-	while (1) {
-		counter++;
+	pa_simple_flush(pa, &error); /* flush audio buffer */
+
+	struct sigaction action;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = 0;
+	action.sa_handler = quit;
+
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	pthread_create(&capture, NULL, capture_thread, NULL);
+	pthread_create(&dsp, NULL, dsp_thread, NULL);
+	if (fd >= 0) {
+		pthread_create(&lamps, NULL, (mode == MODE_BEAT) ? beat_thread : lamp_thread, NULL);
+	}
+
+	/* render stage: no faster than the screen refreshs, the newest analysis only */
+	int64_t frame = 1000000000 / fps, next = fn_now();
+	while (!terminate && !headless) {
+		const struct analysis *a;
+		int64_t now;
 
 		/* handle SDL events */
 		while (SDL_PollEvent(&event)) {
 			if (event.type == SDL_QUIT) {
-				printf("Good bye!\n");
-				exit(0);
+				terminate = 1;
 			}
 		}
 
-		/* read PCM audio data */
-		if (pa_simple_read(s, pcm_data, N * sizeof (int16_t), &error) < 0) {
-			fprintf(stderr, __FILE__": pa_simple_read() failed: %s\n", pa_strerror(error));
-			exit(-1);
+		if ((now = fn_now()) < next) {
+			usleep((next - now) / 1000);
 		}
 
-		/* analyse audio data */
-		int16_t index, max = 0;
-		uint32_t sum = 0;
-		float level;
-		for (index = 0; index < N; index++) {
-			sum += abs(pcm_data[index]);
-			if (abs(pcm_data[index]) > max) max = pcm_data[index];
+		next += frame;
+		if (next < now) {
+			next = now + frame; /* we were stalled: don't catch up */
+		}
 
-			fft_data[index] = (double) pcm_data[index];
+		if ((a = latest(&display_ring, NULL))) {
+			show(&display, a);
+			fn_ring_release(&display_ring);
 		}
-		
-		/* execute fftw plan */
-		fftw_execute(fft_plan);
-		level = (float) sum / (N * pow(2, 15)) * 2;
-		
-		//if (counter % 2 == 0) fade_spectrum(fd, fft_data, fn_num);
-		if (level > 0.67) fade_level(fd, 1);
-		else fade_level(fd, 0);
-		//if (level > 0.05) fade_level(fd, level);
+	}
+
+	while (!terminate) {
+		usleep(100000); /* headless: the threads do the work */
+	}
 
-		show_spectrum(screen, fft_data);
-		show_level(screen, level);		
-		SDL_Flip(screen);
+	printf("Good bye!\n");
 
-		//printf("level: %f \tsum: %d\t max: %d\n", level, sum, max);
+	pthread_join(capture, NULL);
+	pthread_join(dsp, NULL);
+	if (fd >= 0) {
+		pthread_join(lamps, NULL);
 	}
 
+	printf("dropped %lu hops, skipped %lu results", pcm_ring.overruns, skipped);
+	if (latency_count && mode == MODE_BEAT) {
+		printf(", %lu flashes %.1f ms late avg, %.1f ms max", latency_count, latency_sum / 1e6 / latency_count, latency_max / 1e6);
+	}
+	else if (latency_count) {
+		printf(", latency %.1f ms avg, %.1f ms max", latency_sum / 1e6 / latency_count, latency_max / 1e6);
+	}
+	printf("\n");
+
 	/* housekeeping */
-	SDL_Quit();
-	free(pcm_data);
-	fftw_free(fft_data);
+	if (!headless) {
+		SDL_Quit();
+	}
+	pa_simple_free(pa);
+	fn_ring_free(&pcm_ring);
+	fn_ring_free(&lamp_ring);
+	fn_ring_free(&display_ring);
+	analyser_free(&analyser);
 	fftw_cleanup();
 
 	return 0;
@@ -34,6 +34,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <pthread.h>
 #include <microhttpd.h>
@@ -43,13 +44,23 @@
 volatile bool terminate = false;/* will be set to TRUE in our signal handler */
 char *httpd_root;		/* where static HTML content is located */
 int httpd_port;			/* TCP port the webserver should listen to */
-int fn_fd;			/* file descriptor for serial port */
+struct fn_bus *fn_bus;		/* serial port, written by the libfn writer thread */
+struct fn_group *fn_group;	/* or several of them, addressed by logical lamp ids */
 int fn_count;
 int httpd_users = 0;
 
 pthread_cond_t listen_cond;
 pthread_mutex_t listen_mutex;
 
+struct {
+	struct fn_scene scene;	/* mapped from HTTPD-ROOT/scenes/NAME.fns */
+	pthread_t thread;
+	pthread_mutex_t mutex;	/* serializes starting and stopping */
+	volatile bool stop;
+	bool running;
+	bool loop;
+} show;
+
 struct {
 	struct rgb_color_t color;
 	int step;
@@ -80,6 +91,105 @@ void quit(int sig) {
 	pthread_mutex_unlock(&listen_mutex);
 }
 
+/* called from the bus writer thread */
+void topology_changed(const char *device, int old_count, int new_count, void *arg) {
+	printf("Fnordlicht count on %s changed: %d => %d\n", device, old_count, new_count);
+	__atomic_store_n(&fn_count, new_count, __ATOMIC_RELAXED);
+}
+
+int show_submit(struct remote_msg_t *burst, int n) {
+	int i;
+
+	if (!fn_group) {
+		return (fn_bus_submit_frames(fn_bus, burst, n)) ? 0 : -1;
+	}
+
+	/* addresses are logical lamps */
+	for (i = 0; i < n; i++) {
+		if (burst[i].address == REMOTE_ADDR_BROADCAST) {
+			if (fn_group_submit_all(fn_group, &burst[i]) < 0) return -1;
+		}
+		else if (!fn_group_submit(fn_group, burst[i].address, &burst[i])) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void * show_play(void *arg) {
+	struct remote_msg_t burst[FN_SCHED_SLOTS];
+	const struct fn_scene *sc = &show.scene;
+	int64_t start = fn_now();
+	size_t i = 0;
+	int n;
+
+	while (!show.stop) {
+		if (i == sc->keyframe_count) {
+			if (!show.loop) break;
+
+			start = fn_now();
+			i = 0;
+		}
+
+		/* sleep in small steps to notice a stop request */
+		int64_t due = start + (int64_t) sc->keyframes[i].time * 1000000;
+		int64_t left;
+		while (!show.stop && (left = due - fn_now()) > 0) {
+			usleep((left > 100000000) ? 100000 : left / 1000 + 1);
+		}
+
+		i = fn_scene_batch(sc, i, burst, FN_SCHED_SLOTS, &n);
+		if (!show.stop && show_submit(burst, n)) {
+			fprintf(stderr, "Failed to queue show\n");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* called with show.mutex held */
+void show_stop() {
+	if (show.running) {
+		show.stop = true;
+		pthread_join(show.thread, NULL);
+		fn_scene_unmap(&show.scene);
+		show.running = false;
+	}
+}
+
+int show_start(const char *name, bool loop) {
+	char path[1024];
+	int ret = -1;
+
+	/* only plain names, no paths */
+	if (!name[0] || strchr(name, '/') || name[0] == '.') {
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/scenes/%s.fns", httpd_root, name);
+
+	pthread_mutex_lock(&show.mutex);
+	show_stop();
+
+	if (fn_scene_map(&show.scene, path) == 0) {
+		if (show.scene.keyframe_count == 0) {
+			fn_scene_unmap(&show.scene);
+		}
+		else {
+			show.stop = false;
+			show.loop = loop;
+			show.running = (pthread_create(&show.thread, NULL, show_play, NULL) == 0);
+			ret = (show.running) ? 0 : -1;
+		}
+	}
+
+	pthread_mutex_unlock(&show.mutex);
+
+	return ret;
+}
+
 const char * get_filename_ext(char *filename) {
 	const char *dot = strrchr(filename, '.');
 
@@ -163,10 +273,11 @@ int handle_request(void *cls, struct MHD_Connection *connection, const char *url
 			}
 
 			snprintf(color_str, 8, "#%02x%02x%02x\n", fn_last.color.red, fn_last.color.green, fn_last.color.blue);
-			snprintf(status_str, 255, "{ \"count\": %d, \"users\": %d, \"color\": { \"r\": %d, \"g\": %d, \"b\": %d, \"hex\": \"%s\"}, \"step\": %d, \"delay\": %d }\n",
-				fn_count, httpd_users,
+			snprintf(status_str, 255, "{ \"count\": %d, \"users\": %d, \"color\": { \"r\": %d, \"g\": %d, \"b\": %d, \"hex\": \"%s\"}, \"step\": %d, \"delay\": %d, \"queued\": %ld }\n",
+				__atomic_load_n(&fn_count, __ATOMIC_RELAXED), httpd_users,
 				fn_last.color.red, fn_last.color.green, fn_last.color.blue,
-				color_str, fn_last.step, fn_last.delay
+				color_str, fn_last.step, fn_last.delay,
+				((fn_group) ? fn_group_queued(fn_group) : fn_bus_queued(fn_bus)) / 1000 /* ms */
 			);
 	
 			response = MHD_create_response_from_data(strlen(status_str), (void *) status_str, 0, 1);
@@ -217,6 +328,30 @@ int handle_request(void *cls, struct MHD_Connection *connection, const char *url
 
 		msg.address = (address) ? atoi(address) : REMOTE_ADDR_BROADCAST;
 
+		if (strcmp(url+1, "show") == 0) {
+			const char *scene = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "scene");
+			const char *loop = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "loop");
+
+			if (scene == NULL) {
+				return MHD_NO;
+			}
+
+			int p = show_start(scene, loop && atoi(loop));
+			printf("Playing show: %s\n", scene);
+
+			response_str = (p == 0) ? "success" : "failed";
+			response = MHD_create_response_from_data(strlen(response_str), (void *) response_str, 1, 1);
+
+			int ret = MHD_queue_response(connection, (p == 0) ? MHD_HTTP_OK : MHD_HTTP_NOT_FOUND, response);
+			MHD_destroy_response(response);
+			return ret;
+		}
+
+		/* any other command takes over from a running show */
+		pthread_mutex_lock(&show.mutex);
+		show_stop();
+		pthread_mutex_unlock(&show.mutex);
+
 		if (strcmp(url+1, "fade") == 0) {
 			const char *color = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "color");
 			const char *step = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "step");
@@ -270,7 +405,7 @@ int handle_request(void *cls, struct MHD_Connection *connection, const char *url
 				case 0:
 					printf("Start program: colorwheel\n");
 					msg.start_program.params.colorwheel.hue_start = 0;
-					msg.start_program.params.colorwheel.hue_step = 360 / fn_count;
+					msg.start_program.params.colorwheel.hue_step = 360 / __atomic_load_n(&fn_count, __ATOMIC_RELAXED);
 					msg.start_program.params.colorwheel.add_addr = (use_address) ? atoi(use_address) : 1;
 					msg.start_program.params.colorwheel.saturation = (saturation) ? atoi(saturation) : 255;
 					msg.start_program.params.colorwheel.value = (value) ? atoi(value) : 255;
@@ -312,11 +447,31 @@ int handle_request(void *cls, struct MHD_Connection *connection, const char *url
 			return MHD_NO;
 		}
 
-		/* send command */
-		int p = (mask) ? fn_send_mask(fn_fd, mask, &msg) : fn_send(fn_fd, &msg);
+		/* queue command, never blocks on the serial port */
+		struct remote_msg_t burst[FN_MAX_DEVICES+1];
+		int i, n = 1, p = 0;
+		if (fn_group) {
+			if (mask) n = fn_group_submit_mask(fn_group, mask, &msg);
+			else if (address) n = (fn_group_submit(fn_group, atoi(address), &msg)) ? 1 : -1;
+			else n = fn_group_submit_all(fn_group, &msg);
+
+			p = (n > 0) ? n * REMOTE_MSG_LEN : -1;
+			n = 0;
+		}
+		else if (mask) {
+			fn_mask_t bits;
+			n = (fn_mask_parse(&bits, mask) < 0) ? 0 : fn_mask_expand(&bits, &msg, __atomic_load_n(&fn_count, __ATOMIC_RELAXED), burst);
+		}
+		else {
+			burst[0] = msg;
+		}
+
+		for (i = 0; i < n && p >= 0; i++) {
+			p = (fn_bus_submit(fn_bus, &burst[i])) ? p + REMOTE_MSG_LEN : -1;
+		}
 
 		print_cmd(&msg, sizeof(msg));
-		printf("Sent %i bytes to fnordlichts\n", p);
+		printf("Queued %i bytes for fnordlichts\n", p);
 
 		response_str = (p > 0) ? "success" : "failed";
 		response = MHD_create_response_from_data(strlen(response_str), (void *) response_str, 1, 1);
@@ -342,24 +497,42 @@ int main(int argc, char *argv[]) {
 	sigaction(SIGTERM, &action, NULL);	/* catch kill signal */
 
 	if (argc < 3 || argc > 5) {
-		fprintf(stderr, "usage: fnweb SERIAL-PORT WEB-DIRECTORY [HTTPD-PORT [FNORDLICHT-COUNT]]\n");
+		fprintf(stderr, "usage: fnweb (SERIAL-PORT | GROUP-CONFIG) WEB-DIRECTORY [HTTPD-PORT [FNORDLICHT-COUNT]]\n");
 		return EXIT_FAILURE;
 	}
 
-	/* connect to fnordlichts */
-	fn_fd = open(argv[1], O_RDWR | O_NOCTTY);
-	if (fn_fd < 0) {
+	/* connect to fnordlichts, a regular file describes a bus group */
+	struct termios oldtio;
+	struct stat st;
+	int fd = -1, cached = 0;
+
+	if (stat(argv[1], &st) == 0 && S_ISREG(st.st_mode)) {
+		fn_group = fn_group_open(argv[1]);
+	}
+	else if ((fd = open(argv[1], O_RDWR | O_NOCTTY)) >= 0) {
+		oldtio = fn_init(fd);
+
+		/* count while we are the only writer, the bus thread takes the port over afterwards */
+		if (argc < 5) {
+			fn_count = fn_count_devices_cached(fd, argv[1], &cached);
+		}
+
+		/* a count from the cache gets verified between other frames */
+		if ((fn_bus = fn_bus_attach(fd)) && cached) {
+			fn_bus_verify(fn_bus, argv[1], fn_count, topology_changed, NULL);
+		}
+	}
+
+	if (fn_bus == NULL && fn_group == NULL) {
 		fprintf(stderr, "Failed to open fnordlichts: %s\n", strerror(errno));
 		return EXIT_FAILURE;
 	}
 
-	struct termios oldtio = fn_init(fn_fd);
-
 	if (argc >= 5) {
 		fn_count = atoi(argv[4]);
 	}
-	else {
-		fn_count = fn_count_devices(fn_fd);
+	else if (fn_group) {
+		fn_count = fn_group->lamps;
 	}
 
 	/* set startup state */
@@ -375,6 +548,7 @@ int main(int argc, char *argv[]) {
 	/* initialize listen condition */
 	pthread_cond_init(&listen_cond, NULL);
 	pthread_mutex_init(&listen_mutex, NULL);
+	pthread_mutex_init(&show.mutex, NULL);
 
 	/* start embedded HTTPd */
 	httpd_port = (argc >= 4) ? atoi(argv[3]) : 80; /* default port */
@@ -408,15 +582,17 @@ int main(int argc, char *argv[]) {
 	/* busy loop */
 	int c = 0;
 	while (!terminate) {
-		if (c++ % 10 == 0) {
-			int p = fn_sync(fn_fd);
-			if (p <= 0) {
-				fprintf(stderr, "Failed to sync fnordlichts!\n");
-				return EXIT_FAILURE;
-			}
-			else {
-				printf("Fnordlicht's resynced, %d users\n", httpd_users);
-			}
+		int err = (fn_group) ? fn_group_error(fn_group) : fn_bus_error(fn_bus);
+		if (err) {
+			fprintf(stderr, "Failed to send to fnordlichts: %s\n", strerror(err));
+		}
+
+		/* libfn resyncs after idle gaps and errors, the probe catches the rest while idle,
+		 * not right at the start: the cached topology is still being verified */
+		int count = __atomic_load_n(&fn_count, __ATOMIC_RELAXED);
+		if (++c % 10 == 0) {
+			if (fn_group) fn_group_probe(fn_group);
+			else if (count > 0) fn_bus_probe(fn_bus, count - 1);
 		}
 		sleep(1);
 	}
@@ -424,9 +600,19 @@ int main(int argc, char *argv[]) {
 	/* stop embedded HTTPd */
 	MHD_stop_daemon(httpd);
 
-	/* reset and close connection */
-	tcsetattr(fn_fd, TCSANOW, &oldtio);
-	close(fn_fd);
+	pthread_mutex_lock(&show.mutex);
+	show_stop();
+	pthread_mutex_unlock(&show.mutex);
+
+	/* flush, reset and close connection */
+	if (fn_group) {
+		fn_group_close(fn_group);
+	}
+	else {
+		fn_bus_close(fn_bus);
+		tcsetattr(fd, TCSANOW, &oldtio);
+		close(fd);
+	}
 
 	free(httpd_root);
 
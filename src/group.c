@@ -0,0 +1,299 @@
+/**
+ * fnordlicht C library - bus groups
+ *
+ * spreads a logical lamp address space over several
+ * serial ports, each driven by its own writer thread
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "libfn.h"
+
+static int fn_group_bus(struct fn_group *g, const char *device) {
+	int i;
+
+	for (i = 0; i < g->count; i++) {
+		if (strcmp(g->devices[i], device) == 0) {
+			return i;
+		}
+	}
+
+	if (g->count == FN_GROUP_BUSES || !(g->devices[i] = strdup(device))) {
+		return -1;
+	}
+
+	return g->count++;
+}
+
+/* map "first[-last] device address" rows, a range takes consecutive addresses,
+ * "chain device length" rows tell how many devices there are on a port */
+static int fn_group_parse(struct fn_group *g, FILE *f) {
+	char row[1024], device[1024];
+	int first, last, address, length;
+
+	while (fgets(row, sizeof(row), f)) {
+		char *p = row + strspn(row, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0') {
+			continue; /* comments and empty rows */
+		}
+
+		if (sscanf(p, "chain %1023s %d", device, &length) == 2) {
+			int b = fn_group_bus(g, device);
+			if (b < 0 || length < 1 || length > FN_MAX_DEVICES) {
+				return -1;
+			}
+
+			g->length[b] = length;
+			continue;
+		}
+
+		if (sscanf(p, "%d-%d %1023s %d", &first, &last, device, &address) != 4) {
+			if (sscanf(p, "%d %1023s %d", &first, device, &address) != 3) {
+				return -1;
+			}
+			last = first;
+		}
+
+		if (first < 0 || last < first || last >= FN_GROUP_LAMPS ||
+		    address < 0 || address + last - first > FN_MAX_DEVICES) {
+			return -1;
+		}
+
+		int b = fn_group_bus(g, device);
+		if (b < 0) {
+			return -1;
+		}
+
+		for (; first <= last; first++, address++) {
+			g->map[first].bus = b;
+			g->map[first].address = address;
+			fn_mask_set(&g->mapped[b], address);
+
+			if (first >= g->lamps) {
+				g->lamps = first + 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+struct fn_group * fn_group_open(const char *config) {
+	struct fn_group *g;
+	FILE *f;
+	int i;
+
+	if (!(f = fopen(config, "r"))) {
+		return NULL;
+	}
+
+	if (!(g = calloc(1, sizeof(struct fn_group)))) {
+		fclose(f);
+		return NULL;
+	}
+
+	for (i = 0; i < FN_GROUP_LAMPS; i++) {
+		g->map[i].bus = -1;
+	}
+
+	if (fn_group_parse(g, f) || g->count == 0) {
+		fclose(f);
+		fn_group_close(g);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	fclose(f);
+
+	for (i = 0; i < g->count; i++) {
+		fn_mask_t all;
+		int n = fn_mask_popcount(&g->mapped[i]);
+
+		/* only a fully mapped chain may be addressed by broadcast,
+		 * without a length from the config we go by the cached topology */
+		int length = (g->length[i]) ? g->length[i] : fn_topology_load(g->devices[i]);
+		fn_mask_fill(&all, n);
+		g->chain[i] = (n == length && memcmp(&all, &g->mapped[i], sizeof(all)) == 0) ? n : 0;
+
+		if (!(g->buses[i] = fn_bus_open(g->devices[i]))) {
+			int err = errno;
+			fn_group_close(g);
+			errno = err;
+			return NULL;
+		}
+	}
+
+	return g;
+}
+
+void fn_group_close(struct fn_group *g) {
+	int i;
+
+	/* the other writers keep draining while we wait for the first */
+	for (i = 0; i < g->count; i++) {
+		if (g->buses[i]) {
+			fn_bus_close(g->buses[i]);
+		}
+		free(g->devices[i]);
+	}
+
+	free(g);
+}
+
+static int fn_group_submit_bits(struct fn_group *g, int b, const fn_mask_t *bits, const struct remote_msg_t *msg) {
+	struct remote_msg_t burst[FN_MAX_DEVICES+1];
+	int n = fn_mask_expand(bits, msg, g->chain[b], burst);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	uint32_t ticket = fn_bus_submit_frames(g->buses[b], burst, n);
+	if (!ticket) {
+		return -1;
+	}
+
+	__atomic_store_n(&g->last[b], ticket, __ATOMIC_RELAXED);
+
+	return n;
+}
+
+uint32_t fn_group_submit(struct fn_group *g, int lamp, const struct remote_msg_t *msg) {
+	struct remote_msg_t m = *msg;
+	uint32_t ticket;
+
+	if (lamp < 0 || lamp >= g->lamps || g->map[lamp].bus < 0) {
+		return 0;
+	}
+
+	m.address = g->map[lamp].address;
+	if ((ticket = fn_bus_submit(g->buses[g->map[lamp].bus], &m))) {
+		__atomic_store_n(&g->last[g->map[lamp].bus], ticket, __ATOMIC_RELAXED);
+	}
+
+	return ticket;
+}
+
+int fn_group_submit_all(struct fn_group *g, const struct remote_msg_t *msg) {
+	int i, q, n = 0;
+
+	for (i = 0; i < g->count; i++) {
+		if ((q = fn_group_submit_bits(g, i, &g->mapped[i], msg)) < 0) {
+			return -1;
+		}
+		n += q;
+	}
+
+	return n;
+}
+
+int fn_group_submit_mask(struct fn_group *g, const char *mask, const struct remote_msg_t *msg) {
+	fn_mask_t bits[FN_GROUP_BUSES];
+	int i, q, n = 0;
+
+	memset(bits, 0, sizeof(bits));
+
+	/* split the logical mask up into one mask per bus */
+	for (i = 0; mask[i]; i++) {
+		if (i >= FN_GROUP_LAMPS || (mask[i] != '0' && mask[i] != '1')) {
+			return -2; /* invalid mask */
+		}
+		else if (mask[i] == '1' && i < g->lamps && g->map[i].bus >= 0) {
+			fn_mask_set(&bits[g->map[i].bus], g->map[i].address);
+		}
+	}
+
+	for (i = 0; i < g->count; i++) {
+		if ((q = fn_group_submit_bits(g, i, &bits[i], msg)) < 0) {
+			return -1;
+		}
+		n += q;
+	}
+
+	return n;
+}
+
+int fn_group_flush(struct fn_group *g, int timeout) {
+	int i;
+
+	for (i = 0; i < g->count; i++) {
+		uint32_t last = __atomic_load_n(&g->last[i], __ATOMIC_RELAXED);
+
+		if (last && !fn_bus_wait(g->buses[i], last, timeout)) {
+			return 0; /* timeout */
+		}
+	}
+
+	return 1;
+}
+
+void fn_group_sync(struct fn_group *g) {
+	int i;
+
+	for (i = 0; i < g->count; i++) {
+		fn_bus_sync(g->buses[i]);
+	}
+}
+
+void fn_group_probe(struct fn_group *g) {
+	int i, a;
+
+	/* the last device of a chain only answers if all before it are in sync */
+	for (i = 0; i < g->count; i++) {
+		for (a = FN_MAX_DEVICES; a >= 0 && !fn_mask_test(&g->mapped[i], a); a--);
+		if (a >= 0) {
+			fn_bus_probe(g->buses[i], a);
+		}
+	}
+}
+
+int fn_group_error(struct fn_group *g) {
+	int i, err = 0;
+
+	for (i = 0; i < g->count; i++) {
+		int e = fn_bus_error(g->buses[i]);
+		if (e) {
+			err = e;
+		}
+	}
+
+	return err;
+}
+
+long fn_group_queued(struct fn_group *g) {
+	long queued = 0;
+	int i;
+
+	/* buses drain in parallel */
+	for (i = 0; i < g->count; i++) {
+		long q = fn_bus_queued(g->buses[i]);
+		if (q > queued) {
+			queued = q;
+		}
+	}
+
+	return queued;
+}
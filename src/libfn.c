@@ -24,7 +24,12 @@
  */
 
 #include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <linux/serial.h>
 #include <stdio.h>
 
 #include "libfn.h"
@@ -52,29 +57,182 @@ struct termios fn_init(int fd) {
 	return oldtio;
 }
 
+int64_t fn_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct rgb_color_t fn_hsv2rgb(struct hsv_color_t hsv) {
+	struct rgb_color_t rgb;
+
+	uint16_t h = hsv.hue % 360;
+	uint8_t s = hsv.saturation;
+	uint8_t v = hsv.value;
+
+	uint16_t f = ((h % 60) * 255 + 30)/60;
+	uint16_t p = (v * (255-s)+128)/255;
+	uint16_t q = ((v * (255 - (s*f+128)/255))+128)/255;
+	uint16_t t = (v * (255 - ((s * (255 - f))/255)))/255;
+	uint8_t i = h/60;
+
+	switch (i) {
+		case 0:	rgb.red = v; rgb.green = t; rgb.blue = p; break;
+		case 1:	rgb.red = q; rgb.green = v; rgb.blue = p; break;
+		case 2:	rgb.red = p; rgb.green = v; rgb.blue = t; break;
+		case 3:	rgb.red = p; rgb.green = q; rgb.blue = v; break;
+		case 4:	rgb.red = t; rgb.green = p; rgb.blue = v; break;
+		case 5:	rgb.red = v; rgb.green = p; rgb.blue = q; break;
+	}
+
+	return rgb;
+}
+
+/* write the whole buffer, resuming after partial writes and interrupts */
+static ssize_t fn_write_all(int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t q = write(fd, p + done, len - done);
+		if (q < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return -1;
+		}
+		done += q;
+	}
+
+	return done;
+}
+
 size_t fn_send(int fd, struct remote_msg_t *msg) {
-	return write(fd, msg, REMOTE_MSG_LEN);
+	return fn_send_frames(fd, msg, 1);
+}
+
+/* the union pads struct remote_msg_t on the host: strip it to the wire size */
+size_t fn_pack_frames(uint8_t *buf, const struct remote_msg_t *msgs, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		memcpy(buf + i * REMOTE_MSG_LEN, &msgs[i], REMOTE_MSG_LEN);
+	}
+
+	return count * REMOTE_MSG_LEN;
+}
+
+size_t fn_send_frames(int fd, struct remote_msg_t *msgs, int count) {
+	uint8_t buf[FN_CALIBRATION_FANOUT * REMOTE_MSG_LEN];
+	struct remote_msg_t calibrated[FN_CALIBRATION_FANOUT];
+	ssize_t q, sent = 0;
+	int n, m;
+
+	for (; count > 0; count -= n, msgs += n) {
+		const struct remote_msg_t *out = msgs;
+		n = (count < FN_CALIBRATION_FANOUT) ? count : FN_CALIBRATION_FANOUT;
+
+		/* the caller keeps its uncalibrated colors */
+		if ((m = fn_calibrate(calibrated, FN_CALIBRATION_FANOUT, msgs, &n))) {
+			out = calibrated;
+		}
+		else {
+			m = n;
+		}
+
+		fn_capture(out, m, 0);
+
+		if ((q = fn_write_all(fd, buf, fn_pack_frames(buf, out, m))) < 0) {
+			return -1;
+		}
+		sent += q;
+	}
+
+	return sent;
 }
 
 size_t fn_send_mask(int fd, const char *mask, struct remote_msg_t *msg) {
-	int i, p = 0, c = strlen(mask);
-	for (i = 0; i < c; i++) {
-		if (mask[i] == '1') {
-			msg->address = i;
-			int q = fn_send(fd, msg);
-			if (q < 0) {
-				return q;
-			}
-			else {
-				p += q;
+	fn_mask_t bits;
+
+	if (fn_mask_parse(&bits, mask) < 0) {
+		return -2; /* invalid mask */
+	}
+
+	return fn_send_bits(fd, &bits, msg, 0);
+}
+
+int fn_mask_expand(const fn_mask_t *mask, const struct remote_msg_t *msg, int count, struct remote_msg_t *burst) {
+	int i, n = 0;
+
+	/* the whole chain is selected: one broadcast frame does the job */
+	if (count > 0 && fn_mask_covers(mask, count)) {
+		burst[0] = *msg;
+		burst[0].address = REMOTE_ADDR_BROADCAST;
+		return 1;
+	}
+
+	for (i = 0; i <= FN_MAX_DEVICES; i++) {
+		if (fn_mask_test(mask, i)) {
+			burst[n] = *msg;
+			burst[n].address = i;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+size_t fn_send_bits(int fd, const fn_mask_t *mask, struct remote_msg_t *msg, int count) {
+	struct remote_msg_t burst[FN_MAX_DEVICES+1];
+	int n = fn_mask_expand(mask, msg, count, burst);
+
+	if (n > 0) {
+		msg->address = burst[n-1].address;
+	}
+
+	return fn_send_frames(fd, burst, n);
+}
+
+size_t fn_send_each(int fd, struct remote_msg_t *msgs, int count) {
+	struct remote_msg_t burst[FN_MAX_DEVICES+2];
+	int i, j, n = 0, best = 0, best_votes = 1;
+
+	/* find the payload shared by most devices */
+	for (i = 0; i < count && count - i > best_votes; i++) {
+		int votes = 1;
+		for (j = i + 1; j < count; j++) {
+			if (memcmp(&msgs[i].cmd, &msgs[j].cmd, REMOTE_MSG_LEN-1) == 0) {
+				votes++;
 			}
 		}
-		else if (mask[i] != '0') {
-			return -2; /* invalid mask */
+
+		if (votes > best_votes) {
+			best = i;
+			best_votes = votes;
+		}
+	}
+
+	/* broadcast + overrides is cheaper than one frame per device */
+	if (best_votes > 1) {
+		burst[n] = msgs[best];
+		burst[n].address = REMOTE_ADDR_BROADCAST;
+		n++;
+	}
+
+	for (i = 0; i < count; i++) {
+		msgs[i].address = i;
+		if (best_votes <= 1 || memcmp(&msgs[i].cmd, &msgs[best].cmd, REMOTE_MSG_LEN-1) != 0) {
+			burst[n++] = msgs[i];
 		}
 	}
 
-	return p;
+	return fn_send_frames(fd, burst, n);
 }
 
 size_t fn_sync(int fd) {
@@ -82,9 +240,12 @@ size_t fn_sync(int fd) {
 	memset(sync, REMOTE_SYNC_BYTE, REMOTE_SYNC_LEN);
 	sync[REMOTE_SYNC_LEN] = 0;	/* address byte */
 
-	return write(fd, sync, REMOTE_SYNC_LEN+1);
+	fn_capture_sync(0);
+	return fn_write_all(fd, sync, REMOTE_SYNC_LEN+1);
 }
 
+/* every device holds the shared line for the whole PULL_INT delay (50ms at least),
+ * the next one can only answer after it let go: a little over 50ms per device */
 uint8_t fn_count_devices(int fd) {
 	struct remote_msg_t msg;
 	memset(&msg, 0, REMOTE_MSG_LEN);
@@ -93,15 +254,17 @@ uint8_t fn_count_devices(int fd) {
 	msg.cmd = REMOTE_CMD_PULL_INT;
 	msg.pull_int.delay = 1; /* 50ms */
 
-	while (1) {
+	while (msg.address < FN_MAX_DEVICES) {
 		fn_send(fd, (struct remote_msg_t *) &msg);
-		usleep(25000);
 
-		if (fn_get_int(fd)) {
-			msg.address++;
-			usleep(25000);
+		/* advance as soon as the device answered and released the line again */
+		if (fn_wait_int(fd, 1, FN_INT_TIMEOUT, NULL) != 1) {
+			break;
 		}
-		else {
+
+		msg.address++;
+
+		if (fn_wait_int(fd, 0, FN_INT_RELEASE, NULL) != 1) {
 			break;
 		}
 	}
@@ -111,7 +274,125 @@ uint8_t fn_count_devices(int fd) {
 
 int fn_get_int(int fd) {
 	int i;
-	ioctl (fd, TIOCMGET, &i);
+
+	if (ioctl(fd, TIOCMGET, &i) < 0) {
+		return -1; /* no modem lines, e.g. a pty */
+	}
 
 	return i & FN_INT_LINE;
 }
+
+/* transitions of the interrupt line the driver counted so far, -1 if it counts none */
+static int fn_int_edges(int fd) {
+	struct serial_icounter_struct icount;
+
+	if (ioctl(fd, TIOCGICOUNT, &icount) < 0) {
+		return -1;
+	}
+
+	switch (FN_INT_LINE) {
+		case TIOCM_CTS: return icount.cts;
+		case TIOCM_DSR: return icount.dsr;
+		case TIOCM_CD: return icount.dcd;
+		case TIOCM_RNG: return icount.rng;
+		default: return -1;
+	}
+}
+
+/* polls the level, the driver's edge counter catches pulses between two polls.
+ * TIOCMIWAIT would need a thread to get a timeout, which can't be cancelled safely */
+int fn_wait_int(int fd, int active, int timeout, struct timespec *ts) {
+	int64_t deadline = fn_now() + (int64_t) timeout * 1000000;
+	int edges = fn_int_edges(fd); /* before the first look at the level, or we could miss one */
+
+	while (1) {
+		int level = fn_get_int(fd);
+		if (level < 0) {
+			return -1;
+		}
+		else if (!level == !active) {
+			break;
+		}
+		else if (edges >= 0 && fn_int_edges(fd) != edges) {
+			break; /* it got there and back since we last looked */
+		}
+
+		int64_t left = deadline - fn_now();
+		if (left <= 0) {
+			return 0;
+		}
+
+		usleep((left > FN_INT_POLL * 1000000) ? FN_INT_POLL * 1000 : left / 1000 + 1);
+	}
+
+	if (ts) clock_gettime(CLOCK_MONOTONIC, ts);
+	return 1;
+}
+
+void fn_mask_zero(fn_mask_t *mask) {
+	memset(mask, 0, sizeof(fn_mask_t));
+}
+
+void fn_mask_fill(fn_mask_t *mask, int count) {
+	int i;
+
+	fn_mask_zero(mask);
+	for (i = 0; i < count / 32; i++) {
+		mask->bits[i] = 0xffffffff;
+	}
+	if (count % 32) {
+		mask->bits[i] = (1u << (count % 32)) - 1;
+	}
+}
+
+void fn_mask_set(fn_mask_t *mask, uint8_t address) {
+	mask->bits[address / 32] |= 1u << (address % 32);
+}
+
+void fn_mask_clear(fn_mask_t *mask, uint8_t address) {
+	mask->bits[address / 32] &= ~(1u << (address % 32));
+}
+
+int fn_mask_test(const fn_mask_t *mask, uint8_t address) {
+	return (mask->bits[address / 32] >> (address % 32)) & 1;
+}
+
+int fn_mask_popcount(const fn_mask_t *mask) {
+	int i, c = 0;
+
+	for (i = 0; i < FN_MASK_WORDS; i++) {
+		c += __builtin_popcount(mask->bits[i]);
+	}
+
+	return c;
+}
+
+int fn_mask_covers(const fn_mask_t *mask, int count) {
+	fn_mask_t all;
+	int i;
+
+	fn_mask_fill(&all, count);
+	for (i = 0; i < FN_MASK_WORDS; i++) {
+		if ((mask->bits[i] & all.bits[i]) != all.bits[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int fn_mask_parse(fn_mask_t *mask, const char *str) {
+	int i;
+
+	fn_mask_zero(mask);
+	for (i = 0; str[i]; i++) {
+		if (i > FN_MAX_DEVICES || (str[i] != '0' && str[i] != '1')) {
+			return -2; /* invalid mask */
+		}
+		else if (str[i] == '1') {
+			fn_mask_set(mask, i);
+		}
+	}
+
+	return fn_mask_popcount(mask);
+}
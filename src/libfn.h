@@ -29,20 +29,508 @@
 #include <stdint.h>
 #include <termios.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "color.h"
 #include "static-programs.h"
 #include "remote-proto.h"
 
 #define FN_BAUDRATE B19200
+#define FN_BITRATE 19200 /* has to match FN_BAUDRATE */
 #define FN_MAX_DEVICES 254
 #define FN_INT_LINE TIOCM_CTS
+#define FN_INT_TIMEOUT 25	/* ms until an addressed device pulls the interrupt line */
+#define FN_INT_RELEASE 100	/* ms until it releases it again */
+#define FN_INT_POLL 1	/* ms between two looks at it */
+#define FN_CALIBRATION_FANOUT (FN_MAX_DEVICES+2)	/* frames a calibrated broadcast may turn into */
+
+/* compiled address mask, one bit per bus address */
+#define FN_MASK_WORDS 8
+
+typedef struct {
+	uint32_t bits[FN_MASK_WORDS];
+} fn_mask_t;
+
+/* wire time of a single frame (8N1 = 10 bits per byte) */
+#define FN_FRAME_NSEC ((int64_t) REMOTE_MSG_LEN * 10 * 1000000000 / FN_BITRATE)
+
+/* firmware fader tick */
+#define FN_TICK_NSEC 10000000
+
+/* shadow state of a single lamp */
+enum fn_shadow_state {
+	FN_SHADOW_UNKNOWN,
+	FN_SHADOW_FADING,	/* fading towards (or showing) target */
+	FN_SHADOW_PROGRAM	/* running a static program */
+};
+
+struct fn_shadow_lamp {
+	uint8_t state;
+	uint8_t program;
+	uint8_t step;
+	uint8_t delay;
+
+	struct rgb_color_t origin;	/* color when the fade started */
+	struct rgb_color_t target;
+	int64_t since;			/* start of the fade (CLOCK_MONOTONIC, ns) */
+};
+
+#define FN_SHADOW_SUPPRESS 0x01	/* drop frames which would not change the target state */
+
+struct fn_shadow {
+	int flags;
+	unsigned long suppressed;
+
+	struct fn_shadow_lamp lamps[FN_MAX_DEVICES+1];
+};
+
+/* called when the verification found another device count */
+typedef void (*fn_topology_cb_t)(const char *device, int old_count, int new_count, void *arg);
+
+/* topology walk handed to the bus writer, see fn_bus_verify() */
+struct fn_walk {
+	int count;		/* what the cache said */
+	fn_topology_cb_t cb;
+	void *arg;
+
+	int address;		/* probed next (writer only) */
+	int64_t release;	/* the last device has to release the line until then (CLOCK_MONOTONIC, ns) */
+
+	char device[];
+};
+
+/* transmit scheduler */
+#define FN_SCHED_SLOTS 512
+#define FN_SCHED_BUDGET 50000000 /* ns of wire time queued in the kernel at most */
+
+enum fn_class {
+	FN_CLASS_NONE,	/* never coalesced */
+	FN_CLASS_COLOR,
+	FN_CLASS_PROGRAM,
+	FN_CLASS_STOP,
+	FN_CLASS_OFFSETS
+};
+
+struct fn_sched_entry {
+	struct remote_msg_t msg;
+	uint32_t tag;
+	uint8_t class;
+	uint8_t dropped;
+};
+
+struct fn_sched {
+	int fd;
+	int64_t budget;		/* ns, see fn_sched_set_budget() */
+
+	struct fn_shadow *shadow;	/* optional, filters submitted frames */
+
+	uint32_t head, tail;
+	int64_t busy;		/* time when the line drains (CLOCK_MONOTONIC, ns) */
+
+	unsigned long sent;
+	unsigned long coalesced;
+
+	uint32_t pending[FN_MAX_DEVICES+2]; /* last queued frame per address (seq + 1) */
+	struct fn_sched_entry queue[FN_SCHED_SLOTS];
+};
+
+/* asynchronous bus, owned by a writer thread */
+#define FN_BUS_RING 1024
+#define FN_BUS_IDLE 1000000000 /* ns of silence after which the next burst starts with a sync */
+#define FN_BUS_POLL 5 /* ms between two looks at the interrupt line during a topology walk */
+
+struct fn_bus;
+
+/* called by the writer thread once all frames up to ticket 'done' are out */
+typedef void (*fn_bus_notify_t)(struct fn_bus *bus, uint32_t done, void *arg);
+
+struct fn_bus_cell {
+	uint32_t seq;
+	struct remote_msg_t msg;
+};
+
+struct fn_bus {
+	int fd;
+	int epfd;
+	int evfd;		/* wakes the writer */
+
+	int owned;		/* opened by fn_bus_open() */
+	struct termios oldtio;
+
+	pthread_t thread;
+	int running;
+	int sleeping;
+	int resync;		/* sync before the next burst */
+	int probe;		/* pending fn_bus_probe(): address + 1 */
+	struct fn_walk *verify;	/* pending fn_bus_verify() */
+	int64_t probe_due;	/* when to sample the answer (CLOCK_MONOTONIC, ns) */
+	int error;		/* last write error (errno) */
+	int64_t drained;	/* when the wire time ahead of a new submission has passed (CLOCK_MONOTONIC, ns) */
+	long budget;		/* pending fn_bus_set_budget() */
+	unsigned long dropped;
+	unsigned long syncs;
+
+	struct fn_sched sched;	/* writer only */
+
+	uint8_t out[REMOTE_SYNC_LEN + 1 + FN_SCHED_SLOTS * REMOTE_MSG_LEN];
+	size_t outlen, outpos;
+
+	/* completion */
+	uint32_t done;
+	int waiters;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	fn_bus_notify_t notify;
+	void *notify_arg;
+
+	/* submission ring */
+	uint32_t dequeue;
+	uint32_t enqueue __attribute__ ((aligned (64))); /* contended by producers */
+	struct fn_bus_cell ring[FN_BUS_RING];
+};
+
+/* lock-free ring between exactly one producer and one consumer thread */
+struct fn_ring {
+	size_t size;		/* bytes per slot */
+	uint32_t count;		/* slots, power of two */
+	int evfd;		/* wakes the consumer */
+	uint8_t *slots;
+	unsigned long overruns;	/* claims which found the ring full */
+
+	uint32_t head __attribute__ ((aligned (64))); /* written by the producer */
+	uint32_t tail __attribute__ ((aligned (64))); /* written by the consumer */
+};
+
+/* band energies of a power spectrum: a sparse weight matrix, one row per band */
+struct fn_bands {
+	int count;		/* bands */
+	int bins;		/* spectrum bins used */
+	int *offset;		/* count + 1 rows into bin[] and weight[] */
+	int *bin;
+	float *weight;		/* share of the bin in the band times the loudness gain */
+	float *power;		/* squared magnitudes, scratch */
+
+	float attack, release;	/* smoothing factors per update */
+	float *energy;		/* smoothed, one per band */
+};
+
+/* onsets and tempo from band energies, one update per analysis hop */
+struct fn_onset {
+	int bands;
+	double interval;	/* s between two updates */
+	int min_lag, max_lag;	/* tempo range in updates */
+	int length;		/* of the flux history */
+	int median;		/* updates the threshold looks back */
+	int gap;		/* updates between two onsets at least */
+	float decay;		/* of the autocorrelation per update */
+	float falloff;		/* of the peak envelope per update */
+	float multiplier, delta;/* threshold = multiplier * median + delta */
+
+	float *last;		/* log energies of the previous update */
+	float *flux;		/* history, ring */
+	float *strength;	/* flux above the threshold, ring */
+	float *scratch;
+	float *acf;		/* autocorrelation of the strength */
+	float *prior;		/* tempo preference per lag */
+	int pos;
+	float envelope;		/* decaying maximum of the flux */
+	int misses;		/* onsets off the predicted beats in a row */
+
+	unsigned long updates;
+	unsigned long onsets;
+	unsigned long onset_update;
+
+	int64_t period;		/* ns per beat, 0 if unknown */
+	int64_t next;		/* predicted beat (CLOCK_MONOTONIC, ns) */
+	float confidence;	/* 0 .. 1 */
+};
+
+/* traffic capture: a header followed by fixed size records */
+#define FN_CAPTURE_MAGIC "FNCAP\0\0\1"
+
+#define FN_CAPTURE_SYNC 0x01	/* sync sequence, frame[0] holds the address byte */
+#define FN_CAPTURE_BUS 0x02	/* written by the fn_bus writer thread */
+
+struct fn_capture_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t reserved;
+	int64_t created;	/* CLOCK_REALTIME, ns */
+} __attribute__ ((__packed__));
+
+struct fn_capture_record {
+	int64_t time;		/* hand-off to the kernel (CLOCK_MONOTONIC, ns) */
+	uint8_t flags;
+	uint8_t frame[REMOTE_MSG_LEN];	/* as on the wire */
+} __attribute__ ((__packed__));
+
+struct fn_capture {
+	void *base;
+	size_t size;
+
+	const struct fn_capture_header *header;
+	const struct fn_capture_record *records;
+	size_t count;
+};
+
+/* compiled scene: a header followed by the EEPROM rows and the keyframes of a show */
+#define FN_SCENE_MAGIC "FNSCN\0\0\1"
+
+struct fn_scene_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t slots;		/* number of EEPROM rows */
+	uint32_t keyframes;	/* number of timed fades, ordered by time */
+	uint32_t duration;	/* ms until the last keyframe or target is reached */
+} __attribute__ ((__packed__));
+
+struct fn_scene_record {
+	uint32_t time;		/* ms since the start of the show, EEPROM slot for EEPROM rows */
+	uint8_t address;
+	uint8_t step;
+	uint8_t delay;
+	uint8_t reserved;
+	uint16_t pause;		/* EEPROM rows only */
+	struct rgb_color_t color;
+	uint8_t padding[3];
+} __attribute__ ((__packed__));
+
+struct fn_scene {
+	void *base;
+	size_t size;
+
+	const struct fn_scene_header *header;
+	const struct fn_scene_record *slots;
+	size_t slot_count;
+	const struct fn_scene_record *keyframes;
+	size_t keyframe_count;
+};
+
+/* EEPROM color slots of a chain, as far as we know them */
+struct fn_eeprom {
+	fn_mask_t known[CONFIG_EEPROM_COLORS];
+	struct remote_msg_save_rgb_t slots[FN_MAX_DEVICES+1][CONFIG_EEPROM_COLORS];
+};
+
+/* firmware updates through the bootloader */
+#define FN_FLASH_SIZE 65536	/* largest image, no extended addressing */
+#define FN_FLASH_PAGE 64	/* bytes per CRC_CHECK/FLASH cycle, a multiple of the SPM page */
+#define FN_FLASH_RETRIES 3	/* unicast attempts per page before a device is given up */
+#define FN_FLASH_REBOOT 100	/* ms until the devices run their bootloader */
+#define FN_FLASH_WRITE 10	/* ms to erase and write a page */
+
+typedef void (*fn_flash_progress_t)(int done, int total, void *arg);
+
+/* several buses behind one logical lamp address space */
+#define FN_GROUP_BUSES 16
+#define FN_GROUP_LAMPS 4096
+
+struct fn_group_lamp {
+	int8_t bus;		/* -1 if not mapped */
+	uint8_t address;
+};
+
+struct fn_group {
+	int count;
+	struct fn_bus *buses[FN_GROUP_BUSES];
+	char *devices[FN_GROUP_BUSES];
+
+	fn_mask_t mapped[FN_GROUP_BUSES];	/* addresses with a logical id */
+	int chain[FN_GROUP_BUSES];		/* devices if the whole chain is mapped, else 0 */
+	int length[FN_GROUP_BUSES];		/* devices on the port from the config, 0 if unknown */
+	uint32_t last[FN_GROUP_BUSES];		/* ticket of the last submission */
+
+	int lamps;				/* highest logical id + 1 */
+	struct fn_group_lamp map[FN_GROUP_LAMPS];
+};
+
+/* effect engine: generators render one color per lamp, fn_fx sends them on a fixed clock */
+struct fn_effect_params {
+	struct rgb_color_t from, to;
+	double speed;		/* cycles per second */
+	double scale;		/* lamps per cycle, length of the tail for chase */
+};
+
+typedef void (*fn_effect_render_t)(struct rgb_color_t *colors, int count, int64_t t, const struct fn_effect_params *p);
+
+struct fn_effect {
+	const char *name;
+	fn_effect_render_t render;
+};
+
+struct fn_fx {
+	struct fn_bus *bus;
+	const struct fn_effect *effect;
+	struct fn_effect_params params;
+
+	int count;
+	int chain;		/* lamps on the bus if known, broadcasts need count to cover them */
+	int threshold;		/* smallest fn_rgb_distance() worth a frame */
+	int timer;		/* timerfd, -1 without effect */
+	int64_t interval;	/* ns per tick */
+	int64_t start;
+
+	unsigned long ticks;
+	unsigned long overruns;	/* ticks we missed */
+	unsigned long starved;	/* ticks without room on the bus */
+	unsigned long deferred;	/* lamp updates put off to a later tick */
+	unsigned long frames;
+
+	fn_mask_t known;	/* lamps we sent a color to */
+	struct rgb_color_t want[FN_MAX_DEVICES+1];
+	struct rgb_color_t shown[FN_MAX_DEVICES+1];
+};
+
+extern const struct fn_effect fn_effects[];
+
+int64_t fn_now();
+struct rgb_color_t fn_hsv2rgb(struct hsv_color_t hsv);
+struct hsv_color_t fn_rgb2hsv(struct rgb_color_t rgb);
+
+const char * fn_color_kernels();
+void fn_hsv2rgb_batch(struct rgb_color_t *rgb, const struct hsv_color_t *hsv, size_t n);
+void fn_rgb2hsv_batch(struct hsv_color_t *hsv, const struct rgb_color_t *rgb, size_t n);
+void fn_rgb_lerp(struct rgb_color_t *out, const struct rgb_color_t *a, const struct rgb_color_t *b, uint8_t t, size_t n);
+void fn_rgb_scale(struct rgb_color_t *out, const struct rgb_color_t *in, uint8_t factor, size_t n);
+void fn_gamma_table(uint8_t *lut, double gamma);
+void fn_rgb_lut(struct rgb_color_t *out, const struct rgb_color_t *in, const uint8_t *lut, size_t n);
+struct rgb_color_t fn_rgb_box(const uint8_t *image, size_t stride, int x, int y, int w, int h);
+int fn_rgb_distance(struct rgb_color_t a, struct rgb_color_t b);
+void fn_power_spectrum(float *power, const double *spectrum, size_t n);
+
+double fn_loudness_gain(double freq);
+int fn_bands_init(struct fn_bands *b, int count, int window, int rate, double min_freq, double max_freq, double gain);
+void fn_bands_free(struct fn_bands *b);
+void fn_bands_smoothing(struct fn_bands *b, double interval, double attack, double release);
+void fn_bands_update(struct fn_bands *b, const double *spectrum);
+
+int fn_onset_init(struct fn_onset *o, int bands, double interval, int min_bpm, int max_bpm);
+void fn_onset_free(struct fn_onset *o);
+int fn_onset_update(struct fn_onset *o, const float *energy, int64_t t);
+
+int fn_calibration_open(const char *path);
+void fn_calibration_close();
+int fn_calibrate(struct remote_msg_t *out, int size, const struct remote_msg_t *in, int *count);
 
 struct termios fn_init(int fd);
 size_t fn_send(int fd, struct remote_msg_t *msg);
+size_t fn_pack_frames(uint8_t *buf, const struct remote_msg_t *msgs, int count);
+size_t fn_send_frames(int fd, struct remote_msg_t *msgs, int count);
 size_t fn_send_mask(int fd, const char *mask, struct remote_msg_t *msg);
+int fn_mask_expand(const fn_mask_t *mask, const struct remote_msg_t *msg, int count, struct remote_msg_t *burst);
+size_t fn_send_bits(int fd, const fn_mask_t *mask, struct remote_msg_t *msg, int count);
+size_t fn_send_each(int fd, struct remote_msg_t *msgs, int count);
 size_t fn_sync(int fd);
 int fn_get_int(int fd);
+int fn_wait_int(int fd, int active, int timeout, struct timespec *ts);
+
+int fn_capture_open(const char *path);
+void fn_capture_close();
+void fn_capture(const struct remote_msg_t *msgs, int count, int flags);
+void fn_capture_sync(uint8_t address);
+int fn_capture_map(struct fn_capture *cap, const char *path);
+void fn_capture_unmap(struct fn_capture *cap);
+void fn_capture_frame(const struct fn_capture_record *rec, struct remote_msg_t *msg);
+int fn_msg_describe(char *buf, size_t len, const struct remote_msg_t *msg);
+
+void fn_eeprom_init(struct fn_eeprom *ee);
+void fn_eeprom_apply(struct fn_eeprom *ee, const struct remote_msg_t *msg, int count);
+int fn_eeprom_parse(struct fn_eeprom *ee, const char *path, int count);
+int fn_eeprom_plan(const struct fn_eeprom *cur, const struct fn_eeprom *want, int count, int slot, struct remote_msg_t *burst);
+int fn_eeprom_sync(int fd, struct fn_eeprom *cur, const struct fn_eeprom *want, int count);
+
+int fn_scene_compile(const char *csv, const char *path);
+int fn_scene_map(struct fn_scene *sc, const char *path);
+void fn_scene_unmap(struct fn_scene *sc);
+void fn_scene_frame(const struct fn_scene_record *rec, int slot, struct remote_msg_t *msg);
+int fn_scene_eeprom(const struct fn_scene *sc, struct fn_eeprom *ee, int count);
+size_t fn_scene_batch(const struct fn_scene *sc, size_t i, struct remote_msg_t *burst, int max, int *n);
+
+int64_t fn_timeline_fade(struct rgb_color_t from, struct rgb_color_t to, int64_t duration, uint8_t *step, uint8_t *delay);
+int fn_timeline_plan(const struct fn_scene_record *keys, size_t count, struct fn_scene_record *fades);
+
+const struct fn_effect * fn_effect_find(const char *name);
+int fn_fx_init(struct fn_fx *fx, struct fn_bus *bus, int count, int rate, const struct fn_effect *effect);
+void fn_fx_close(struct fn_fx *fx);
+int fn_fx_output(struct fn_fx *fx);
+int fn_fx_tick(struct fn_fx *fx);
+
+uint16_t fn_crc16(uint16_t crc, const uint8_t *data, size_t len);
+int fn_flash_load(const char *path, uint8_t *image, uint16_t *start);
+int fn_flash(int fd, int count, const uint8_t *image, uint16_t start, int len, fn_mask_t *failed, fn_flash_progress_t cb, void *arg);
+
+int fn_cache_path(char *path, size_t len, const char *name);
+int fn_topology_load(const char *device);
+int fn_topology_store(const char *device, int count);
+int fn_count_devices_cached(int fd, const char *device, int *cached);
+int fn_topology_verify(int fd, const char *device, int count, fn_topology_cb_t cb, void *arg);
+int fn_eeprom_load(struct fn_eeprom *ee, const char *device);
+int fn_eeprom_store(const struct fn_eeprom *ee, const char *device);
 uint8_t fn_count_devices(int fd);
 
+void fn_mask_zero(fn_mask_t *mask);
+void fn_mask_fill(fn_mask_t *mask, int count);
+void fn_mask_set(fn_mask_t *mask, uint8_t address);
+void fn_mask_clear(fn_mask_t *mask, uint8_t address);
+int fn_mask_test(const fn_mask_t *mask, uint8_t address);
+int fn_mask_popcount(const fn_mask_t *mask);
+int fn_mask_covers(const fn_mask_t *mask, int count);
+int fn_mask_parse(fn_mask_t *mask, const char *str);
+
+int64_t fn_fade_duration(struct rgb_color_t from, struct rgb_color_t to, uint8_t step, uint8_t delay);
+void fn_shadow_init(struct fn_shadow *sh, int flags);
+int fn_shadow_check(struct fn_shadow *sh, const struct remote_msg_t *msg);
+void fn_shadow_commit(struct fn_shadow *sh, const struct remote_msg_t *msg);
+struct rgb_color_t fn_shadow_estimate(const struct fn_shadow *sh, uint8_t address);
+size_t fn_send_shadow(int fd, struct fn_shadow *sh, struct remote_msg_t *msg);
+
+struct fn_group * fn_group_open(const char *config);
+void fn_group_close(struct fn_group *g);
+uint32_t fn_group_submit(struct fn_group *g, int lamp, const struct remote_msg_t *msg);
+int fn_group_submit_all(struct fn_group *g, const struct remote_msg_t *msg);
+int fn_group_submit_mask(struct fn_group *g, const char *mask, const struct remote_msg_t *msg);
+int fn_group_flush(struct fn_group *g, int timeout);
+void fn_group_sync(struct fn_group *g);
+void fn_group_probe(struct fn_group *g);
+int fn_group_error(struct fn_group *g);
+long fn_group_queued(struct fn_group *g);
+
+int fn_msg_class(const struct remote_msg_t *msg);
+void fn_sched_init(struct fn_sched *s, int fd);
+int fn_sched_submit(struct fn_sched *s, const struct remote_msg_t *msg);
+int fn_sched_submit_tagged(struct fn_sched *s, const struct remote_msg_t *msg, uint32_t tag);
+int fn_sched_pending(struct fn_sched *s);
+int fn_sched_oldest(struct fn_sched *s, uint32_t *tag);
+int fn_sched_take(struct fn_sched *s, struct remote_msg_t *burst, long *wait);
+long fn_sched_run(struct fn_sched *s);
+long fn_sched_queued(struct fn_sched *s);
+void fn_sched_set_budget(struct fn_sched *s, long usec);
+int fn_sched_flush(struct fn_sched *s);
+
+struct fn_bus * fn_bus_open(const char *device);
+struct fn_bus * fn_bus_attach(int fd);
+void fn_bus_close(struct fn_bus *bus);
+int fn_bus_fd(struct fn_bus *bus);
+int fn_bus_error(struct fn_bus *bus);
+uint32_t fn_bus_submit(struct fn_bus *bus, const struct remote_msg_t *msg);
+uint32_t fn_bus_submit_frames(struct fn_bus *bus, const struct remote_msg_t *msgs, int count);
+void fn_bus_sync(struct fn_bus *bus);
+void fn_bus_probe(struct fn_bus *bus, uint8_t address);
+int fn_bus_verify(struct fn_bus *bus, const char *device, int count, fn_topology_cb_t cb, void *arg);
+void fn_bus_set_notify(struct fn_bus *bus, fn_bus_notify_t cb, void *arg);
+int fn_bus_wait(struct fn_bus *bus, uint32_t ticket, int timeout);
+long fn_bus_queued(struct fn_bus *bus);
+void fn_bus_set_budget(struct fn_bus *bus, long usec);
+
+int fn_ring_init(struct fn_ring *r, size_t size, int count);
+void fn_ring_free(struct fn_ring *r);
+int fn_ring_pending(struct fn_ring *r);
+void * fn_ring_claim(struct fn_ring *r);
+void fn_ring_publish(struct fn_ring *r);
+const void * fn_ring_peek(struct fn_ring *r);
+void fn_ring_release(struct fn_ring *r);
+int fn_ring_wait(struct fn_ring *r, int timeout);
+
 #endif
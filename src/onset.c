@@ -0,0 +1,238 @@
+/**
+ * fnordlicht C library - onset and beat detection
+ *
+ * spectral flux of band energies against a running median,
+ * the tempo comes from a leaky autocorrelation of the flux
+ *
+ * every update costs the same: a median over a few hundred ms
+ * and one multiply-add per candidate tempo
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "libfn.h"
+
+#define FN_ONSET_MEDIAN		0.25	/* s of flux the threshold follows */
+#define FN_ONSET_MEMORY		4.0	/* s, time constant of the autocorrelation */
+#define FN_ONSET_GAP		0.1	/* s between two onsets at least */
+#define FN_ONSET_FALLOFF	0.2	/* s, time constant of the peak envelope */
+#define FN_ONSET_MISSES		4	/* onsets off the beat before we start over */
+#define FN_ONSET_PREFERRED	120	/* bpm, the middle of the tempo prior */
+
+int fn_onset_init(struct fn_onset *o, int bands, double interval, int min_bpm, int max_bpm) {
+	memset(o, 0, sizeof(struct fn_onset));
+
+	if (bands < 1 || interval <= 0 || min_bpm < 1 || max_bpm <= min_bpm) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	o->bands = bands;
+	o->interval = interval;
+	o->min_lag = floor(60.0 / max_bpm / interval);
+	o->max_lag = ceil(60.0 / min_bpm / interval);
+	o->length = o->max_lag + 1;
+	o->median = (int) (FN_ONSET_MEDIAN / interval) | 1;
+	o->gap = FN_ONSET_GAP / interval;
+	o->decay = exp(-interval / FN_ONSET_MEMORY);
+	o->falloff = exp(-interval / FN_ONSET_FALLOFF);
+	o->multiplier = 1.5;
+	o->delta = 0.5;		/* dB */
+
+	if (o->min_lag < 1 || o->median > o->length) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	o->last = calloc(bands, sizeof(float));
+	o->flux = calloc(o->length, sizeof(float));
+	o->strength = calloc(o->length, sizeof(float));
+	o->scratch = malloc(o->median * sizeof(float));
+	o->acf = calloc(o->max_lag + 1, sizeof(float));
+	o->prior = malloc((o->max_lag + 1) * sizeof(float));
+
+	if (!o->last || !o->flux || !o->strength || !o->scratch || !o->acf || !o->prior) {
+		fn_onset_free(o);
+		return -1;
+	}
+
+	/* a wide log-gaussian around 120 bpm keeps us from locking onto half or double the tempo */
+	int lag;
+	double preferred = 60.0 / FN_ONSET_PREFERRED / interval;
+	for (lag = 0; lag <= o->max_lag; lag++) {
+		double octaves = log2((lag + 0.5) / preferred);
+		o->prior[lag] = exp(-0.5 * octaves * octaves);
+	}
+
+	return 0;
+}
+
+void fn_onset_free(struct fn_onset *o) {
+	free(o->last);
+	free(o->flux);
+	free(o->strength);
+	free(o->scratch);
+	free(o->acf);
+	free(o->prior);
+}
+
+/* quickselect, 'v' gets reordered */
+static float fn_onset_median(float *v, int n) {
+	int lo = 0, hi = n - 1, k = n / 2;
+
+	while (lo < hi) {
+		float pivot = v[k];
+		int i = lo, j = hi;
+
+		do {
+			while (v[i] < pivot) i++;
+			while (pivot < v[j]) j--;
+
+			if (i <= j) {
+				float tmp = v[i];
+				v[i] = v[j];
+				v[j] = tmp;
+				i++;
+				j--;
+			}
+		} while (i <= j);
+
+		if (j < k) lo = i;
+		if (k < i) hi = j;
+	}
+
+	return v[k];
+}
+
+#define FN_ONSET_AT(o, age) ((o)->pos + (o)->length - 1 - (age)) % (o)->length
+
+static void fn_onset_tempo(struct fn_onset *o) {
+	int lag, best = 0;
+	float s = o->strength[FN_ONSET_AT(o, 0)];
+
+	for (lag = 0; lag <= o->max_lag; lag++) {
+		o->acf[lag] = o->decay * o->acf[lag] + s * o->strength[FN_ONSET_AT(o, lag)];
+	}
+
+	for (lag = o->min_lag; lag <= o->max_lag; lag++) {
+		if (!best || o->acf[lag] * o->prior[lag] > o->acf[best] * o->prior[best]) {
+			best = lag;
+		}
+	}
+
+	if (o->acf[0] <= 0 || best <= o->min_lag || best >= o->max_lag) {
+		o->period = 0; /* silence or no clear peak */
+		return;
+	}
+
+	/* parabola through the peak and its neighbours */
+	double l = o->acf[best - 1], c = o->acf[best], r = o->acf[best + 1];
+	double shift = (l - 2 * c + r < 0) ? 0.5 * (l - r) / (l - 2 * c + r) : 0;
+
+	o->confidence = c / o->acf[0];
+	o->period = (best + shift) * o->interval * 1e9;
+}
+
+/* the beat after 'now', pulled towards the onsets we see */
+static void fn_onset_phase(struct fn_onset *o, int64_t onset, int64_t now) {
+	if (!o->period) {
+		o->next = 0;
+		return;
+	}
+
+	if (onset && !o->next) {
+		o->next = onset + o->period; /* nothing predicted yet to compare with */
+		o->misses = 0;
+	}
+	else if (onset) {
+		/* distance to the closest beat we predicted, it may lie behind us already */
+		int64_t error = (onset - o->next) % o->period;
+
+		if (error >= o->period / 2) error -= o->period;
+		if (error < -o->period / 2) error += o->period;
+
+		if (llabs(error) <= o->period / 4) {
+			o->next += error / 2;
+			o->misses = 0;
+		}
+		else if (++o->misses >= FN_ONSET_MISSES) {
+			o->next = onset + o->period; /* lost the beat: start over */
+			o->misses = 0;
+		}
+	}
+
+	while (o->next && o->next < now) {
+		o->next += o->period; /* keeps going through breaks */
+	}
+}
+
+/* 'energy': o->bands values, 't' when the analysed audio was played (CLOCK_MONOTONIC, ns) */
+int fn_onset_update(struct fn_onset *o, const float *energy, int64_t t) {
+	float flux = 0, threshold, s;
+	int i, onset = 0;
+
+	/* rises in loudness only, in dB: quiet tracks look like loud ones */
+	for (i = 0; i < o->bands; i++) {
+		float l = 10 * log10f(energy[i] + 1e-10f);
+
+		if (l > o->last[i] && o->updates) {
+			flux += l - o->last[i];
+		}
+
+		o->last[i] = l;
+	}
+
+	flux /= o->bands;
+	o->flux[o->pos] = flux;
+
+	for (i = 0; i < o->median; i++) {
+		o->scratch[i] = o->flux[FN_ONSET_AT(o, i - 1)];
+	}
+
+	threshold = o->multiplier * fn_onset_median(o->scratch, o->median) + o->delta;
+	s = o->flux[o->pos] - threshold;
+	o->strength[o->pos] = (s > 0) ? s : 0;
+
+	o->pos = (o->pos + 1) % o->length;
+	o->updates++;
+
+	/* a peak one update ago, we needed this one to see it,
+	 * and no smaller than what the last onsets left behind */
+	float prev = o->strength[FN_ONSET_AT(o, 1)];
+	if (prev > 0 && prev >= o->strength[FN_ONSET_AT(o, 0)] && prev > o->strength[FN_ONSET_AT(o, 2)] &&
+	    o->flux[FN_ONSET_AT(o, 1)] >= o->envelope && o->updates - o->onset_update > o->gap) {
+		o->onset_update = o->updates - 1;
+		o->onsets++;
+		onset = 1;
+	}
+
+	o->envelope = fmaxf(o->flux[FN_ONSET_AT(o, 1)], o->falloff * o->envelope);
+
+	fn_onset_tempo(o);
+	fn_onset_phase(o, onset ? t - (int64_t) (o->interval * 1e9) : 0, t);
+
+	return onset;
+}
@@ -89,7 +89,7 @@ struct remote_msg_save_rgb_t {
     uint8_t delay;
     uint16_t pause;
     struct rgb_color_t color;
-};
+} __attribute__ ((__packed__));
 
 struct remote_msg_save_hsv_t {
     uint8_t address;
@@ -99,14 +99,14 @@ struct remote_msg_save_hsv_t {
     uint8_t delay;
     uint16_t pause;
     struct hsv_color_t color;
-};
+} __attribute__ ((__packed__));
 
 struct remote_msg_save_current_t {
     uint8_t slot;
     uint8_t step;
     uint8_t delay;
     uint16_t pause;
-};
+} __attribute__ ((__packed__));
 
 struct remote_msg_config_offsets_t {
     int8_t step;
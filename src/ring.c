@@ -0,0 +1,117 @@
+/**
+ * fnordlicht C library - single producer, single consumer ring
+ *
+ * hands fixed size blocks from one thread to another without locks,
+ * an eventfd wakes up the consumer
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "libfn.h"
+
+int fn_ring_init(struct fn_ring *r, size_t size, int count) {
+	memset(r, 0, sizeof(struct fn_ring));
+
+	if (count < 1 || (count & (count - 1))) {
+		errno = EINVAL;
+		return -1; /* not a power of two */
+	}
+
+	r->size = (size + 63) & ~63; /* slots don't share cache lines */
+	r->count = count;
+
+	if ((errno = posix_memalign((void **) &r->slots, 64, r->size * count))) {
+		return -1;
+	}
+
+	if ((r->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		free(r->slots);
+		return -1;
+	}
+
+	return 0;
+}
+
+void fn_ring_free(struct fn_ring *r) {
+	close(r->evfd);
+	free(r->slots);
+}
+
+int fn_ring_pending(struct fn_ring *r) {
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/* producer: a free slot to fill in, NULL if the consumer fell behind */
+void * fn_ring_claim(struct fn_ring *r) {
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->count) {
+		r->overruns++;
+		return NULL;
+	}
+
+	return r->slots + (head & (r->count - 1)) * r->size;
+}
+
+void fn_ring_publish(struct fn_ring *r) {
+	uint64_t one = 1;
+
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	if (write(r->evfd, &one, sizeof(one)) < 0) { /* counter saturated, consumer is awake anyway */ }
+}
+
+/* consumer: the oldest block, NULL if there is none */
+const void * fn_ring_peek(struct fn_ring *r) {
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+		return NULL;
+	}
+
+	return r->slots + (tail & (r->count - 1)) * r->size;
+}
+
+void fn_ring_release(struct fn_ring *r) {
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* consumer: block until there is something to peek at, 0 on timeout (ms) */
+int fn_ring_wait(struct fn_ring *r, int timeout) {
+	struct pollfd pfd = { .fd = r->evfd, .events = POLLIN };
+	uint64_t cnt;
+
+	while (!fn_ring_pending(r)) {
+		if (poll(&pfd, 1, timeout) <= 0) {
+			return 0;
+		}
+
+		if (read(r->evfd, &cnt, sizeof(cnt)) < 0) { /* someone else reset it */ }
+	}
+
+	return 1;
+}
@@ -0,0 +1,338 @@
+/**
+ * fnordlicht C library - compiled scenes
+ *
+ * EEPROM sequences and timed shows in a binary format
+ * which is used in place by mapping it into memory
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libfn.h"
+
+struct fn_scene_rows {
+	struct fn_scene_record *records;
+	size_t count, size;
+};
+
+static int fn_scene_append(struct fn_scene_rows *rows, const struct fn_scene_record *rec) {
+	if (rows->count == rows->size) {
+		size_t size = (rows->size) ? 2 * rows->size : 256;
+		struct fn_scene_record *records = realloc(rows->records, size * sizeof(struct fn_scene_record));
+
+		if (!records) {
+			return -1;
+		}
+
+		rows->records = records;
+		rows->size = size;
+	}
+
+	rows->records[rows->count++] = *rec;
+
+	return 0;
+}
+
+/* keyframes are ordered by time, rows of the same time keep their order (merge sort) */
+static int fn_scene_sort(struct fn_scene_rows *rows) {
+	struct fn_scene_record *a = rows->records, *b, *t;
+	size_t n = rows->count, w, i;
+
+	if (n < 2) {
+		return 0;
+	}
+
+	if (!(b = malloc(n * sizeof(struct fn_scene_record)))) {
+		return -1;
+	}
+
+	for (w = 1; w < n; w *= 2) {
+		for (i = 0; i < n; i += 2 * w) {
+			size_t l = i, m = (i + w < n) ? i + w : n, r = m, e = (i + 2 * w < n) ? i + 2 * w : n, k = i;
+
+			while (l < m || r < e) {
+				b[k++] = (r == e || (l < m && a[l].time <= a[r].time)) ? a[l++] : a[r++];
+			}
+		}
+
+		t = a; a = b; b = t;
+	}
+
+	if (a != rows->records) { /* result ended up in the scratch buffer */
+		memcpy(rows->records, a, n * sizeof(struct fn_scene_record));
+		b = a;
+	}
+
+	free(b);
+
+	return 0;
+}
+
+static int fn_scene_parse(FILE *in, const char *path, struct fn_scene_rows *slots, struct fn_scene_rows *keyframes, struct fn_scene_rows *targets) {
+	char row[1024];
+	int line = 0;
+
+	while (fgets(row, sizeof(row), in)) {
+		struct fn_scene_record rec;
+		unsigned int time, address, slot, red, green, blue, step, delay, pause;
+		char *p = row + strspn(row, " \t");
+
+		line++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+			continue; /* comments and empty rows */
+		}
+
+		memset(&rec, 0, sizeof(rec));
+
+		if (*p == '@') { /* "@ms;address;color;step;delay": fade at this time of the show */
+			if (sscanf(p, "@%u;%u;%2x%2x%2x;%u;%u", &time, &address, &red, &green, &blue, &step, &delay) != 7) {
+				goto invalid;
+			}
+
+			rec.time = time;
+		}
+		else if (*p == '~') { /* "~ms;address;color": show this color at this time, the fade is up to us */
+			if (sscanf(p, "~%u;%u;%2x%2x%2x", &time, &address, &red, &green, &blue) != 5) {
+				goto invalid;
+			}
+
+			rec.time = time;
+			step = delay = 0;
+		}
+		else { /* "address;slot;color;step;delay;pause": EEPROM row */
+			if (sscanf(p, "%u;%u;%2x%2x%2x;%u;%u;%u", &address, &slot, &red, &green, &blue, &step, &delay, &pause) != 8 ||
+			    slot >= CONFIG_EEPROM_COLORS || pause > 65535) {
+				goto invalid;
+			}
+
+			rec.time = slot;
+			rec.pause = pause;
+		}
+
+		if (address > 255 || step > 255 || delay > 255) {
+			goto invalid;
+		}
+
+		rec.address = address;
+		rec.step = step;
+		rec.delay = delay;
+		rec.color.red = red;
+		rec.color.green = green;
+		rec.color.blue = blue;
+
+		if (fn_scene_append((*p == '@') ? keyframes : (*p == '~') ? targets : slots, &rec)) {
+			return -1;
+		}
+	}
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s:%d: invalid row\n", path, line);
+	errno = EINVAL;
+	return -1;
+}
+
+/* fades which reach the targets in time, merged into the keyframes */
+static int fn_scene_timeline(struct fn_scene_rows *keyframes, struct fn_scene_rows *targets) {
+	struct fn_scene_record *fades;
+	int i, n;
+
+	if (targets->count == 0) {
+		return 0;
+	}
+
+	if (fn_scene_sort(targets) || !(fades = malloc(targets->count * sizeof(struct fn_scene_record)))) {
+		return -1;
+	}
+
+	n = fn_timeline_plan(targets->records, targets->count, fades);
+
+	for (i = 0; i < n; i++) {
+		if (fn_scene_append(keyframes, &fades[i])) {
+			free(fades);
+			return -1;
+		}
+	}
+
+	free(fades);
+
+	return 0;
+}
+
+int fn_scene_compile(const char *csv, const char *path) {
+	struct fn_scene_rows slots = { 0 }, keyframes = { 0 }, targets = { 0 };
+	struct fn_scene_header header;
+	char tmp[1024];
+	FILE *in, *out;
+	int ret = -1;
+
+	if (!(in = fopen(csv, "r"))) {
+		return -1;
+	}
+
+	if (fn_scene_parse(in, csv, &slots, &keyframes, &targets)) {
+		goto out;
+	}
+
+	if (fn_scene_timeline(&keyframes, &targets) || fn_scene_sort(&keyframes)) {
+		goto out;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FN_SCENE_MAGIC, sizeof(header.magic));
+	header.record_size = sizeof(struct fn_scene_record);
+	header.slots = slots.count;
+	header.keyframes = keyframes.count;
+	header.duration = (keyframes.count) ? keyframes.records[keyframes.count - 1].time : 0;
+	if (targets.count && targets.records[targets.count - 1].time > header.duration) {
+		header.duration = targets.records[targets.count - 1].time; /* the last fade is still running */
+	}
+
+	/* replace the old scene atomically, players may still map it */
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	if (!(out = fopen(tmp, "wb"))) {
+		goto out;
+	}
+
+	fwrite(&header, sizeof(header), 1, out);
+	fwrite(slots.records, sizeof(struct fn_scene_record), slots.count, out);
+	fwrite(keyframes.records, sizeof(struct fn_scene_record), keyframes.count, out);
+
+	if (fclose(out) || rename(tmp, path)) {
+		unlink(tmp);
+		goto out;
+	}
+
+	ret = slots.count + keyframes.count;
+
+out:
+	fclose(in);
+	free(slots.records);
+	free(keyframes.records);
+	free(targets.records);
+
+	return ret;
+}
+
+int fn_scene_map(struct fn_scene *sc, const char *path) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	memset(sc, 0, sizeof(struct fn_scene));
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (fstat(fd, &st) || st.st_size < sizeof(struct fn_scene_header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	sc->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (sc->base == MAP_FAILED) {
+		sc->base = NULL;
+		return -1;
+	}
+
+	sc->size = st.st_size;
+	sc->header = sc->base;
+
+	if (memcmp(sc->header->magic, FN_SCENE_MAGIC, sizeof(sc->header->magic)) ||
+	    sc->header->record_size != sizeof(struct fn_scene_record) ||
+	    sc->size != sizeof(struct fn_scene_header) + ((size_t) sc->header->slots + sc->header->keyframes) * sizeof(struct fn_scene_record)) {
+		fn_scene_unmap(sc);
+		errno = EINVAL;
+		return -1;
+	}
+
+	sc->slots = (const struct fn_scene_record *) (sc->header + 1);
+	sc->slot_count = sc->header->slots;
+	sc->keyframes = sc->slots + sc->slot_count;
+	sc->keyframe_count = sc->header->keyframes;
+
+	madvise(sc->base, sc->size, MADV_SEQUENTIAL);
+
+	return 0;
+}
+
+void fn_scene_unmap(struct fn_scene *sc) {
+	if (sc->base) {
+		munmap(sc->base, sc->size);
+	}
+
+	memset(sc, 0, sizeof(struct fn_scene));
+}
+
+void fn_scene_frame(const struct fn_scene_record *rec, int slot, struct remote_msg_t *msg) {
+	memset(msg, 0, sizeof(struct remote_msg_t));
+	msg->address = rec->address;
+
+	if (slot) {
+		msg->cmd = REMOTE_CMD_SAVE_RGB;
+		msg->save_rgb.slot = rec->time;
+		msg->save_rgb.step = rec->step;
+		msg->save_rgb.delay = rec->delay;
+		msg->save_rgb.pause = rec->pause;
+		msg->save_rgb.color = rec->color;
+	}
+	else {
+		msg->cmd = REMOTE_CMD_FADE_RGB;
+		msg->fade_rgb.step = rec->step;
+		msg->fade_rgb.delay = rec->delay;
+		msg->fade_rgb.color = rec->color;
+	}
+}
+
+int fn_scene_eeprom(const struct fn_scene *sc, struct fn_eeprom *ee, int count) {
+	struct remote_msg_t msg;
+	size_t i;
+
+	for (i = 0; i < sc->slot_count; i++) {
+		fn_scene_frame(&sc->slots[i], 1, &msg);
+		fn_eeprom_apply(ee, &msg, count);
+	}
+
+	return sc->slot_count;
+}
+
+size_t fn_scene_batch(const struct fn_scene *sc, size_t i, struct remote_msg_t *burst, int max, int *n) {
+	uint32_t time = sc->keyframes[i].time;
+
+	/* all keyframes of the same instant */
+	for (*n = 0; i < sc->keyframe_count && sc->keyframes[i].time == time && *n < max; i++) {
+		fn_scene_frame(&sc->keyframes[i], 0, &burst[(*n)++]);
+	}
+
+	return i;
+}
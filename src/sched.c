@@ -0,0 +1,240 @@
+/**
+ * fnordlicht C library - transmit scheduler
+ *
+ * paces frames to the wire rate of the bus and coalesces
+ * stale frames per address (latest wins)
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libfn.h"
+
+int fn_msg_class(const struct remote_msg_t *msg) {
+	switch (msg->cmd) {
+		case REMOTE_CMD_FADE_RGB:
+		case REMOTE_CMD_FADE_HSV:
+			return FN_CLASS_COLOR;
+
+		case REMOTE_CMD_START_PROGRAM:
+			return FN_CLASS_PROGRAM;
+
+		case REMOTE_CMD_STOP:
+			return FN_CLASS_STOP;
+
+		case REMOTE_CMD_CONFIG_OFFSETS:
+			return FN_CLASS_OFFSETS;
+
+		default: /* relative or stateful commands must not be merged */
+			return FN_CLASS_NONE;
+	}
+}
+
+void fn_sched_init(struct fn_sched *s, int fd) {
+	memset(s, 0, sizeof(struct fn_sched));
+
+	s->fd = fd;
+	s->budget = FN_SCHED_BUDGET;
+}
+
+static void fn_sched_drop(struct fn_sched *s, int address) {
+	uint32_t seq = s->pending[address];
+
+	if (seq && (int32_t) (seq - 1 - s->tail) >= 0) {
+		s->queue[(seq - 1) % FN_SCHED_SLOTS].dropped = 1;
+		s->coalesced++;
+	}
+}
+
+int fn_sched_submit(struct fn_sched *s, const struct remote_msg_t *msg) {
+	return fn_sched_submit_tagged(s, msg, 0);
+}
+
+int fn_sched_submit_tagged(struct fn_sched *s, const struct remote_msg_t *msg, uint32_t tag) {
+	int i, class = fn_msg_class(msg);
+	uint32_t seq = s->pending[msg->address];
+
+	/* frame would not change what the lamps are showing */
+	if (s->shadow && !fn_shadow_check(s->shadow, msg)) {
+		return 1;
+	}
+
+	/* latest wins: replace the last queued frame for this address */
+	if (class != FN_CLASS_NONE && seq && (int32_t) (seq - 1 - s->tail) >= 0) {
+		struct fn_sched_entry *e = &s->queue[(seq - 1) % FN_SCHED_SLOTS];
+
+		if (e->class == class && !e->dropped) {
+			e->msg = *msg;
+			e->tag = tag;
+			s->coalesced++;
+			if (s->shadow) {
+				fn_shadow_commit(s->shadow, msg);
+			}
+			return 1;
+		}
+	}
+
+	if (s->head - s->tail >= FN_SCHED_SLOTS) {
+		return -1; /* queue full */
+	}
+
+	if (msg->address == REMOTE_ADDR_BROADCAST) {
+		for (i = 0; i <= FN_MAX_DEVICES; i++) {
+			/* a broadcast color supersedes pending unicast colors */
+			seq = s->pending[i];
+			if (class == FN_CLASS_COLOR && seq && s->queue[(seq - 1) % FN_SCHED_SLOTS].class == class) {
+				fn_sched_drop(s, i);
+			}
+
+			s->pending[i] = 0; /* later frames must not overtake the broadcast */
+		}
+	}
+	else {
+		s->pending[REMOTE_ADDR_BROADCAST] = 0;
+	}
+
+	struct fn_sched_entry *e = &s->queue[s->head % FN_SCHED_SLOTS];
+	e->msg = *msg;
+	e->tag = tag;
+	e->class = class;
+	e->dropped = 0;
+
+	s->pending[msg->address] = ++s->head; /* stored as seq + 1, 0 means none */
+
+	if (s->shadow) {
+		fn_shadow_commit(s->shadow, msg);
+	}
+
+	return 0;
+}
+
+int fn_sched_pending(struct fn_sched *s) {
+	return s->head - s->tail;
+}
+
+int fn_sched_oldest(struct fn_sched *s, uint32_t *tag) {
+	uint32_t seq;
+	int found = 0;
+
+	for (seq = s->tail; seq != s->head; seq++) {
+		struct fn_sched_entry *e = &s->queue[seq % FN_SCHED_SLOTS];
+
+		if (!e->dropped && (!found || (int32_t) (e->tag - *tag) < 0)) {
+			*tag = e->tag;
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+/* wire time of the frames already handed to the kernel */
+static int64_t fn_sched_inflight(struct fn_sched *s, int64_t now) {
+	int64_t queued = s->busy - now;
+	int outq;
+
+	/* prefer the driver's view, fall back to our own estimate */
+	if (ioctl(s->fd, TIOCOUTQ, &outq) == 0) {
+		int64_t drain = (int64_t) outq * 10 * 1000000000 / FN_BITRATE;
+		if (drain > queued) {
+			queued = drain;
+		}
+	}
+
+	return (queued > 0) ? queued : 0;
+}
+
+int fn_sched_take(struct fn_sched *s, struct remote_msg_t *burst, long *wait) {
+	int n = 0;
+	int64_t now = fn_now();
+	int64_t queued = fn_sched_inflight(s, now);
+
+	s->busy = now + queued;
+
+	/* release frames as long as the line stays within its latency budget */
+	while (s->tail != s->head && queued + FN_FRAME_NSEC <= s->budget) {
+		struct fn_sched_entry *e = &s->queue[s->tail % FN_SCHED_SLOTS];
+		s->tail++;
+
+		if (e->dropped) {
+			continue;
+		}
+
+		burst[n++] = e->msg;
+		queued += FN_FRAME_NSEC;
+	}
+
+	s->busy = now + queued;
+	s->sent += n;
+
+	if (s->tail == s->head) {
+		*wait = 0; /* idle */
+	}
+	else { /* wait until the line drained enough for the next frame */
+		*wait = (queued + FN_FRAME_NSEC - s->budget) / 1000 + 1;
+	}
+
+	return n;
+}
+
+long fn_sched_queued(struct fn_sched *s) {
+	int64_t queued = fn_sched_inflight(s, fn_now());
+	uint32_t seq;
+
+	/* plus everything still held back in user space */
+	for (seq = s->tail; seq != s->head; seq++) {
+		if (!s->queue[seq % FN_SCHED_SLOTS].dropped) {
+			queued += FN_FRAME_NSEC;
+		}
+	}
+
+	return queued / 1000;
+}
+
+void fn_sched_set_budget(struct fn_sched *s, long usec) {
+	/* at least one frame has to fit in */
+	s->budget = ((int64_t) usec * 1000 < FN_FRAME_NSEC) ? FN_FRAME_NSEC : (int64_t) usec * 1000;
+}
+
+long fn_sched_run(struct fn_sched *s) {
+	struct remote_msg_t burst[FN_SCHED_SLOTS];
+	long wait;
+	int n = fn_sched_take(s, burst, &wait);
+
+	if (n > 0 && (int) fn_send_frames(s->fd, burst, n) < 0) {
+		return -1;
+	}
+
+	return wait;
+}
+
+int fn_sched_flush(struct fn_sched *s) {
+	long wait;
+
+	while ((wait = fn_sched_run(s)) > 0) {
+		usleep(wait);
+	}
+
+	return wait;
+}
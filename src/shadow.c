@@ -0,0 +1,228 @@
+/**
+ * fnordlicht C library - shadow state
+ *
+ * tracks what every lamp on the bus is showing by
+ * replaying sent frames against the firmware fade model
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "libfn.h"
+
+/* the firmware advances a fade by 'step' every 'delay' ticks of 10ms */
+static int64_t fn_fade_interval(uint8_t delay) {
+	return (int64_t) ((delay) ? delay : 1) * FN_TICK_NSEC;
+}
+
+int64_t fn_fade_duration(struct rgb_color_t from, struct rgb_color_t to, uint8_t step, uint8_t delay) {
+	int i, dist = 0;
+
+	for (i = 0; i < 3; i++) {
+		int d = abs(to.rgb[i] - from.rgb[i]);
+		if (d > dist) dist = d;
+	}
+
+	if (step == 0) {
+		return (dist) ? -1 : 0; /* never arrives */
+	}
+
+	return ((dist + step - 1) / step) * fn_fade_interval(delay);
+}
+
+void fn_shadow_init(struct fn_shadow *sh, int flags) {
+	memset(sh, 0, sizeof(struct fn_shadow));
+	sh->flags = flags;
+}
+
+static struct rgb_color_t fn_shadow_estimate_at(const struct fn_shadow_lamp *l, int64_t now) {
+	struct rgb_color_t c = l->target;
+	int i;
+
+	if (l->step == 0 || now < l->since) {
+		return l->origin;
+	}
+
+	int64_t travel = ((now - l->since) / fn_fade_interval(l->delay)) * l->step;
+
+	for (i = 0; i < 3; i++) {
+		int d = l->target.rgb[i] - l->origin.rgb[i];
+
+		if (d > travel) c.rgb[i] = l->origin.rgb[i] + travel;
+		else if (-d > travel) c.rgb[i] = l->origin.rgb[i] - travel;
+	}
+
+	return c;
+}
+
+struct rgb_color_t fn_shadow_estimate(const struct fn_shadow *sh, uint8_t address) {
+	return fn_shadow_estimate_at(&sh->lamps[address], fn_now());
+}
+
+static void fn_shadow_fade(struct fn_shadow_lamp *l, struct rgb_color_t color, uint8_t step, uint8_t delay, int64_t now) {
+	l->origin = (l->state == FN_SHADOW_FADING) ? fn_shadow_estimate_at(l, now) : color;
+	l->target = color;
+	l->step = step;
+	l->delay = delay;
+	l->since = now;
+	l->state = FN_SHADOW_FADING;
+}
+
+static int fn_shadow_redundant(const struct fn_shadow_lamp *l, const struct remote_msg_t *msg, struct rgb_color_t color, int64_t now) {
+	if (l->state != FN_SHADOW_FADING) {
+		return 0; /* unknown or running a program */
+	}
+
+	switch (msg->cmd) {
+		case REMOTE_CMD_FADE_RGB:
+		case REMOTE_CMD_FADE_HSV:
+			if (memcmp(&l->target, &color, sizeof(color)) != 0) {
+				return 0;
+			}
+			else if (l->step == msg->fade_rgb.step && l->delay == msg->fade_rgb.delay) {
+				return 1;
+			}
+			else { /* same target with another speed: only matters while fading */
+				struct rgb_color_t cur = fn_shadow_estimate_at(l, now);
+				return memcmp(&cur, &l->target, sizeof(cur)) == 0;
+			}
+
+		case REMOTE_CMD_STOP: {
+			struct rgb_color_t cur = fn_shadow_estimate_at(l, now);
+			return memcmp(&cur, &l->target, sizeof(cur)) == 0;
+		}
+
+		default:
+			return 0;
+	}
+}
+
+static void fn_shadow_update(struct fn_shadow_lamp *l, const struct remote_msg_t *msg, struct rgb_color_t color, int64_t now) {
+	int i;
+
+	switch (msg->cmd) {
+		case REMOTE_CMD_FADE_RGB:
+		case REMOTE_CMD_FADE_HSV:
+			fn_shadow_fade(l, color, msg->fade_rgb.step, msg->fade_rgb.delay, now);
+			l->program = 0;
+			break;
+
+		case REMOTE_CMD_STOP:
+			if (l->state == FN_SHADOW_FADING && msg->msg_stop.fade) {
+				fn_shadow_fade(l, fn_shadow_estimate_at(l, now), 255, 0, now);
+			}
+			else if (l->state == FN_SHADOW_PROGRAM) {
+				l->state = FN_SHADOW_UNKNOWN; /* stopped somewhere in the program */
+			}
+			break;
+
+		case REMOTE_CMD_MODIFY_CURRENT:
+			if (l->state == FN_SHADOW_FADING && !msg->modify_current.hsv.hue &&
+			    !msg->modify_current.hsv.saturation && !msg->modify_current.hsv.value) {
+				struct rgb_color_t c = l->target;
+				for (i = 0; i < 3; i++) {
+					int v = c.rgb[i] + msg->modify_current.rgb.rgb[i];
+					c.rgb[i] = (v < 0) ? 0 : (v > 255) ? 255 : v;
+				}
+				fn_shadow_fade(l, c, msg->modify_current.step, msg->modify_current.delay, now);
+			}
+			else {
+				l->state = FN_SHADOW_UNKNOWN;
+			}
+			break;
+
+		case REMOTE_CMD_START_PROGRAM:
+			l->state = FN_SHADOW_PROGRAM;
+			l->program = msg->start_program.script;
+			break;
+
+		case REMOTE_CMD_POWERDOWN:
+		case REMOTE_CMD_BOOTLOADER:
+			l->state = FN_SHADOW_UNKNOWN;
+			break;
+
+		default: /* commands which do not touch the current color */
+			break;
+	}
+}
+
+static struct rgb_color_t fn_shadow_color(const struct remote_msg_t *msg, int *first, int *last) {
+	if (msg->address == REMOTE_ADDR_BROADCAST) {
+		*first = 0;
+		*last = FN_MAX_DEVICES;
+	}
+	else {
+		*first = *last = msg->address;
+	}
+
+	if (msg->cmd == REMOTE_CMD_FADE_HSV) {
+		/* the firmware's hsv structure overlays the whole message */
+		return fn_hsv2rgb(((struct remote_msg_fade_hsv_t *) msg)->color);
+	}
+	else {
+		return msg->fade_rgb.color;
+	}
+}
+
+/* 0 if the frame can be suppressed, the shadow itself stays as it is */
+int fn_shadow_check(struct fn_shadow *sh, const struct remote_msg_t *msg) {
+	int64_t now = fn_now();
+	int i, first, last, redundant = 1;
+	struct rgb_color_t color = fn_shadow_color(msg, &first, &last);
+
+	for (i = first; i <= last && redundant; i++) {
+		redundant = fn_shadow_redundant(&sh->lamps[i], msg, color, now);
+	}
+
+	if (redundant && (sh->flags & FN_SHADOW_SUPPRESS)) {
+		sh->suppressed++;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* only once the frame has been queued or written: a rejected one must not become the target */
+void fn_shadow_commit(struct fn_shadow *sh, const struct remote_msg_t *msg) {
+	int64_t now = fn_now();
+	int i, first, last;
+	struct rgb_color_t color = fn_shadow_color(msg, &first, &last);
+
+	for (i = first; i <= last; i++) {
+		fn_shadow_update(&sh->lamps[i], msg, color, now);
+	}
+}
+
+size_t fn_send_shadow(int fd, struct fn_shadow *sh, struct remote_msg_t *msg) {
+	size_t ret;
+
+	if (!fn_shadow_check(sh, msg)) {
+		return 0; /* suppressed */
+	}
+
+	if ((ssize_t) (ret = fn_send(fd, msg)) >= 0) {
+		fn_shadow_commit(sh, msg);
+	}
+
+	return ret;
+}
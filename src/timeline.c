@@ -0,0 +1,128 @@
+/**
+ * fnordlicht C library - timeline
+ *
+ * turns colors which lamps should show at given times into
+ * firmware fades which arrive there on their own
+ *
+ * @copyright	2013 Steffen Vogel
+ * @license	http://www.gnu.org/licenses/gpl.txt GNU Public License
+ * @author	Steffen Vogel <post@steffenvogel.de>
+ * @link	http://www.steffenvogel.de
+ */
+/*
+ * This file is part of libfn
+ *
+ * libfn is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * libfn is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libfn. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "libfn.h"
+
+#define FN_TICK_MSEC (FN_TICK_NSEC / 1000000)
+
+/* the smallest step which arrives close enough to the given time, otherwise the closest fade */
+int64_t fn_timeline_fade(struct rgb_color_t from, struct rgb_color_t to, int64_t duration, uint8_t *step, uint8_t *delay) {
+	int64_t slack = duration / 50, best_err = -1, best = 0;
+	int s, i, dist = 0;
+
+	for (i = 0; i < 3; i++) {
+		int d = abs(to.rgb[i] - from.rgb[i]);
+		if (d > dist) dist = d;
+	}
+
+	*step = 255;
+	*delay = 0;
+
+	if (dist == 0 || duration <= FN_TICK_NSEC) {
+		return (dist) ? FN_TICK_NSEC : 0; /* jump */
+	}
+
+	if (slack < FN_TICK_NSEC) {
+		slack = FN_TICK_NSEC;
+	}
+
+	for (s = 1; s <= 255; s++) {
+		int64_t n = (dist + s - 1) / s; /* updates until the fade arrives */
+		int64_t ticks = (duration + n * FN_TICK_NSEC / 2) / (n * FN_TICK_NSEC);
+
+		if (ticks < 1) ticks = 1;
+		if (ticks > 255) ticks = 255;
+
+		int64_t got = fn_fade_duration(from, to, s, ticks);
+		int64_t err = llabs(got - duration);
+
+		if (best_err < 0 || err < best_err) {
+			*step = s;
+			*delay = ticks;
+			best = got;
+			best_err = err;
+		}
+
+		if (err <= slack) {
+			break;
+		}
+	}
+
+	return best;
+}
+
+/* keys: the colors to show (time, address, color) ordered by time
+ * fades: up to one frame per key (time to send, address, color, step, delay) */
+int fn_timeline_plan(const struct fn_scene_record *keys, size_t count, struct fn_scene_record *fades) {
+	struct {
+		uint8_t known;
+		uint32_t ready;			/* ms when the last frame has arrived */
+		struct rgb_color_t color;
+	} lamps[256];
+	size_t i;
+	int n = 0;
+
+	memset(lamps, 0, sizeof(lamps));
+
+	for (i = 0; i < count; i++) {
+		const struct fn_scene_record *key = &keys[i];
+		struct fn_scene_record *f = &fades[n];
+		int a = key->address;
+
+		memset(f, 0, sizeof(struct fn_scene_record));
+		f->address = a;
+		f->color = key->color;
+		f->step = 255;
+
+		if (lamps[a].known && memcmp(&lamps[a].color, &key->color, sizeof(struct rgb_color_t)) == 0) {
+			lamps[a].ready = key->time; /* holds its color */
+		}
+		else if (!lamps[a].known || key->time <= lamps[a].ready) {
+			/* we don't know where the lamp starts from or there is no time left */
+			f->time = key->time;
+			lamps[a].ready = key->time + FN_TICK_MSEC;
+			n++;
+		}
+		else {
+			/* leaves when the previous key has been reached, or later if even the slowest fade is faster */
+			int64_t wanted = (int64_t) (key->time - lamps[a].ready) * 1000000;
+			int64_t got = fn_timeline_fade(lamps[a].color, key->color, wanted, &f->step, &f->delay);
+
+			f->time = (got < wanted) ? key->time - got / 1000000 : lamps[a].ready;
+			lamps[a].ready = key->time;
+			n++;
+		}
+
+		lamps[a].known = 1;
+		lamps[a].color = key->color;
+	}
+
+	return n;
+}